@@ -0,0 +1,95 @@
+# Measures throughput, latency and allocations per operation for a few
+# commands, value sizes and thread counts. Runs against the stand-in server
+# in bench/fake_server.rb, so no Redis or network is needed.
+#
+#   ruby bench/bench.rb
+#
+# BENCH_OPS sets the number of operations per case (default 20000) and
+# BENCH_PORT the loopback port of the stand-in server (default 6399).
+
+require File.expand_path('../../ext/redis', __FILE__)
+require File.expand_path('../fake_server', __FILE__)
+
+OPS = (ENV['BENCH_OPS'] || 20_000).to_i
+PORT = (ENV['BENCH_PORT'] || 6399).to_i
+SERVER = "127.0.0.1:#{PORT}"
+
+def percentile(sorted, fraction)
+  sorted[((sorted.size - 1) * fraction).round]
+end
+
+def now
+  Process.clock_gettime(Process::CLOCK_MONOTONIC)
+end
+
+def measure(name, threads, ops = OPS)
+  redis = Redis.new(SERVER, :pool_size => threads)
+  yield redis, 0
+
+  per_thread = ops / threads
+  latencies = []
+  c_before = Redis.allocation_stats[:allocations]
+  ruby_before = GC.stat(:total_allocated_objects)
+  started = now
+
+  workers = (0...threads).map do
+    Thread.new do
+      times = Array.new(per_thread)
+      per_thread.times do |i|
+        t = now
+        yield redis, i
+        times[i] = now - t
+      end
+      times
+    end
+  end
+  workers.each { |worker| latencies.concat(worker.value) }
+
+  elapsed = now - started
+  ops = per_thread * threads
+  c_allocations = (Redis.allocation_stats[:allocations] - c_before).to_f / ops
+  ruby_allocations = (GC.stat(:total_allocated_objects) - ruby_before).to_f / ops
+  latencies.sort!
+
+  puts '%-22s %3d %9.0f %9.1f %9.1f %9.1f %9.2f %8.2f' % [
+    name, threads, ops / elapsed,
+    percentile(latencies, 0.5) * 1e6, percentile(latencies, 0.99) * 1e6, percentile(latencies, 0.999) * 1e6,
+    c_allocations, ruby_allocations
+  ]
+end
+
+pid = FakeServer.fork(PORT)
+begin
+  setup = Redis.new(SERVER)
+  begin
+    setup.flush_all
+  rescue RedisError
+    sleep 0.1
+    retry
+  end
+
+  puts '%-22s %3s %9s %9s %9s %9s %9s %8s' % %w(case thr ops/sec p50(us) p99(us) p999(us) malloc/op obj/op)
+
+  [1, 4, 16].each do |threads|
+    [16, 1024, 64 * 1024].each do |size|
+      value = 'x' * size
+      setup.set("get_#{size}", value)
+      measure("set #{size}b", threads) { |redis, i| redis.set("set_#{i}", value) }
+      measure("get #{size}b", threads) { |redis, i| redis.get("get_#{size}") }
+    end
+
+    large = 'x' * (1024 * 1024)
+    measure('set 1mb', threads, OPS / 20) { |redis, i| redis.set('large', large) }
+
+    keys = (0...100).map { |i| "mget_#{i}" }
+    keys.each { |key| setup.set(key, 'x' * 16) }
+    setup.del('list')
+    setup.rpush('list', *(['x' * 16] * 100))
+    measure('mget 100 keys', threads) { |redis, i| redis.mget(*keys) }
+    measure('lrange 100 elements', threads) { |redis, i| redis.lrange('list', 0, -1) }
+    measure('pipeline 100 gets', threads, OPS / 10) { |redis, i| redis.pipelined { |p| keys.each { |key| p.get(key) } } }
+  end
+ensure
+  Process.kill('TERM', pid)
+  Process.wait(pid)
+end
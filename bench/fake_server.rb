@@ -0,0 +1,107 @@
+# A stand-in for a Redis server, good enough to benchmark the extension
+# without a real one: it keeps strings and lists in memory and answers the
+# commands the benchmarks use. It speaks the inline, bulk and multibulk
+# request formats. Run it on its own with
+#
+#   ruby bench/fake_server.rb [port]
+
+require 'socket'
+
+class FakeServer
+  # Commands sent in the old bulk format, where the last argument is
+  # announced by its length on the command line.
+  BULK_COMMANDS = %w(SET GETSET SETNX RPUSH LPUSH SADD)
+
+  def self.fork(port)
+    server = new(port)
+    pid = Process.fork do
+      trap('TERM') { exit! }
+      server.run
+    end
+    server.close
+    pid
+  end
+
+  def initialize(port)
+    @socket = TCPServer.new('127.0.0.1', port)
+    @data = {}
+    @lock = Mutex.new
+  end
+
+  def run
+    loop do
+      client = @socket.accept
+      client.setsockopt(Socket::IPPROTO_TCP, Socket::TCP_NODELAY, 1)
+      Thread.new(client) { |io| serve(io) }
+    end
+  end
+
+  def close
+    @socket.close
+  end
+
+  private
+
+  def serve(io)
+    while (args = read_command(io))
+      reply = begin
+        @lock.synchronize { execute(args) }
+      rescue => e
+        e
+      end
+      io.write(encode(reply))
+    end
+  rescue IOError, SystemCallError
+  ensure
+    io.close
+  end
+
+  def read_command(io)
+    line = io.gets("\r\n") or return nil
+    line.chomp!("\r\n")
+    if line.start_with?('*')
+      Array.new(line[1..-1].to_i) { read_bulk(io, io.gets("\r\n")[1..-1].to_i) }
+    else
+      args = line.split(' ')
+      args << read_bulk(io, args.pop.to_i) if BULK_COMMANDS.include?(args.first.to_s.upcase)
+      args
+    end
+  end
+
+  def read_bulk(io, length)
+    io.read(length + 2)[0, length]
+  end
+
+  def execute(args)
+    key = args[1]
+    case args[0].upcase
+    when 'PING' then :PONG
+    when 'FLUSHALL', 'FLUSHDB' then @data.clear; :OK
+    when 'DBSIZE' then @data.size
+    when 'SET' then @data[key] = args[2]; :OK
+    when 'GET' then @data[key]
+    when 'MSET' then args[1..-1].each_slice(2) { |k, v| @data[k] = v }; :OK
+    when 'MGET' then args[1..-1].map { |k| @data[k] }
+    when 'DEL' then args[1..-1].count { |k| @data.delete(k) }
+    when 'INCR' then @data[key] = (@data[key].to_i + 1).to_s; @data[key].to_i
+    when 'RPUSH' then (@data[key] ||= []).concat(args[2..-1]).size
+    when 'LRANGE' then (@data[key] || [])[args[2].to_i..args[3].to_i] || []
+    else raise "ERR unknown command '#{args[0]}'"
+    end
+  end
+
+  def encode(reply)
+    case reply
+    when nil then "$-1\r\n"
+    when Symbol then "+#{reply}\r\n"
+    when Integer then ":#{reply}\r\n"
+    when Array then "*#{reply.size}\r\n" + reply.map { |element| encode(element) }.join
+    when StandardError then "-#{reply.message}\r\n"
+    else "$#{reply.bytesize}\r\n#{reply}\r\n"
+    end
+  end
+end
+
+if $0 == __FILE__
+  FakeServer.new((ARGV[0] || 6379).to_i).run
+end
@@ -0,0 +1,114 @@
+/* The command table. Each line expands to an entry of command_table, and
+   COMMAND lines also to the method that sends the command; CUSTOM_COMMAND
+   lines have a method written by hand instead.
+
+   The arguments are one letter each: k for a key, v for a value, i for an
+   integer and f for a score, which may be a Float, an Integer or a string
+   such as "-inf". A trailing * repeats the last letter any number of times.
+   A command whose first argument is a key is sent to the node that owns
+   it, and all of its keys must live on that node. Any other command goes
+   to every node.
+
+   The values of commands flagged CODEC go through the codec of the
+   instance, if it has one, and their replies are decoded. */
+
+/*      NAME                method              Ruby name           arguments   reply           flags */
+
+COMMAND(PING,               ping,               "ping",             "",         ANY,            READ_ONLY)
+COMMAND(ECHO,               echo,               "echo",             "v",        ANY,            READ_ONLY)
+COMMAND(QUIT,               quit,               "quit",             "",         ANY,            0)
+CUSTOM_COMMAND(AUTH,        auth,               "auth",             "v",        ANY,            0)
+COMMAND(INFO,               info,               "info",             "",         ANY,            READ_ONLY)
+COMMAND(SAVE,               save,               "save",             "",         STATUS,         0)
+COMMAND(BGSAVE,             bgsave,             "bgsave",           "",         STATUS,         0)
+COMMAND(LASTSAVE,           lastsave,           "lastsave",         "",         ANY,            READ_ONLY)
+COMMAND(PUBLISH,            publish,            "publish",          "kv",       ANY,            0)
+
+COMMAND(EXISTS,             exists,             "exists?",          "k",        BOOLEAN,        READ_ONLY)
+CUSTOM_COMMAND(DEL,         del,                "del",              "k*",       ANY,            0)
+COMMAND(TYPE,               type,               "type",             "k",        ANY,            READ_ONLY)
+COMMAND(KEYS,               keys,               "keys",             "v",        return_keys,    READ_ONLY)
+COMMAND(RANDOMKEY,          random_key,         "random_key",       "",         ANY,            READ_ONLY)
+COMMAND(RENAME,             rename,             "rename",           "kk",       STATUS,         0)
+COMMAND(RENAMENX,           renamenx,           "renamenx",         "kk",       STATUS,         0)
+COMMAND(DBSIZE,             dbsize,             "dbsize",           "",         ANY,            READ_ONLY)
+COMMAND(EXPIRE,             expire,             "expire",           "ki",       ANY,            0)
+COMMAND(EXPIREAT,           expire_at,          "expire_at",        "ki",       ANY,            0)
+COMMAND(PERSIST,            persist,            "persist",          "k",        BOOLEAN,        0)
+COMMAND(TTL,                ttl,                "ttl",              "k",        ANY,            READ_ONLY)
+CUSTOM_COMMAND(SELECT,      select,             "select",           "i",        ANY,            0)
+COMMAND(MOVE,               move,               "move",             "ki",       STATUS,         0)
+COMMAND(FLUSHDB,            flush_db,           "flush_db",         "",         STATUS,         0)
+COMMAND(FLUSHALL,           flush_all,          "flush_all",        "",         STATUS,         0)
+
+COMMAND(SET,                set,                "set",              "kv",       ANY,            CODEC)
+COMMAND(SETEX,              setex,              "setex",            "kiv",      STATUS,         CODEC)
+CUSTOM_COMMAND(GET,         get,                "get",              "k",        DECODED,        READ_ONLY | CODEC)
+CUSTOM_COMMAND(MGET,        mget,               "mget",             "k*",       DECODED,        READ_ONLY | CODEC)
+CUSTOM_COMMAND(MSET,        mset,               "mset",             "v",        STATUS,         CODEC)
+COMMAND(GETSET,             get_set,            "getset",           "kv",       DECODED,        CODEC)
+COMMAND(SETNX,              setnx,              "setnx",            "kv",       ANY,            CODEC)
+COMMAND(APPEND,             append,             "append",           "kv",       ANY,            0)
+COMMAND(STRLEN,             strlen,             "strlen",           "k",        ANY,            READ_ONLY)
+COMMAND(GETRANGE,           getrange,           "getrange",         "kii",      ANY,            READ_ONLY)
+COMMAND(INCR,               incr,               "incr",             "k",        ANY,            0)
+COMMAND(INCRBY,             incrby,             "incrby",           "ki",       ANY,            0)
+COMMAND(DECR,               decr,               "decr",             "k",        ANY,            0)
+COMMAND(DECRBY,             decrby,             "decrby",           "ki",       ANY,            0)
+COMMAND(INCRBYFLOAT,        incrbyfloat,        "incrbyfloat",      "kf",       DOUBLE,         0)
+
+COMMAND(RPUSH,              rpush,              "rpush",            "kv*",      ANY,            0)
+COMMAND(LPUSH,              lpush,              "lpush",            "kv*",      ANY,            0)
+COMMAND(RPUSHX,             rpushx,             "rpushx",           "kv",       ANY,            0)
+COMMAND(LPUSHX,             lpushx,             "lpushx",           "kv",       ANY,            0)
+COMMAND(LLEN,               llen,               "llen",             "k",        ANY,            READ_ONLY)
+COMMAND(LRANGE,             lrange,             "lrange",           "kii",      ANY,            READ_ONLY)
+COMMAND(LTRIM,              ltrim,              "ltrim",            "kii",      ANY,            0)
+COMMAND(LINDEX,             lindex,             "lindex",           "ki",       ANY,            READ_ONLY)
+COMMAND(LSET,               lset,               "lset",             "kiv",      ANY,            0)
+COMMAND(LREM,               lrem,               "lrem",             "kiv",      ANY,            0)
+COMMAND(LPOP,               lpop,               "lpop",             "k",        ANY,            0)
+COMMAND(RPOP,               rpop,               "rpop",             "k",        ANY,            0)
+COMMAND(RPOPLPUSH,          rpoplpush,          "rpoplpush",        "kk",       ANY,            0)
+
+COMMAND(SADD,               sadd,               "sadd",             "kv*",      ANY,            0)
+COMMAND(SREM,               srem,               "srem",             "kv*",      ANY,            0)
+COMMAND(SPOP,               spop,               "spop",             "k",        ANY,            0)
+COMMAND(SMOVE,              smove,              "smove",            "kkv",      ANY,            0)
+COMMAND(SCARD,              scard,              "scard",            "k",        ANY,            READ_ONLY)
+COMMAND(SISMEMBER,          sismember,          "sismember",        "kv",       BOOLEAN,        READ_ONLY)
+COMMAND(SINTER,             sinter,             "sinter",           "k*",       ANY,            READ_ONLY)
+COMMAND(SINTERSTORE,        sinterstore,        "sinterstore",      "kk*",      ANY,            0)
+COMMAND(SUNION,             sunion,             "sunion",           "k*",       ANY,            READ_ONLY)
+COMMAND(SUNIONSTORE,        sunionstore,        "sunionstore",      "kk*",      ANY,            0)
+COMMAND(SDIFF,              sdiff,              "sdiff",            "k*",       ANY,            READ_ONLY)
+COMMAND(SDIFFSTORE,         sdiffstore,         "sdiffstore",       "kk*",      ANY,            0)
+COMMAND(SRANDMEMBER,        srandmember,        "srandmember",      "k",        ANY,            READ_ONLY)
+COMMAND(SMEMBERS,           smembers,           "smembers",         "k",        ANY,            READ_ONLY)
+
+COMMAND(ZADD,               zadd,               "zadd",             "kfv",      ANY,            0)
+COMMAND(ZREM,               zrem,               "zrem",             "kv",       ANY,            0)
+COMMAND(ZINCRBY,            zincrby,            "zincrby",          "kfv",      DOUBLE,         0)
+COMMAND(ZRANK,              zrank,              "zrank",            "kv",       ANY,            READ_ONLY)
+COMMAND(ZREVRANK,           zrevrank,           "zrevrank",         "kv",       ANY,            READ_ONLY)
+COMMAND(ZCARD,              zcard,              "zcard",            "k",        ANY,            READ_ONLY)
+COMMAND(ZCOUNT,             zcount,             "zcount",           "kff",      ANY,            READ_ONLY)
+COMMAND(ZSCORE,             zscore,             "zscore",           "kv",       DOUBLE,         READ_ONLY)
+COMMAND(ZRANGE,             zrange,             "zrange",           "kii",      ANY,            READ_ONLY)
+COMMAND(ZREVRANGE,          zrevrange,          "zrevrange",        "kii",      ANY,            READ_ONLY)
+COMMAND(ZRANGEBYSCORE,      zrangebyscore,      "zrangebyscore",    "kff",      ANY,            READ_ONLY)
+COMMAND(ZREMRANGEBYRANK,    zremrangebyrank,    "zremrangebyrank",  "kii",      ANY,            0)
+COMMAND(ZREMRANGEBYSCORE,   zremrangebyscore,   "zremrangebyscore", "kff",      ANY,            0)
+
+COMMAND(HSET,               hset,               "hset",             "kvv",      ANY,            0)
+COMMAND(HSETNX,             hsetnx,             "hsetnx",           "kvv",      BOOLEAN,        0)
+COMMAND(HGET,               hget,               "hget",             "kv",       ANY,            READ_ONLY)
+COMMAND(HMGET,              hmget,              "hmget",            "kv*",      ANY,            READ_ONLY)
+COMMAND(HDEL,               hdel,               "hdel",             "kv*",      ANY,            0)
+COMMAND(HEXISTS,            hexists,            "hexists",          "kv",       BOOLEAN,        READ_ONLY)
+COMMAND(HINCRBY,            hincrby,            "hincrby",          "kvi",      ANY,            0)
+COMMAND(HINCRBYFLOAT,       hincrbyfloat,       "hincrbyfloat",     "kvf",      DOUBLE,         0)
+COMMAND(HLEN,               hlen,               "hlen",             "k",        ANY,            READ_ONLY)
+COMMAND(HKEYS,              hkeys,              "hkeys",            "k",        ANY,            READ_ONLY)
+COMMAND(HVALS,              hvals,              "hvals",            "k",        ANY,            READ_ONLY)
+COMMAND(HGETALL,            hgetall,            "hgetall",          "k",        return_hash,    READ_ONLY)
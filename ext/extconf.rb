@@ -2,11 +2,23 @@ require 'mkmf'
 
 success = true
 
-if !have_library('redis', 'Module_new') && !find_library('redis', 'Module_new', './lib')
-  puts 'libredis is missing!'
+# libredis is compiled along with the extension, from the sources in libredis/
+$VPATH << '$(srcdir)/libredis'
+$srcs = ['redis.c'] + Dir[File.join($srcdir, 'libredis', '*.c')].map { |path| File.basename(path) }.sort
+
+if !have_header('poll.h') || !have_header('sys/un.h')
+  puts 'libredis needs poll() and unix sockets'
   success = false
 end
 
+if have_header('ruby/thread.h')
+  have_func('rb_thread_call_without_gvl', 'ruby/thread.h')
+  have_func('rb_thread_call_without_gvl2', 'ruby/thread.h')
+end
+have_func('rb_gc_adjust_memory_usage')
+have_func('compress2', 'zlib.h') if have_library('z', 'compress2', 'zlib.h')
+have_library('m', 'floorf')
+
 if success
   create_makefile 'redis'
 else
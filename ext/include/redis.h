@@ -104,6 +104,7 @@ void Module_free(Module *module);
 /**
  * Create a new connection to a Redis instance. addr should be of form 'xxx.xxx.xxx.xxx:y' where xxx is an ip-address and y is the port
  * to connect to. if the port is not given the default Redis port of 6379 will be used.
+ * A Unix domain socket is given by its path, as '/tmp/redis.sock', 'unix:/tmp/redis.sock' or 'unix:///tmp/redis.sock'.
  * Note that the actual connection will not be made at this point. It will open the connection as soon as the first command
  * will be written to Redis.
  */
@@ -114,6 +115,17 @@ Connection *Connection_new(const char *addr);
  */
 void Connection_free(Connection *connection);
 
+/**
+ * Socket options, used whenever the connection (re)connects. A connect that takes longer than timeout_ms fails even if
+ * the timeout of the execute is not up yet; 0, the default, leaves it to that timeout.
+ * TCP_NODELAY is on by default, SO_KEEPALIVE off. Buffer sizes of 0, the default, leave those of the system.
+ * Nodelay and keepalive do not apply to Unix domain sockets.
+ */
+void Connection_set_connect_timeout(Connection *connection, int timeout_ms);
+void Connection_set_nodelay(Connection *connection, int nodelay);
+void Connection_set_keepalive(Connection *connection, int keepalive);
+void Connection_set_buffer_sizes(Connection *connection, int send_buffer, int receive_buffer);
+
 /**
  * Enumerates the type of replies that can be read from a Batch.
  */
@@ -195,7 +207,8 @@ int Executor_add(Executor *executor, Connection *connection, Batch *batch);
  * will be gathered in their respective batches.
  * When all batches complete within the timeout, the result of this function is 1.
  * If a timeout occurs before completion. the result of this function is 0, and all commands in all batches that
- * were not completed at the time of timeout will get an error reply.
+ * were not completed at the time of timeout will get an error reply. The same goes for a connection that fails.
+ * Batch_error tells which batches were aborted: one without an error got all its replies.
  * If there is an error with this method itself, it will return -1.
  */
 int Executor_execute(Executor *executor, int timeout_ms);
@@ -237,7 +250,8 @@ void Ketama_free(Ketama *ketama);
 /**
  * Add a server to the hash-ring. This must be called (repeatedly) BEFORE calling Ketama_create_continuum.
  * Address must be an IP-address of a server as a dotted string e.g. 127.0.0.1, 192.168.1.10 etc etc. port is the servers port number
- * The weight is the relative weight of this server in the ring.
+ * The weight is the relative weight of this server in the ring. The server is hashed as "address:port", so any other
+ * string that is unique to the server, like the path of a Unix domain socket with port 0, works as well.
  */
 void Ketama_add_server(Ketama *ketama, const char *addr, int port, unsigned long weight);
 
@@ -0,0 +1,278 @@
+/* Batches: the commands written for one connection, and the replies read
+   back for them. Replies are parsed as they come in; the elements of a
+   multibulk reply follow it one level deeper. */
+
+#include <stdio.h>
+#include <string.h>
+#include "common.h"
+
+#define READ_CHUNK_SIZE (16 * 1024)
+
+typedef struct {
+    ReplyType type;
+    int level;
+    size_t offset;              /* of the data in the read buffer */
+    size_t length;              /* or the element count of a multibulk */
+} BatchReply;
+
+struct _Batch {
+    char * write_buffer;
+    size_t write_length;
+    size_t write_capacity;
+    size_t sent;
+    int num_commands;
+
+    char * read_buffer;
+    size_t read_length;
+    size_t read_capacity;
+    size_t parsed;
+
+    BatchReply * replies;
+    size_t reply_count;
+    size_t reply_capacity;
+    size_t next_reply;
+    int complete;               /* replies parsed to the end */
+    size_t reply_start;         /* of the one being parsed, in replies */
+    long * pending;             /* elements left of each multibulk being parsed */
+    int depth;
+    int pending_capacity;
+
+    char * error;
+};
+
+Batch * Batch_new() {
+    Batch * batch = Module_alloc(sizeof(Batch));
+
+    memset(batch, 0, sizeof(Batch));
+    return batch;
+}
+
+void Batch_free(Batch * batch) {
+    if(!batch)
+        return;
+    Module_release(batch->write_buffer);
+    Module_release(batch->read_buffer);
+    Module_release(batch->replies);
+    Module_release(batch->pending);
+    Module_release(batch->error);
+    Module_release(batch);
+}
+
+void Batch_write(Batch * batch, const char * str, size_t str_len, int num_commands) {
+    if(str && str_len) {
+        if(batch->write_length + str_len > batch->write_capacity) {
+            batch->write_capacity = batch->write_capacity ? batch->write_capacity * 2 : 256;
+            if(batch->write_capacity < batch->write_length + str_len)
+                batch->write_capacity = batch->write_length + str_len;
+            batch->write_buffer = Module_realloc(batch->write_buffer, batch->write_capacity);
+        }
+        memcpy(batch->write_buffer + batch->write_length, str, str_len);
+        batch->write_length += str_len;
+    }
+    batch->num_commands += num_commands;
+}
+
+void Batch_write_decimal(Batch * batch, long decimal) {
+    char digits[32];
+
+    Batch_write(batch, digits, snprintf(digits, sizeof(digits), "%ld", decimal), 0);
+}
+
+int Batch_next_reply(Batch * batch, ReplyType * reply_type, char ** data, size_t * len) {
+    BatchReply * reply;
+
+    if(batch->next_reply >= batch->reply_count) {
+        *reply_type = RT_NONE;
+        *data = NULL;
+        *len = 0;
+        return 0;
+    }
+    reply = &(batch->replies[batch->next_reply++]);
+    *reply_type = reply->type;
+    *data = batch->read_buffer + reply->offset;
+    *len = reply->length;
+    return reply->level;
+}
+
+char * Batch_error(Batch * batch) {
+    return batch->error;
+}
+
+/* Forgets any replies of an earlier round trip */
+void Batch_prepare(Batch * batch) {
+    batch->sent = 0;
+    batch->read_length = 0;
+    batch->parsed = 0;
+    batch->reply_count = 0;
+    batch->next_reply = 0;
+    batch->complete = 0;
+    batch->reply_start = 0;
+    batch->depth = 0;
+    Module_release(batch->error);
+    batch->error = NULL;
+}
+
+int Batch_complete(Batch * batch) {
+    return batch->complete >= batch->num_commands;
+}
+
+size_t Batch_unsent(Batch * batch, const char ** data) {
+    *data = batch->write_buffer + batch->sent;
+    return batch->write_length - batch->sent;
+}
+
+void Batch_sent(Batch * batch, size_t length) {
+    batch->sent += length;
+}
+
+static void Batch_reserve(Batch * batch, size_t length) {
+    if(batch->read_length + length <= batch->read_capacity)
+        return;
+    batch->read_capacity = batch->read_capacity ? batch->read_capacity * 2 : READ_CHUNK_SIZE * 4;
+    if(batch->read_capacity < batch->read_length + length)
+        batch->read_capacity = batch->read_length + length;
+    batch->read_buffer = Module_realloc(batch->read_buffer, batch->read_capacity);
+}
+
+/* Where the next bytes read go */
+char * Batch_read_space(Batch * batch, size_t * size) {
+    Batch_reserve(batch, READ_CHUNK_SIZE);
+    *size = batch->read_capacity - batch->read_length;
+    return batch->read_buffer + batch->read_length;
+}
+
+static void Batch_add_reply(Batch * batch, ReplyType type, size_t offset, size_t length) {
+    BatchReply * reply;
+
+    if(batch->reply_count == batch->reply_capacity) {
+        batch->reply_capacity = batch->reply_capacity ? batch->reply_capacity * 2 : 16;
+        batch->replies = Module_realloc(batch->replies, batch->reply_capacity * sizeof(BatchReply));
+    }
+    reply = &(batch->replies[batch->reply_count++]);
+    reply->type = type;
+    reply->level = batch->depth + 1;
+    reply->offset = offset;
+    reply->length = length;
+}
+
+/* Counts a reply or element as parsed, along with every multibulk it was
+   the last element of */
+static void Batch_element_done(Batch * batch) {
+    while(batch->depth > 0) {
+        if(--batch->pending[batch->depth - 1] > 0)
+            return;
+        batch->depth--;
+    }
+    batch->complete++;
+    batch->reply_start = batch->reply_count;
+}
+
+static int parse_long(const char * data, const char * end, long * value) {
+    int negative = 0;
+
+    *value = 0;
+    if(data < end && *data == '-') {
+        negative = 1;
+        data++;
+    }
+    if(data == end)
+        return -1;
+    for(; data < end; data++) {
+        if(*data < '0' || *data > '9')
+            return -1;
+        *value = *value * 10 + (*data - '0');
+    }
+    if(negative)
+        *value = -*value;
+    return 0;
+}
+
+/* Parses what came in so far. Returns -1 on a protocol error. */
+static int Batch_parse(Batch * batch) {
+    char * line, * end;
+    size_t available, header;
+    long value;
+
+    while(!Batch_complete(batch)) {
+        line = batch->read_buffer + batch->parsed;
+        available = batch->read_length - batch->parsed;
+        end = available > 1 ? memchr(line, '\r', available - 1) : NULL;
+        if(!end)
+            return 0;
+        if(end[1] != '\n')
+            return -1;
+        header = end - line + 2;
+
+        switch(line[0]) {
+        case '+':
+        case '-':
+        case ':':
+            Batch_add_reply(batch, line[0] == '+' ? RT_OK : line[0] == '-' ? RT_ERROR : RT_INTEGER,
+                            batch->parsed + 1, end - line - 1);
+            batch->parsed += header;
+            break;
+        case '$':
+            if(parse_long(line + 1, end, &value))
+                return -1;
+            if(value < 0) {
+                Batch_add_reply(batch, RT_BULK_NIL, batch->parsed, 0);
+                batch->parsed += header;
+                break;
+            }
+            if(available < header + value + 2) {
+                Batch_reserve(batch, header + value + 2 - available);
+                return 0;
+            }
+            Batch_add_reply(batch, RT_BULK, batch->parsed + header, value);
+            batch->parsed += header + value + 2;
+            break;
+        case '*':
+            if(parse_long(line + 1, end, &value))
+                return -1;
+            Batch_add_reply(batch, value < 0 ? RT_MULTIBULK_NIL : RT_MULTIBULK, batch->parsed, value < 0 ? 0 : value);
+            batch->parsed += header;
+            if(value > 0) {
+                if(batch->depth == batch->pending_capacity) {
+                    batch->pending_capacity = batch->pending_capacity ? batch->pending_capacity * 2 : 4;
+                    batch->pending = Module_realloc(batch->pending, batch->pending_capacity * sizeof(long));
+                }
+                batch->pending[batch->depth++] = value;
+                continue;
+            }
+            break;
+        default:
+            return -1;
+        }
+        Batch_element_done(batch);
+    }
+    return 0;
+}
+
+/* Takes in bytes read into the read space. Returns -1 on a protocol error. */
+int Batch_received(Batch * batch, size_t length) {
+    batch->read_length += length;
+    return Batch_parse(batch);
+}
+
+/* Gives every command without a complete reply an error reply. A reply
+   that was only partly read is dropped. */
+void Batch_abort(Batch * batch, const char * error) {
+    size_t offset, length = strlen(error);
+
+    if(!batch->error)
+        batch->error = Module_strdup(error);
+    batch->reply_count = batch->reply_start;
+    batch->depth = 0;
+
+    Batch_reserve(batch, length);
+    offset = batch->read_length;
+    memcpy(batch->read_buffer + offset, error, length);
+    batch->read_length += length;
+    batch->parsed = batch->read_length;
+
+    while(!Batch_complete(batch)) {
+        Batch_add_reply(batch, RT_ERROR, offset, length);
+        batch->complete++;
+    }
+    batch->reply_start = batch->reply_count;
+}
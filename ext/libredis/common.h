@@ -0,0 +1,53 @@
+/* Internals shared by the sources of libredis. The API is in
+   include/redis.h; what is here is only used between its parts. */
+#ifndef LIBREDIS_COMMON_H
+#define LIBREDIS_COMMON_H
+
+#include <stddef.h>
+#include "../include/redis.h"
+
+/* Memory, through the functions set on the module, and counted */
+void * Module_alloc(size_t size);
+void * Module_realloc(void * ptr, size_t size);
+void Module_release(void * ptr);
+char * Module_strdup(const char * string);
+
+/* Sets what Module_last_error returns in the calling thread */
+void Module_set_error(const char * format, ...);
+
+struct _Connection {
+    char * address;             /* as given, for error messages */
+    char * host;                /* NULL for a unix socket */
+    char * port;
+    char * path;                /* of a unix socket, NULL for TCP */
+    int fd;                     /* -1 until connected */
+    int connect_timeout;        /* milliseconds, 0 for that of the round trip */
+    int nodelay;
+    int keepalive;
+    int send_buffer;            /* bytes, 0 for the default of the system */
+    int receive_buffer;
+};
+
+/* Starts connecting without blocking. Returns 0 once connected, 1 while
+   the connection is in progress and -1 if it failed. */
+int Connection_connect(Connection * connection);
+
+/* Returns 0 when a connection that was in progress went through, or the
+   error it failed with */
+int Connection_connect_error(Connection * connection);
+
+void Connection_close(Connection * connection);
+
+/* Called by the executor around a round trip */
+void Batch_prepare(Batch * batch);
+int Batch_complete(Batch * batch);
+size_t Batch_unsent(Batch * batch, const char ** data);
+void Batch_sent(Batch * batch, size_t length);
+char * Batch_read_space(Batch * batch, size_t * size);
+int Batch_received(Batch * batch, size_t length);
+void Batch_abort(Batch * batch, const char * error);
+
+/* RFC 1321 */
+void md5_digest(const char * data, size_t length, unsigned char digest[16]);
+
+#endif
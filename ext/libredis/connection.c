@@ -0,0 +1,170 @@
+/* Connections to a server, over TCP or a unix socket. They connect
+   without blocking, once the executor first needs them. */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "common.h"
+
+#define DEFAULT_PORT "6379"
+
+/* "unix:/path", "unix:///path" and "/path" are unix sockets, anything else
+   "host:port" or just "host" */
+Connection * Connection_new(const char * addr) {
+    Connection * connection = Module_alloc(sizeof(Connection));
+    const char * colon;
+
+    memset(connection, 0, sizeof(Connection));
+    connection->address = Module_strdup(addr);
+    connection->fd = -1;
+    connection->nodelay = 1;
+
+    if(!strncmp(addr, "unix:", 5) || addr[0] == '/') {
+        if(!strncmp(addr, "unix:", 5))
+            addr += 5;
+        if(!strncmp(addr, "//", 2))
+            addr += 2;
+        connection->path = Module_strdup(addr);
+        return connection;
+    }
+
+    colon = strrchr(addr, ':');
+    if(colon) {
+        connection->host = Module_alloc(colon - addr + 1);
+        memcpy(connection->host, addr, colon - addr);
+        connection->host[colon - addr] = '\0';
+        connection->port = Module_strdup(colon + 1);
+    } else {
+        connection->host = Module_strdup(addr);
+        connection->port = Module_strdup(DEFAULT_PORT);
+    }
+    return connection;
+}
+
+void Connection_free(Connection * connection) {
+    if(!connection)
+        return;
+    Connection_close(connection);
+    Module_release(connection->address);
+    Module_release(connection->host);
+    Module_release(connection->port);
+    Module_release(connection->path);
+    Module_release(connection);
+}
+
+void Connection_set_connect_timeout(Connection * connection, int timeout_ms) {
+    connection->connect_timeout = timeout_ms;
+}
+
+void Connection_set_nodelay(Connection * connection, int nodelay) {
+    connection->nodelay = nodelay;
+}
+
+void Connection_set_keepalive(Connection * connection, int keepalive) {
+    connection->keepalive = keepalive;
+}
+
+void Connection_set_buffer_sizes(Connection * connection, int send_buffer, int receive_buffer) {
+    connection->send_buffer = send_buffer;
+    connection->receive_buffer = receive_buffer;
+}
+
+/* Buffer sizes are set before connecting, so TCP can scale its window */
+static void Connection_set_options(Connection * connection, int fd) {
+    int one = 1;
+
+    if(connection->send_buffer > 0)
+        setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &(connection->send_buffer), sizeof(int));
+    if(connection->receive_buffer > 0)
+        setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &(connection->receive_buffer), sizeof(int));
+    if(connection->path)
+        return;
+    if(connection->nodelay)
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if(connection->keepalive)
+        setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &one, sizeof(one));
+#ifdef SO_NOSIGPIPE
+    setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof(one));
+#endif
+}
+
+/* A unix socket with a full backlog fails with EAGAIN rather than waiting */
+static int Connection_start(Connection * connection, int family, const struct sockaddr * address, socklen_t length) {
+    int fd = socket(family, SOCK_STREAM, 0), error;
+
+    if(fd < 0)
+        return -1;
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    Connection_set_options(connection, fd);
+    connection->fd = fd;
+    if(connect(fd, address, length) == 0)
+        return 0;
+    if(errno == EINPROGRESS)
+        return 1;
+    error = errno;
+    Connection_close(connection);
+    errno = error;
+    return -1;
+}
+
+int Connection_connect(Connection * connection) {
+    struct addrinfo hints, * addresses, * address;
+    struct sockaddr_un unix_address;
+    int result = -1, error;
+
+    if(connection->fd >= 0)
+        return 0;
+
+    if(connection->path) {
+        if(strlen(connection->path) >= sizeof(unix_address.sun_path)) {
+            Module_set_error("Could not connect to %s: path too long", connection->address);
+            return -1;
+        }
+        memset(&unix_address, 0, sizeof(unix_address));
+        unix_address.sun_family = AF_UNIX;
+        strcpy(unix_address.sun_path, connection->path);
+        result = Connection_start(connection, AF_UNIX, (struct sockaddr *) &unix_address, sizeof(unix_address));
+        if(result < 0)
+            Module_set_error("Could not connect to %s: %s", connection->address, strerror(errno));
+        return result;
+    }
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if((error = getaddrinfo(connection->host, connection->port, &hints, &addresses))) {
+        Module_set_error("Could not resolve %s: %s", connection->address, gai_strerror(error));
+        return -1;
+    }
+    for(address = addresses; address && result < 0; address = address->ai_next)
+        result = Connection_start(connection, address->ai_family, address->ai_addr, address->ai_addrlen);
+    if(result < 0)
+        Module_set_error("Could not connect to %s: %s", connection->address, strerror(errno));
+    freeaddrinfo(addresses);
+    return result;
+}
+
+int Connection_connect_error(Connection * connection) {
+    int error = 0;
+    socklen_t length = sizeof(error);
+
+    if(getsockopt(connection->fd, SOL_SOCKET, SO_ERROR, &error, &length) < 0)
+        return errno;
+    return error;
+}
+
+void Connection_close(Connection * connection) {
+    if(connection->fd < 0)
+        return;
+    close(connection->fd);
+    connection->fd = -1;
+}
@@ -0,0 +1,216 @@
+/* The executor: sends the batches to their connections and reads back
+   the replies, all at once, polling every socket until each batch is
+   complete or the timeout is up. */
+
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+#include <time.h>
+#include <sys/socket.h>
+#include "common.h"
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+#define PAIR_CONNECTING 1
+#define PAIR_RUNNING 2
+#define PAIR_DONE 3
+
+typedef struct {
+    Connection * connection;
+    Batch * batch;
+    int state;
+    long long connect_deadline;     /* milliseconds, 0 for none */
+} Pair;
+
+struct _Executor {
+    Pair * pairs;
+    int count;
+    int capacity;
+};
+
+static long long now_milliseconds() {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000LL + now.tv_nsec / 1000000;
+}
+
+Executor * Executor_new() {
+    Executor * executor = Module_alloc(sizeof(Executor));
+
+    memset(executor, 0, sizeof(Executor));
+    return executor;
+}
+
+void Executor_free(Executor * executor) {
+    if(!executor)
+        return;
+    Module_release(executor->pairs);
+    Module_release(executor);
+}
+
+int Executor_add(Executor * executor, Connection * connection, Batch * batch) {
+    Pair * pairs;
+
+    if(!connection || !batch) {
+        Module_set_error("Executor_add needs a connection and a batch");
+        return -1;
+    }
+    if(executor->count == executor->capacity) {
+        pairs = Module_realloc(executor->pairs, (executor->capacity ? executor->capacity * 2 : 4) * sizeof(Pair));
+        if(!pairs) {
+            Module_set_error("Out of memory");
+            return -1;
+        }
+        executor->pairs = pairs;
+        executor->capacity = executor->capacity ? executor->capacity * 2 : 4;
+    }
+    executor->pairs[executor->count].connection = connection;
+    executor->pairs[executor->count].batch = batch;
+    executor->count++;
+    return 0;
+}
+
+/* Gives up on a pair. Replies may still be on their way, so its
+   connection is closed and connects again when next used. */
+static void Pair_abort(Pair * pair, const char * error) {
+    Module_set_error("%s: %s", pair->connection->address, error);
+    Batch_abort(pair->batch, Module_last_error(NULL));
+    Connection_close(pair->connection);
+    pair->state = PAIR_DONE;
+}
+
+static void Pair_start(Pair * pair, long long now) {
+    int result;
+
+    Batch_prepare(pair->batch);
+    if(Batch_complete(pair->batch)) {
+        pair->state = PAIR_DONE;
+        return;
+    }
+    result = Connection_connect(pair->connection);
+    if(result < 0) {
+        Batch_abort(pair->batch, Module_last_error(NULL));
+        pair->state = PAIR_DONE;
+        return;
+    }
+    pair->state = result ? PAIR_CONNECTING : PAIR_RUNNING;
+    pair->connect_deadline = result && pair->connection->connect_timeout > 0 ? now + pair->connection->connect_timeout : 0;
+}
+
+static void Pair_write(Pair * pair) {
+    const char * data;
+    size_t length = Batch_unsent(pair->batch, &data);
+    ssize_t written = send(pair->connection->fd, data, length, MSG_NOSIGNAL);
+
+    if(written >= 0)
+        Batch_sent(pair->batch, written);
+    else if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+        Pair_abort(pair, strerror(errno));
+}
+
+static void Pair_read(Pair * pair) {
+    size_t size;
+    char * space = Batch_read_space(pair->batch, &size);
+    ssize_t length = recv(pair->connection->fd, space, size, 0);
+
+    if(length == 0)
+        Pair_abort(pair, "Connection closed by the server");
+    else if(length < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+        Pair_abort(pair, strerror(errno));
+    else if(length > 0 && Batch_received(pair->batch, length) < 0)
+        Pair_abort(pair, "Protocol error");
+    else if(Batch_complete(pair->batch))
+        pair->state = PAIR_DONE;
+}
+
+static void Pair_handle(Pair * pair, short events) {
+    int error;
+
+    if(pair->state == PAIR_CONNECTING) {
+        if((error = Connection_connect_error(pair->connection))) {
+            Pair_abort(pair, strerror(error));
+            return;
+        }
+        pair->state = PAIR_RUNNING;
+        pair->connect_deadline = 0;
+        return;
+    }
+    if(events & POLLOUT)
+        Pair_write(pair);
+    if(pair->state == PAIR_RUNNING && (events & (POLLIN | POLLERR | POLLHUP)))
+        Pair_read(pair);
+}
+
+int Executor_execute(Executor * executor, int timeout_ms) {
+    long long now = now_milliseconds(), deadline = now + timeout_ms, wait;
+    struct pollfd * fds = Module_alloc((executor->count + 1) * sizeof(struct pollfd));
+    int * polled = Module_alloc((executor->count + 1) * sizeof(int));
+    const char * data;
+    int i, count, ready, error, result = 1;
+    Pair * pair;
+
+    if(!fds || !polled) {
+        Module_release(fds);
+        Module_release(polled);
+        Module_set_error("Out of memory");
+        return -1;
+    }
+
+    for(i = 0; i < executor->count; i++) {
+        Pair_start(&(executor->pairs[i]), now);
+        if(Batch_error(executor->pairs[i].batch))
+            result = 0;
+    }
+
+    for(;;) {
+        now = now_milliseconds();
+        wait = deadline - now;
+        count = 0;
+        for(i = 0; i < executor->count; i++) {
+            pair = &(executor->pairs[i]);
+            if(pair->state == PAIR_DONE)
+                continue;
+            if(now >= deadline || (pair->connect_deadline && now >= pair->connect_deadline)) {
+                Pair_abort(pair, pair->state == PAIR_CONNECTING ? "Timed out connecting" : "Timed out waiting for the reply");
+                result = 0;
+                continue;
+            }
+            if(pair->connect_deadline && pair->connect_deadline - now < wait)
+                wait = pair->connect_deadline - now;
+            fds[count].fd = pair->connection->fd;
+            fds[count].events = pair->state == PAIR_CONNECTING || Batch_unsent(pair->batch, &data) ? POLLOUT : 0;
+            if(pair->state == PAIR_RUNNING)
+                fds[count].events |= POLLIN;
+            fds[count].revents = 0;
+            polled[count++] = i;
+        }
+        if(!count)
+            break;
+
+        ready = poll(fds, count, (int) wait);
+        if(ready < 0) {
+            /* Let the caller see to whatever interrupted it */
+            error = errno;
+            for(i = 0; i < count; i++)
+                Pair_abort(&(executor->pairs[polled[i]]), error == EINTR ? "Interrupted" : strerror(error));
+            result = error == EINTR ? 0 : -1;
+            break;
+        }
+        for(i = 0; i < count && ready > 0; i++) {
+            if(!fds[i].revents)
+                continue;
+            ready--;
+            pair = &(executor->pairs[polled[i]]);
+            Pair_handle(pair, fds[i].revents);
+            if(Batch_error(pair->batch))
+                result = 0;
+        }
+    }
+
+    Module_release(fds);
+    Module_release(polled);
+    return result;
+}
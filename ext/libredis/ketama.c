@@ -0,0 +1,128 @@
+/* Ketama consistent hashing, as in libketama, so keys map to the same
+   servers as with other ketama clients given the same server list */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "common.h"
+
+#define POINTS_PER_SERVER 40    /* times 4 points per digest */
+
+typedef struct {
+    char * address;             /* "host:port" */
+    unsigned long weight;
+} KetamaServer;
+
+typedef struct {
+    unsigned int point;
+    int ordinal;
+} KetamaPoint;
+
+struct _Ketama {
+    KetamaServer * servers;
+    int server_count;
+    int server_capacity;
+    KetamaPoint * continuum;
+    int point_count;
+};
+
+Ketama * Ketama_new() {
+    Ketama * ketama = Module_alloc(sizeof(Ketama));
+
+    memset(ketama, 0, sizeof(Ketama));
+    return ketama;
+}
+
+void Ketama_free(Ketama * ketama) {
+    int i;
+
+    if(!ketama)
+        return;
+    for(i = 0; i < ketama->server_count; i++)
+        Module_release(ketama->servers[i].address);
+    Module_release(ketama->servers);
+    Module_release(ketama->continuum);
+    Module_release(ketama);
+}
+
+void Ketama_add_server(Ketama * ketama, const char * addr, int port, unsigned long weight) {
+    KetamaServer * server;
+    size_t length = strlen(addr) + 16;
+
+    if(ketama->server_count == ketama->server_capacity) {
+        ketama->server_capacity = ketama->server_capacity ? ketama->server_capacity * 2 : 8;
+        ketama->servers = Module_realloc(ketama->servers, ketama->server_capacity * sizeof(KetamaServer));
+    }
+    server = &(ketama->servers[ketama->server_count++]);
+    server->address = Module_alloc(length);
+    snprintf(server->address, length, "%s:%d", addr, port);
+    server->weight = weight;
+}
+
+static int compare_points(const void * a, const void * b) {
+    unsigned int first = ((const KetamaPoint *) a)->point, second = ((const KetamaPoint *) b)->point;
+
+    return first < second ? -1 : first > second;
+}
+
+void Ketama_create_continuum(Ketama * ketama) {
+    unsigned long total_weight = 0;
+    unsigned char digest[16];
+    char name[300];
+    float share;
+    unsigned int points, k;
+    int i, h, length;
+
+    for(i = 0; i < ketama->server_count; i++)
+        total_weight += ketama->servers[i].weight;
+
+    Module_release(ketama->continuum);
+    ketama->continuum = Module_alloc((ketama->server_count * POINTS_PER_SERVER + 1) * 4 * sizeof(KetamaPoint));
+    ketama->point_count = 0;
+
+    for(i = 0; i < ketama->server_count; i++) {
+        /* The float arithmetic of libketama, point counts included */
+        share = (float) ketama->servers[i].weight / (float) total_weight;
+        points = floorf(share * 40.0 * (float) ketama->server_count);
+        for(k = 0; k < points; k++) {
+            length = snprintf(name, sizeof(name), "%s-%u", ketama->servers[i].address, k);
+            md5_digest(name, length < (int) sizeof(name) ? length : (int) sizeof(name) - 1, digest);
+            for(h = 0; h < 4; h++) {
+                ketama->continuum[ketama->point_count].point = ((unsigned int) digest[3 + h * 4] << 24) |
+                    ((unsigned int) digest[2 + h * 4] << 16) | ((unsigned int) digest[1 + h * 4] << 8) | digest[h * 4];
+                ketama->continuum[ketama->point_count++].ordinal = i;
+            }
+        }
+    }
+    qsort(ketama->continuum, ketama->point_count, sizeof(KetamaPoint), compare_points);
+}
+
+/* The first point at or after the hash of the key, wrapping around */
+int Ketama_get_server_ordinal(Ketama * ketama, char * key, size_t key_len) {
+    unsigned char digest[16];
+    unsigned int hash, low = 0, high, middle;
+
+    if(!ketama->point_count)
+        return -1;
+    md5_digest(key, key_len, digest);
+    hash = ((unsigned int) digest[3] << 24) | ((unsigned int) digest[2] << 16) | ((unsigned int) digest[1] << 8) | digest[0];
+
+    high = ketama->point_count;
+    while(low < high) {
+        middle = low + (high - low) / 2;
+        if(ketama->continuum[middle].point < hash)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+    if(low == (unsigned int) ketama->point_count)
+        low = 0;
+    return ketama->continuum[low].ordinal;
+}
+
+char * Ketama_get_server_address(Ketama * ketama, int ordinal) {
+    if(ordinal < 0 || ordinal >= ketama->server_count)
+        return NULL;
+    return ketama->servers[ordinal].address;
+}
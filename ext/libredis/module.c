@@ -0,0 +1,110 @@
+/* The module: memory management and the last error */
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "common.h"
+
+struct _Module {
+    void * (*alloc_malloc)();
+    void * (*alloc_realloc)(void *, size_t);
+    void (*alloc_free)(void *);
+    size_t allocated;
+};
+
+static Module module = {malloc, realloc, free, 0};
+
+/* Executors run in several threads at once, so each has its own */
+static __thread char last_error[256];
+
+/* Every block starts with its size, so the module can count its bytes */
+typedef union {
+    size_t size;
+    double align;
+} Header;
+
+Module * Module_new() {
+    return &module;
+}
+
+void Module_set_alloc_alloc(Module * module, void * (*alloc_malloc)()) {
+    module->alloc_malloc = alloc_malloc;
+}
+
+void Module_set_alloc_realloc(Module * module, void * (*alloc_realloc)(void *, size_t)) {
+    module->alloc_realloc = alloc_realloc;
+}
+
+void Module_set_alloc_free(Module * module, void (*alloc_free)(void *)) {
+    module->alloc_free = alloc_free;
+}
+
+int Module_init(Module * module) {
+    return 0;
+}
+
+size_t Module_get_allocated(Module * module) {
+    return __sync_add_and_fetch(&(module->allocated), 0);
+}
+
+char * Module_last_error(Module * module) {
+    return last_error;
+}
+
+void Module_free(Module * module) {
+}
+
+void Module_set_error(const char * format, ...) {
+    va_list arguments;
+
+    va_start(arguments, format);
+    vsnprintf(last_error, sizeof(last_error), format, arguments);
+    va_end(arguments);
+}
+
+void * Module_alloc(size_t size) {
+    Header * header = module.alloc_malloc(sizeof(Header) + size);
+
+    if(!header)
+        return NULL;
+    header->size = size;
+    __sync_add_and_fetch(&(module.allocated), size);
+    return header + 1;
+}
+
+void * Module_realloc(void * ptr, size_t size) {
+    Header * header;
+    size_t old_size;
+
+    if(!ptr)
+        return Module_alloc(size);
+    header = ((Header *) ptr) - 1;
+    old_size = header->size;
+    header = module.alloc_realloc(header, sizeof(Header) + size);
+    if(!header)
+        return NULL;
+    header->size = size;
+    __sync_add_and_fetch(&(module.allocated), size);
+    __sync_sub_and_fetch(&(module.allocated), old_size);
+    return header + 1;
+}
+
+void Module_release(void * ptr) {
+    Header * header;
+
+    if(!ptr)
+        return;
+    header = ((Header *) ptr) - 1;
+    __sync_sub_and_fetch(&(module.allocated), header->size);
+    module.alloc_free(header);
+}
+
+char * Module_strdup(const char * string) {
+    size_t length = strlen(string) + 1;
+    char * copy = Module_alloc(length);
+
+    if(copy)
+        memcpy(copy, string, length);
+    return copy;
+}
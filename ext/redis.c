@@ -1,48 +1,1201 @@
 #include <ruby.h>
+#include <ruby/util.h>
 #include <string.h>
+#include <stdlib.h>
+#include <math.h>
 #include <stdarg.h>
+#include <pthread.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/un.h>
+#ifdef HAVE_COMPRESS2
+#define USE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef HAVE_RUBY_THREAD_H
+#include <ruby/thread.h>
+#endif
 #include "redis.h"
 
-VALUE cRedis, cRedisError;
+VALUE cRedis, cRedisError, cRedisConnectionError, cRedisTimeoutError, cRedisPartialError, cRedisPipeline, cRedisTransaction, cRedisFuture, cRedisAsync, cRedisSubscriber, cConditionVariable;
+
+static ID id_value, id_ready, id_async;
+static ID id_redis, id_lock, id_work, id_done, id_pending, id_thread, id_closed;
+static ID id_wait, id_signal, id_broadcast;
+static ID id_read, id_write;
+static ID id_errors, id_result;
+
+static Module * module;
+
+static const char ** command_names;
+static char * command_read_only;
+static int command_name_count;
+static int pipeline_command_id;
+static int multi_command_id, watch_command_id, unwatch_command_id;
+
+
+/* Memory functions
+
+   libredis allocates a Batch, an Executor and their buffers for every
+   command and frees them again once the reply has been read. Rather than
+   going back to malloc each time, freed blocks are kept on a free list per
+   power of two size class and handed out again, so a steady stream of
+   commands does no heap allocation at all. Allocations can happen while the
+   GVL is released, so the free lists have their own lock.
+
+   For the same reason ruby_xmalloc cannot be used here. Instead the pool
+   keeps count of the bytes it holds, and the difference is reported to the
+   GC each time a command has run, so large replies make it run sooner. */
+
+#define POOL_MIN_SHIFT 4
+#define POOL_MAX_SHIFT 18
+#define POOL_CLASSES (POOL_MAX_SHIFT - POOL_MIN_SHIFT + 1)
+#define POOL_MAX_CACHED_BYTES (512 * 1024)
+
+typedef union _PoolBlock {
+    union _PoolBlock * next;    /* while on a free list */
+    struct {
+        size_t size_class;      /* POOL_CLASSES if unpooled */
+        size_t size;
+    } used;
+    char align[16];
+} PoolBlock;
+
+static struct {
+    pthread_mutex_t lock;
+    PoolBlock * free[POOL_CLASSES];
+    size_t cached[POOL_CLASSES];
+    size_t requests;
+    size_t allocations;
+    size_t bytes;               /* malloc'ed, whether handed out or cached */
+    size_t reported;            /* bytes last reported to the GC */
+} pool = { PTHREAD_MUTEX_INITIALIZER };
+
+static size_t pool_class(size_t size) {
+    size_t size_class = 0;
+    size = (size - 1) >> POOL_MIN_SHIFT;
+    while(size) {
+        size >>= 1;
+        size_class++;
+    }
+    return size_class;
+}
+
+static void * pool_alloc(size_t size) {
+    size_t size_class = size ? pool_class(size) : 0;
+    PoolBlock * block = NULL;
+
+    pthread_mutex_lock(&pool.lock);
+    pool.requests++;
+    if(size_class < POOL_CLASSES && pool.free[size_class]) {
+        block = pool.free[size_class];
+        pool.free[size_class] = block->next;
+        pool.cached[size_class]--;
+    } else {
+        pool.allocations++;
+    }
+    pthread_mutex_unlock(&pool.lock);
+
+    if(!block) {
+        if(size_class < POOL_CLASSES)
+            size = (size_t) 1 << (size_class + POOL_MIN_SHIFT);
+        else
+            size_class = POOL_CLASSES;
+        block = (PoolBlock *) malloc(sizeof(PoolBlock) + size);
+        if(!block)
+            return NULL;
+        block->used.size = size;
+        pthread_mutex_lock(&pool.lock);
+        pool.bytes += size;
+        pthread_mutex_unlock(&pool.lock);
+    }
+    block->used.size_class = size_class;
+    return block + 1;
+}
+
+static void pool_free(void * ptr) {
+    PoolBlock * block;
+    size_t size_class;
+
+    if(!ptr)
+        return;
+    block = ((PoolBlock *) ptr) - 1;
+    size_class = block->used.size_class;
+
+    pthread_mutex_lock(&pool.lock);
+    if(size_class < POOL_CLASSES && (pool.cached[size_class] << (size_class + POOL_MIN_SHIFT)) < POOL_MAX_CACHED_BYTES) {
+        block->next = pool.free[size_class];
+        pool.free[size_class] = block;
+        pool.cached[size_class]++;
+        block = NULL;
+    } else {
+        pool.bytes -= block->used.size;
+    }
+    pthread_mutex_unlock(&pool.lock);
+
+    if(block)
+        free(block);
+}
+
+static void * pool_realloc(void * ptr, size_t size) {
+    PoolBlock * block;
+    void * resized;
+
+    if(!ptr)
+        return pool_alloc(size);
+
+    block = ((PoolBlock *) ptr) - 1;
+    if(size <= block->used.size)
+        return ptr;
+
+    if(block->used.size_class < POOL_CLASSES) {
+        resized = pool_alloc(size);
+        if(resized) {
+            memcpy(resized, ptr, block->used.size);
+            pool_free(ptr);
+        }
+        return resized;
+    }
+
+    pthread_mutex_lock(&pool.lock);
+    pool.bytes -= block->used.size;
+    pthread_mutex_unlock(&pool.lock);
+
+    block = (PoolBlock *) realloc(block, sizeof(PoolBlock) + size);
+    if(!block)
+        return NULL;
+
+    block->used.size = size;
+    pthread_mutex_lock(&pool.lock);
+    pool.bytes += size;
+    pthread_mutex_unlock(&pool.lock);
+    return block + 1;
+}
+
+/* Tells the GC how much the pool grew or shrank since the last call. Must
+   be called with the GVL held. */
+static void pool_report() {
+#ifdef HAVE_RB_GC_ADJUST_MEMORY_USAGE
+    ssize_t diff;
+
+    pthread_mutex_lock(&pool.lock);
+    diff = (ssize_t) pool.bytes - (ssize_t) pool.reported;
+    pool.reported = pool.bytes;
+    pthread_mutex_unlock(&pool.lock);
+
+    if(diff)
+        rb_gc_adjust_memory_usage(diff);
+#endif
+}
+
+/* Returns how many blocks libredis asked for, how many of those had to come
+   from malloc because no freed block of the right size was around, and the
+   number of bytes the pool holds. */
+static VALUE Redis_s_allocation_stats(VALUE klass) {
+    VALUE stats = rb_hash_new();
+
+    pthread_mutex_lock(&pool.lock);
+    rb_hash_aset(stats, ID2SYM(rb_intern("requests")), SIZET2NUM(pool.requests));
+    rb_hash_aset(stats, ID2SYM(rb_intern("allocations")), SIZET2NUM(pool.allocations));
+    rb_hash_aset(stats, ID2SYM(rb_intern("bytes")), SIZET2NUM(pool.bytes));
+    pthread_mutex_unlock(&pool.lock);
+    return stats;
+}
+
+
+/* Command names
+
+   Every command name gets an id, so looking up its stats or whether it
+   writes is an array index rather than a lookup. The commands of the
+   command table are registered when the extension is loaded, anything
+   else the first time it is sent. */
+
+
+static int Command_id(const char * name) {
+    int i;
+
+    for(i = 0; i < command_name_count; i++) {
+        if(!strcmp(command_names[i], name))
+            return i;
+    }
+    REALLOC_N(command_names, const char *, command_name_count + 1);
+    REALLOC_N(command_read_only, char, command_name_count + 1);
+    command_names[command_name_count] = name;
+    command_read_only[command_name_count] = 0;
+    return command_name_count++;
+}
+
+
+/* Stats functions
+
+   All counters are updated with the GVL held, which is what keeps them
+   consistent without a lock. */
+
+static unsigned long long monotonic_nanoseconds() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (unsigned long long) now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+static void Stats_record(Stats * stats, int id, int result, unsigned long long started) {
+    unsigned long long elapsed = monotonic_nanoseconds() - started;
+    unsigned long long microseconds = elapsed / 1000;
+    CommandStats * command;
+    int bucket;
+
+    if(id >= stats->command_count) {
+        REALLOC_N(stats->commands, CommandStats, command_name_count);
+        MEMZERO(stats->commands + stats->command_count, CommandStats, command_name_count - stats->command_count);
+        stats->command_count = command_name_count;
+    }
+    command = &(stats->commands[id]);
+
+    bucket = microseconds ? 64 - __builtin_clzll(microseconds) : 0;
+    if(bucket >= STATS_BUCKETS)
+        bucket = STATS_BUCKETS - 1;
+
+    command->calls++;
+    command->nanoseconds += elapsed;
+    command->histogram[bucket]++;
+    if(result == 0)
+        command->timeouts++;
+    else if(result < 0)
+        command->failures++;
+}
+
+/* Counts a reply that was read, and its payload */
+static void Stats_read(Reply * reply) {
+    if(!reply->stats)
+        return;
+    if(reply->reply_type == RT_ERROR)
+        reply->stats->error_replies++;
+    if(reply->reply_type != RT_MULTIBULK)
+        reply->stats->bytes_read += reply->length;
+}
+
+static int decimal_length(long value) {
+    int length = value < 0 ? 2 : 1;
+    while(value /= 10)
+        length++;
+    return length;
+}
+
+static VALUE CommandStats_to_hash(CommandStats * command) {
+    VALUE hash = rb_hash_new();
+    VALUE histogram = rb_hash_new();
+    int i;
+
+    for(i = 0; i < STATS_BUCKETS; i++) {
+        if(command->histogram[i])
+            rb_hash_aset(histogram, ULL2NUM(1ULL << i), ULL2NUM(command->histogram[i]));
+    }
+    rb_hash_aset(hash, ID2SYM(rb_intern("calls")), ULL2NUM(command->calls));
+    rb_hash_aset(hash, ID2SYM(rb_intern("failures")), ULL2NUM(command->failures));
+    rb_hash_aset(hash, ID2SYM(rb_intern("timeouts")), ULL2NUM(command->timeouts));
+    rb_hash_aset(hash, ID2SYM(rb_intern("time")), DBL2NUM(command->nanoseconds / 1e9));
+    rb_hash_aset(hash, ID2SYM(rb_intern("histogram")), histogram);
+    return hash;
+}
+
+
+/* Near cache functions
+
+   An opt-in cache of GET replies in front of the server. Entries are
+   evicted with the CLOCK algorithm once the cache holds more than its
+   budget of bytes: the hand sweeps the slots, sparing each entry read
+   since it last passed once. Any command that writes a key, sent through
+   the same instance or one of its pipelines, drops that key. Keyless
+   writes such as FLUSHDB or SELECT drop everything.
+
+   A GET that misses only fills the cache if no write was sent or completed
+   while it was in flight, so a value read before a write can never be
+   cached after it. Like the stats, the cache is only touched with the GVL
+   held. Keys are looked up as they are sent, converted by encode_argument,
+   so :foo and "foo" are the same key. */
+
+static VALUE encode_argument(char kind, VALUE value);
+
+#define CACHE_ENTRY_OVERHEAD (sizeof(CacheEntry) + 2 * sizeof(struct RString))
+
+static Cache * Cache_new(size_t max_bytes, unsigned long long ttl) {
+    Cache * cache = ZALLOC(Cache);
+    cache->index = rb_hash_new();
+    cache->max_bytes = max_bytes;
+    cache->ttl = ttl;
+    return cache;
+}
+
+static void Cache_mark(Cache * cache) {
+    long i;
+
+    rb_gc_mark(cache->index);
+    for(i = 0; i < cache->used; i++) {
+        if(cache->entries[i].value != Qundef) {
+            rb_gc_mark(cache->entries[i].key);
+            rb_gc_mark(cache->entries[i].value);
+        }
+    }
+}
+
+static void Cache_free(Cache * cache) {
+    xfree(cache->entries);
+    xfree(cache->free);
+    xfree(cache);
+}
+
+static void Cache_remove(Cache * cache, long slot) {
+    CacheEntry * entry = &(cache->entries[slot]);
+
+    rb_hash_delete(cache->index, entry->key);
+    cache->bytes -= entry->bytes;
+    entry->key = Qnil;
+    entry->value = Qundef;
+    cache->free[cache->free_count++] = slot;
+}
+
+static void Cache_clear(Cache * cache) {
+    cache->generation++;
+    if(!cache->used)
+        return;
+    cache->invalidations += RHASH_SIZE(cache->index);
+    rb_hash_clear(cache->index);
+    cache->used = 0;
+    cache->free_count = 0;
+    cache->hand = 0;
+    cache->bytes = 0;
+}
+
+static void Cache_invalidate(Cache * cache, VALUE key) {
+    VALUE slot;
+
+    cache->generation++;
+    slot = rb_hash_lookup2(cache->index, encode_argument('k', key), Qundef);
+    if(slot != Qundef) {
+        Cache_remove(cache, FIX2LONG(slot));
+        cache->invalidations++;
+    }
+}
+
+/* Returns the cached value of key, or Qundef */
+static VALUE Cache_lookup(Cache * cache, VALUE key) {
+    VALUE slot = rb_hash_lookup2(cache->index, encode_argument('k', key), Qundef);
+    CacheEntry * entry;
+
+    if(slot == Qundef) {
+        cache->misses++;
+        return Qundef;
+    }
+    entry = &(cache->entries[FIX2LONG(slot)]);
+    if(entry->expires && entry->expires < monotonic_nanoseconds()) {
+        Cache_remove(cache, FIX2LONG(slot));
+        cache->misses++;
+        return Qundef;
+    }
+    entry->referenced = 1;
+    cache->hits++;
+    return entry->value;
+}
+
+/* Makes room for the given number of bytes by moving the clock hand */
+static void Cache_evict(Cache * cache, size_t bytes) {
+    CacheEntry * entry;
+
+    while(cache->bytes && cache->bytes + bytes > cache->max_bytes) {
+        entry = &(cache->entries[cache->hand]);
+        if(entry->value != Qundef) {
+            if(entry->referenced) {
+                entry->referenced = 0;
+            } else {
+                Cache_remove(cache, cache->hand);
+                cache->evictions++;
+            }
+        }
+        cache->hand = (cache->hand + 1) % cache->used;
+    }
+}
+
+/* Caches the value of key unless a write happened since the given
+   generation. Returns the value as it should be handed out, frozen. */
+static VALUE Cache_store(Cache * cache, VALUE key, VALUE value, unsigned long long generation) {
+    size_t bytes;
+    long slot;
+    CacheEntry * entry;
+    VALUE existing;
+
+    if(!RB_TYPE_P(value, T_STRING))
+        return value;
+    rb_obj_freeze(value);
+    key = encode_argument('k', key);
+    bytes = RSTRING_LEN(key) + RSTRING_LEN(value) + CACHE_ENTRY_OVERHEAD;
+    if(generation != cache->generation || bytes > cache->max_bytes)
+        return value;
+
+    /* Another thread may have missed on the same key at the same time */
+    existing = rb_hash_lookup2(cache->index, key, Qundef);
+    if(existing != Qundef)
+        Cache_remove(cache, FIX2LONG(existing));
+
+    Cache_evict(cache, bytes);
+    if(cache->free_count) {
+        slot = cache->free[--cache->free_count];
+    } else {
+        if(cache->used == cache->capacity) {
+            cache->capacity = cache->capacity ? cache->capacity * 2 : 64;
+            REALLOC_N(cache->entries, CacheEntry, cache->capacity);
+            REALLOC_N(cache->free, long, cache->capacity);
+        }
+        slot = cache->used++;
+    }
+
+    entry = &(cache->entries[slot]);
+    entry->key = rb_str_new_frozen(key);
+    entry->value = value;
+    entry->bytes = bytes;
+    entry->expires = cache->ttl ? monotonic_nanoseconds() + cache->ttl : 0;
+    entry->referenced = 0;
+    rb_hash_aset(cache->index, entry->key, LONG2FIX(slot));
+    cache->bytes += bytes;
+    return value;
+}
+
+
+/* Script registry functions */
+
+static Scripts * Scripts_new() {
+    Scripts * scripts = ZALLOC(Scripts);
+    scripts->index = rb_hash_new();
+    return scripts;
+}
+
+static void Scripts_mark(Scripts * scripts) {
+    long i;
+
+    rb_gc_mark(scripts->index);
+    for(i = 0; i < scripts->count; i++) {
+        rb_gc_mark(scripts->entries[i].sha);
+        rb_gc_mark(scripts->entries[i].source);
+    }
+}
+
+static int is_noscript(Reply * reply) {
+    return reply->reply_type == RT_ERROR && reply->length >= 8 && !memcmp(reply->data, "NOSCRIPT", 8);
+}
+
+/* Notes whether a node has a script cached, going by the reply to running
+   it. Registering a script can move the entries while a call waits without
+   the GVL, so the entry is looked up again by its position, and left alone
+   if the name got another script in the meantime. */
+static void Scripts_note(Scripts * scripts, long position, unsigned long version, int node, Reply * reply) {
+    Script * script = &(scripts->entries[position]);
+
+    if(script->version != version)
+        return;
+    if(is_noscript(reply))
+        script->loaded[node] = 0;
+    else if(reply->reply_type != RT_ERROR && reply->reply_type != RT_NONE)
+        script->loaded[node] = 1;
+}
+
+static void Scripts_free(Scripts * scripts) {
+    long i;
+
+    for(i = 0; i < scripts->count; i++)
+        xfree(scripts->entries[i].loaded);
+    xfree(scripts->entries);
+    xfree(scripts);
+}
+
+
+/* Node functions */
+
+/* A connection to the node with the socket options of its instance */
+static Connection * Node_connection(Node * node) {
+    Connection * connection = Connection_new(node->address);
+
+    Connection_set_connect_timeout(connection, node->options->connect_timeout);
+    Connection_set_nodelay(connection, node->options->nodelay);
+    Connection_set_keepalive(connection, node->options->keepalive);
+    Connection_set_buffer_sizes(connection, node->options->send_buffer, node->options->receive_buffer);
+    return connection;
+}
+
+static void Node_init(Node * node, const char * address, int size, const ConnectionOptions * options) {
+    int i;
+
+    node->address = ruby_strdup(address);
+    node->options = options;
+    pthread_mutex_init(&(node->lock), NULL);
+    pthread_cond_init(&(node->available), NULL);
+    node->idle = ALLOC_N(Connection *, size);
+    node->size = size;
+
+    /* libredis only connects once a connection is first used */
+    for(i = 0; i < size; i++)
+        node->idle[i] = Node_connection(node);
+    node->idle_count = size;
+
+    node->setup = NULL;
+    node->setup_length = 0;
+    node->setup_commands = 0;
+    node->ready = ALLOC_N(Connection *, size);
+    node->ready_count = 0;
+    node->watchers = ALLOC_N(VALUE, size);
+    node->watcher_count = 0;
+
+    node->replicas = NULL;
+    node->replica_count = 0;
+    node->latency = 0;
+    node->down_until = 0;
+}
+
+static void Node_free(Node * node) {
+    int i;
+
+    for(i = 0; i < node->replica_count; i++)
+        Node_free(&(node->replicas[i]));
+    xfree(node->replicas);
+    for(i = 0; i < node->idle_count; i++)
+        Connection_free(node->idle[i]);
+    xfree(node->idle);
+    xfree(node->ready);
+    xfree(node->watchers);
+    xfree(node->setup);
+    xfree(node->address);
+    pthread_mutex_destroy(&(node->lock));
+    pthread_cond_destroy(&(node->available));
+}
+
+typedef struct {
+    Node * node;
+    Connection * connection;
+    int interrupted;
+} Checkout;
+
+/* An interrupted wait takes nothing, and passes on the wakeup it may have
+   used up to the next waiter */
+static void * wait_for_connection(void * arg) {
+    Checkout * checkout = (Checkout *) arg;
+    Node * node = checkout->node;
+
+    pthread_mutex_lock(&(node->lock));
+    while(!node->idle_count && !checkout->interrupted)
+        pthread_cond_wait(&(node->available), &(node->lock));
+    if(!checkout->interrupted)
+        checkout->connection = node->idle[--node->idle_count];
+    else if(node->idle_count)
+        pthread_cond_signal(&(node->available));
+    pthread_mutex_unlock(&(node->lock));
+    return NULL;
+}
+
+static void stop_waiting_for_connection(void * arg) {
+    Checkout * checkout = (Checkout *) arg;
+    Node * node = checkout->node;
+
+    pthread_mutex_lock(&(node->lock));
+    checkout->interrupted = 1;
+    pthread_cond_broadcast(&(node->available));
+    pthread_mutex_unlock(&(node->lock));
+}
+
+/* Takes an idle connection, waiting without the GVL when every connection
+   is in use by another thread. Interrupts are only raised while nothing
+   was taken, as a connection taken by a wait that is then interrupted
+   would never be checked in again. */
+static Connection * Node_checkout(Node * node) {
+    Checkout checkout;
+
+    checkout.node = node;
+    checkout.connection = NULL;
+
+    pthread_mutex_lock(&(node->lock));
+    if(node->idle_count)
+        checkout.connection = node->idle[--node->idle_count];
+    pthread_mutex_unlock(&(node->lock));
+
+    while(!checkout.connection) {
+        checkout.interrupted = 0;
+#if defined(HAVE_RB_THREAD_CALL_WITHOUT_GVL2)
+        rb_thread_call_without_gvl2(wait_for_connection, &checkout, stop_waiting_for_connection, &checkout);
+        if(!checkout.connection)
+            rb_thread_check_ints();
+#elif defined(HAVE_RB_THREAD_CALL_WITHOUT_GVL)
+        rb_thread_call_without_gvl(wait_for_connection, &checkout, stop_waiting_for_connection, &checkout);
+#else
+        wait_for_connection(&checkout);
+#endif
+    }
+    return checkout.connection;
+}
+
+/* A watch block holds a connection for as long as it runs. A thread that
+   asks for a connection of a node whose every connection it holds itself,
+   say by calling the parent instance inside the block, would wait for
+   good, so it raises instead. */
+static void Node_check_held(Node * node) {
+    VALUE thread = rb_thread_current();
+    int i, held = 0;
+
+    for(i = 0; i < node->watcher_count; i++)
+        held += node->watchers[i] == thread;
+    if(held && held == node->size)
+        rb_raise(cRedisError, "Every connection to %s is held by a watch block of this thread; "
+                 "send commands through the instance the block was given", node->address);
+}
+
+static void Node_add_watcher(Node * node) {
+    if(node->watcher_count < node->size)
+        node->watchers[node->watcher_count++] = rb_thread_current();
+}
+
+static void Node_remove_watcher(Node * node) {
+    VALUE thread = rb_thread_current();
+    int i;
+
+    for(i = 0; i < node->watcher_count; i++) {
+        if(node->watchers[i] == thread) {
+            node->watchers[i] = node->watchers[--node->watcher_count];
+            return;
+        }
+    }
+}
+
+
+/* Connection setup
+
+   AUTH and SELECT only hold for the connection they are sent on. Rather
+   than being sent like other commands, the password and db of an instance
+   make up the setup of each of its nodes, which goes ahead of everything
+   else on any connection that has not had it yet: new ones, ones that
+   replaced a failed connection, and all of them again once the setup
+   changes. Nodes without a setup skip all of this. */
+
+static void Node_set_setup(Node * node, const char * setup, long length, int commands) {
+    int i;
+
+    xfree(node->setup);
+    node->setup = NULL;
+    if(length) {
+        node->setup = ALLOC_N(char, length);
+        memcpy(node->setup, setup, length);
+    }
+    node->setup_length = length;
+    node->setup_commands = commands;
+    node->ready_count = 0;
+
+    for(i = 0; i < node->replica_count; i++)
+        Node_set_setup(&(node->replicas[i]), setup, length, commands);
+}
+
+static int Node_is_ready(Node * node, Connection * connection) {
+    int i;
+
+    if(!node->setup)
+        return 1;
+    for(i = 0; i < node->ready_count; i++) {
+        if(node->ready[i] == connection)
+            return 1;
+    }
+    return 0;
+}
+
+static void Node_ready(Node * node, Connection * connection) {
+    if(node->ready_count < node->size)
+        node->ready[node->ready_count++] = connection;
+}
+
+/* Called before a connection is freed, so a new one that happens to get
+   the same address is not taken for set up */
+static void Node_forget(Node * node, Connection * connection) {
+    int i;
+
+    for(i = 0; i < node->ready_count; i++) {
+        if(node->ready[i] == connection) {
+            node->ready[i] = node->ready[--node->ready_count];
+            return;
+        }
+    }
+}
+
+/* Hands a connection back to the pool. A connection that was in use when a
+   command failed may still have replies coming in, so it is replaced. When
+   it was dropped rather than timed out, the server most likely went away
+   and the idle connections are replaced as well; libredis only connects
+   them again once they are used. */
+static void Node_checkin(Node * node, Connection * connection, int result) {
+    int i;
+
+    if(result <= 0) {
+        Node_forget(node, connection);
+        Connection_free(connection);
+        connection = Node_connection(node);
+    }
+
+    pthread_mutex_lock(&(node->lock));
+    if(result < 0) {
+        for(i = 0; i < node->idle_count; i++) {
+            Node_forget(node, node->idle[i]);
+            Connection_free(node->idle[i]);
+            node->idle[i] = Node_connection(node);
+        }
+    }
+    node->idle[node->idle_count++] = connection;
+    pthread_cond_signal(&(node->available));
+    pthread_mutex_unlock(&(node->lock));
+}
+
+static AutoPipeline * AutoPipeline_new(void);
+static void AutoPipeline_mark(AutoPipeline * pipeline);
+static void AutoPipeline_free(AutoPipeline * pipeline, int count);
 
 
 /* Redis struct functions */
 
+static void Redis_mark(Redis * redis) {
+    rb_gc_mark(redis->connection_strings);
+    rb_gc_mark(redis->parent);
+    rb_gc_mark(redis->futures);
+    if(redis->cache && NIL_P(redis->parent))
+        Cache_mark(redis->cache);
+    if(redis->scripts && NIL_P(redis->parent))
+        Scripts_mark(redis->scripts);
+    if(redis->codec && NIL_P(redis->parent))
+        rb_gc_mark(redis->codec->serializer);
+    if(redis->auto_pipeline && NIL_P(redis->parent))
+        AutoPipeline_mark(redis->auto_pipeline);
+    rb_gc_mark(redis->options.password);
+}
+
 void Redis_free(Redis * redis) {
-    Connection_free(redis->connection);
-    Module_free(redis->module);
+    int i;
+
+    if(redis->batches) {
+        for(i = 0; i < redis->connection_count; i++) {
+            if(redis->batches[i])
+                Batch_free(redis->batches[i]);
+        }
+        xfree(redis->batches);
+    }
+    xfree(redis->queue);
+
+    /* Pipelines only borrow the connections of their parent */
+    if(NIL_P(redis->parent)) {
+        for(i = 0; i < redis->connection_count; i++)
+            Node_free(&(redis->nodes[i]));
+        xfree(redis->nodes);
+        if(redis->ketama)
+            Ketama_free(redis->ketama);
+        if(redis->stats) {
+            xfree(redis->stats->commands);
+            xfree(redis->stats);
+        }
+        if(redis->cache)
+            Cache_free(redis->cache);
+        if(redis->scripts)
+            Scripts_free(redis->scripts);
+        xfree(redis->codec);
+        if(redis->auto_pipeline)
+            AutoPipeline_free(redis->auto_pipeline, redis->connection_count);
+    }
+    free(redis);
+}
+
+static size_t Redis_memsize(const Redis * redis) {
+    size_t size = sizeof(Redis);
+
+    size += redis->queue_capacity * sizeof(QueuedReply);
+    if(redis->batches)
+        size += redis->connection_count * sizeof(Batch *);
+    if(NIL_P(redis->parent)) {
+        int i;
+        for(i = 0; i < redis->connection_count; i++) {
+            size += sizeof(Node) + redis->nodes[i].size * sizeof(Connection *);
+            size += redis->nodes[i].replica_count * (sizeof(Node) + redis->nodes[i].size * sizeof(Connection *));
+        }
+        if(redis->stats)
+            size += sizeof(Stats) + redis->stats->command_count * sizeof(CommandStats);
+        if(redis->cache)
+            size += sizeof(Cache) + redis->cache->capacity * (sizeof(CacheEntry) + sizeof(long));
+        if(redis->scripts)
+            size += sizeof(Scripts) + redis->scripts->count * (sizeof(Script) + redis->connection_count);
+        if(redis->codec)
+            size += sizeof(Codec);
+        if(redis->auto_pipeline)
+            size += sizeof(AutoPipeline);
+    }
+    return size;
 }
 
+static const rb_data_type_t redis_type = {
+    "Redis",
+    {
+        (void (*)(void *)) Redis_mark,
+        (void (*)(void *)) Redis_free,
+        (size_t (*)(const void *)) Redis_memsize,
+    },
+    0, 0,
+    RUBY_TYPED_FREE_IMMEDIATELY
+};
+
 static VALUE Redis_alloc(VALUE klass) {
     VALUE obj;
 
     Redis * redis = (Redis *) malloc(sizeof(Redis));
-    redis->module = Module_new();
-    Module_init(redis->module);
+    redis->module = module;
+    redis->nodes = NULL;
+    redis->connection_count = 0;
+    redis->ketama = NULL;
+    redis->connection_strings = Qnil;
+    redis->stats = NULL;
+    redis->cache = NULL;
+    redis->scripts = NULL;
+    redis->codec = NULL;
+    redis->auto_pipeline = NULL;
+    redis->replicated = 0;
+    redis->options.timeout = DEFAULT_TIMEOUT;
+    redis->options.connect_timeout = DEFAULT_CONNECT_TIMEOUT;
+    redis->options.nodelay = 1;
+    redis->options.keepalive = 0;
+    redis->options.send_buffer = 0;
+    redis->options.receive_buffer = 0;
+    redis->options.reconnect_attempts = DEFAULT_RECONNECT_ATTEMPTS;
+    redis->options.reconnect_delay = DEFAULT_RECONNECT_DELAY;
+    redis->options.db = -1;
+    redis->options.password = Qnil;
+    redis->watch = NULL;
+
+    redis->parent = Qnil;
+    redis->pipelined = 0;
+    redis->batches = NULL;
+    redis->queue = NULL;
+    redis->queue_length = 0;
+    redis->queue_capacity = 0;
+    redis->futures = Qnil;
 
-    obj = Data_Wrap_Struct(klass, 0, Redis_free, redis);
+    obj = TypedData_Wrap_Struct(klass, &redis_type, redis);
     return obj;
 }
 
 
-/* Reply struct functions */
+/* Codec functions
+
+   Values are serialized with dump and load of the serializer, and those
+   of threshold bytes or more are compressed, with zlib or with the LZF
+   format below when zlib is not worth the time. What is stored starts
+   with a three byte header: the magic and flags saying what was done,
+   followed by the length before compression for compressed values.
+   Compressed values are written straight into the string that is sent,
+   and read straight from the reply into the string handed out. Anything
+   without the header is a plain string, so existing values stay
+   readable. */
+
+/* LZF: a control byte below 32 is followed by that many literal bytes
+   plus one; any other holds the length of a back reference in its top
+   three bits, with seven meaning the next byte adds to it, and the high
+   bits of the offset, whose low byte follows. */
+
+#define LZF_HASH_LOG 13
+#define LZF_MAX_OFFSET (1 << 13)
+#define LZF_MAX_LITERALS 32
+#define LZF_MAX_MATCH (264)
+
+static long lzf_compress(const unsigned char * in, long in_length, unsigned char * out, long out_length) {
+    const unsigned char * ip = in, * in_end = in + in_length, * ref;
+    unsigned char * op = out, * out_end = out + out_length;
+    unsigned int * table = ZALLOC_N(unsigned int, 1 << LZF_HASH_LOG);
+    unsigned int hash;
+    long literals = 0, length, max_length, offset;
+
+    op++;                       /* the control byte of the first literal run */
+    while(ip + 2 < in_end) {
+        hash = ((ip[0] << 16 | ip[1] << 8 | ip[2]) * 2654435761U) >> (32 - LZF_HASH_LOG);
+        ref = table[hash] ? in + table[hash] - 1 : NULL;
+        table[hash] = ip - in + 1;
+
+        if(ref && (offset = ip - ref - 1) < LZF_MAX_OFFSET && ref[0] == ip[0] && ref[1] == ip[1] && ref[2] == ip[2]) {
+            max_length = in_end - ip < LZF_MAX_MATCH ? in_end - ip : LZF_MAX_MATCH;
+            for(length = 3; length < max_length && ref[length] == ip[length]; length++);
+            if(op + 3 > out_end)
+                goto overflow;
+
+            op[-literals - 1] = literals - 1;
+            if(!literals)
+                op--;
+            length -= 2;
+            if(length < 7) {
+                *op++ = (offset >> 8) + (length << 5);
+            } else {
+                *op++ = (offset >> 8) + (7 << 5);
+                *op++ = length - 7;
+            }
+            *op++ = offset;
+            ip += length + 2;
+            literals = 0;
+            op++;
+        } else {
+            if(op >= out_end)
+                goto overflow;
+            literals++;
+            *op++ = *ip++;
+            if(literals == LZF_MAX_LITERALS) {
+                op[-literals - 1] = literals - 1;
+                literals = 0;
+                op++;
+            }
+        }
+    }
+
+    while(ip < in_end) {
+        if(op >= out_end)
+            goto overflow;
+        literals++;
+        *op++ = *ip++;
+        if(literals == LZF_MAX_LITERALS) {
+            op[-literals - 1] = literals - 1;
+            literals = 0;
+            op++;
+        }
+    }
+    op[-literals - 1] = literals - 1;
+    if(!literals)
+        op--;
+    xfree(table);
+    return op - out;
+
+overflow:
+    xfree(table);
+    return 0;
+}
+
+/* Returns the length of the output, or -1 if the input is corrupt */
+static long lzf_decompress(const unsigned char * in, long in_length, unsigned char * out, long out_length) {
+    const unsigned char * ip = in, * in_end = in + in_length;
+    unsigned char * op = out, * out_end = out + out_length, * ref;
+    long length;
+    unsigned int control;
+
+    while(ip < in_end) {
+        control = *ip++;
+        if(control < LZF_MAX_LITERALS) {
+            length = control + 1;
+            if(ip + length > in_end || op + length > out_end)
+                return -1;
+            memcpy(op, ip, length);
+            op += length;
+            ip += length;
+            continue;
+        }
+
+        length = control >> 5;
+        ref = op - ((control & 0x1f) << 8) - 1;
+        if(ip >= in_end)
+            return -1;
+        if(length == 7) {
+            length += *ip++;
+            if(ip >= in_end)
+                return -1;
+        }
+        ref -= *ip++;
+        length += 2;
+        if(ref < out || op + length > out_end)
+            return -1;
+        while(length--)
+            *op++ = *ref++;
+    }
+    return op - out;
+}
+
+/* Fills in a codec from the options of Redis.new. It is already owned by
+   the instance, so nothing leaks when an option is wrong. */
+static void Codec_configure(Codec * codec, VALUE options) {
+    VALUE serializer = rb_hash_aref(options, ID2SYM(rb_intern("codec")));
+    VALUE compression = rb_hash_aref(options, ID2SYM(rb_intern("compression")));
+    VALUE threshold = rb_hash_aref(options, ID2SYM(rb_intern("compress_threshold")));
+
+    codec->serializer = Qnil;
+    codec->dump = rb_intern("dump");
+    codec->load = rb_intern("load");
+    if(serializer == ID2SYM(rb_intern("marshal"))) {
+        codec->serializer = rb_path2class("Marshal");
+    } else if(serializer == ID2SYM(rb_intern("json"))) {
+        rb_require("json");
+        codec->serializer = rb_path2class("JSON");
+        codec->dump = rb_intern("generate");
+        codec->load = rb_intern("parse");
+    } else if(!NIL_P(serializer)) {
+        if(!rb_respond_to(serializer, codec->dump) || !rb_respond_to(serializer, codec->load))
+            rb_raise(rb_eArgError, "codec must be :marshal, :json or respond to dump and load");
+        codec->serializer = serializer;
+    }
+
+    if(compression == ID2SYM(rb_intern("lz"))) {
+        codec->compression = CODEC_LZ;
+    } else if(compression == ID2SYM(rb_intern("zlib"))) {
+#ifdef USE_ZLIB
+        codec->compression = CODEC_ZLIB;
+#else
+        rb_raise(rb_eArgError, "the extension was built without zlib");
+#endif
+    } else if(!NIL_P(compression)) {
+        rb_raise(rb_eArgError, "compression must be :zlib or :lz");
+    }
+
+    codec->threshold = NIL_P(threshold) ? DEFAULT_COMPRESS_THRESHOLD : NUM2LONG(threshold);
+}
+
+static void Codec_write_header(char * data, int flags, long length) {
+    memcpy(data, CODEC_MAGIC, 2);
+    data[2] = flags;
+    if(flags & (CODEC_ZLIB | CODEC_LZ)) {
+        data[3] = length & 0xff;
+        data[4] = (length >> 8) & 0xff;
+        data[5] = (length >> 16) & 0xff;
+        data[6] = (length >> 24) & 0xff;
+    }
+}
+
+/* Compresses into a new string with the header in front, or returns nil
+   if that did not make it any smaller */
+static VALUE Codec_compress(Codec * codec, int flags, const char * data, long length) {
+    long header = CODEC_HEADER_SIZE + CODEC_LENGTH_SIZE;
+    long compressed = 0;
+    VALUE out;
+
+    if(length > 0xffffffffL)
+        return Qnil;
+    flags |= codec->compression;
+    out = rb_str_buf_new(header + length);
+#ifdef USE_ZLIB
+    if(codec->compression == CODEC_ZLIB) {
+        uLongf size = length;
+        if(compress2((Bytef *) RSTRING_PTR(out) + header, &size, (const Bytef *) data, length, Z_BEST_SPEED) == Z_OK)
+            compressed = size;
+    }
+#endif
+    if(codec->compression == CODEC_LZ)
+        compressed = lzf_compress((const unsigned char *) data, length, (unsigned char *) RSTRING_PTR(out) + header, length - 1);
+    if(compressed <= 0 || compressed >= length)
+        return Qnil;
+
+    Codec_write_header(RSTRING_PTR(out), flags, length);
+    rb_str_set_len(out, header + compressed);
+    return out;
+}
+
+/* Turns a value into what is stored */
+static VALUE Codec_encode(Codec * codec, VALUE value) {
+    VALUE encoded;
+    int flags = 0;
+
+    if(NIL_P(codec->serializer)) {
+        value = encode_argument('v', value);
+    } else {
+        value = rb_funcall(codec->serializer, codec->dump, 1, value);
+        StringValue(value);
+        flags = CODEC_SERIALIZED;
+    }
+
+    if(codec->compression && RSTRING_LEN(value) >= codec->threshold) {
+        encoded = Codec_compress(codec, flags, RSTRING_PTR(value), RSTRING_LEN(value));
+        if(!NIL_P(encoded))
+            return encoded;
+    }
+    if(!flags)
+        return value;
 
-static Reply * Reply_new() {
-    return (Reply *) malloc(sizeof(Reply));
+    encoded = rb_str_buf_new(CODEC_HEADER_SIZE + RSTRING_LEN(value));
+    Codec_write_header(RSTRING_PTR(encoded), flags, 0);
+    rb_str_set_len(encoded, CODEC_HEADER_SIZE);
+    return rb_str_buf_append(encoded, value);
 }
 
-static void Reply_free(Reply * reply) {
-    Executor_free(reply->executor);
-    free(reply);
+/* Turns what is stored back into a value */
+static VALUE Codec_decode(Codec * codec, const char * data, long length) {
+    const unsigned char * bytes = (const unsigned char *) data;
+    long header = CODEC_HEADER_SIZE, original;
+    VALUE value;
+    int flags;
+
+    if(length < CODEC_HEADER_SIZE || memcmp(data, CODEC_MAGIC, 2) || (bytes[2] & ~7))
+        return rb_str_new(data, length);
+    flags = bytes[2];
+
+    if(flags & (CODEC_ZLIB | CODEC_LZ)) {
+        header += CODEC_LENGTH_SIZE;
+        if(length < header)
+            rb_raise(cRedisError, "Corrupt compressed value");
+        original = bytes[3] | bytes[4] << 8 | bytes[5] << 16 | (long) bytes[6] << 24;
+        value = rb_str_new(NULL, original);
+        if(flags & CODEC_LZ) {
+            if(lzf_decompress(bytes + header, length - header, (unsigned char *) RSTRING_PTR(value), original) != original)
+                rb_raise(cRedisError, "Corrupt compressed value");
+        } else {
+#ifdef USE_ZLIB
+            uLongf size = original;
+            if(uncompress((Bytef *) RSTRING_PTR(value), &size, bytes + header, length - header) != Z_OK || (long) size != original)
+                rb_raise(cRedisError, "Corrupt compressed value");
+#else
+            rb_raise(cRedisError, "Value was compressed with zlib, which the extension was built without");
+#endif
+        }
+    } else {
+        value = rb_str_new(data + header, length - header);
+    }
+
+    if(!(flags & CODEC_SERIALIZED))
+        return value;
+    if(!codec || NIL_P(codec->serializer))
+        rb_raise(cRedisError, "Value was serialized, but there is no codec to load it");
+    return rb_funcall(codec->serializer, codec->load, 1, value);
 }
 
 
 /* Utility functions */
 
+static VALUE return_multibulk(Reply * reply);
+
+/* Numbers are parsed straight from the reply buffer. Redis integers are 64
+   bits wide, so the ones past 2^62 become Bignums. */
+static VALUE parse_integer(const char * data, size_t length) {
+    unsigned long long n = 0;
+    size_t i = 0;
+    int negative = length > 0 && data[0] == '-';
+
+    for(i = negative; i < length && data[i] >= '0' && data[i] <= '9'; i++)
+        n = n * 10 + (data[i] - '0');
+    if(negative)
+        return LL2NUM(n > (unsigned long long) LLONG_MAX ? LLONG_MIN : -(long long) n);
+    return ULL2NUM(n);
+}
+
+/* strtod needs a terminated string, which a bulk reply is not; anything
+   longer than a double needs is not a number Redis sent */
+static VALUE parse_double(const char * data, size_t length) {
+    char buffer[64];
+    char * end;
+    double value;
+
+    if(length == 0 || length >= sizeof(buffer))
+        rb_raise(cRedisError, "Expected a number from Redis");
+    memcpy(buffer, data, length);
+    buffer[length] = '\0';
+    value = strtod(buffer, &end);
+    if(end != buffer + length)
+        rb_raise(cRedisError, "Expected a number from Redis, got %s", buffer);
+    return DBL2NUM(value);
+}
+
 static VALUE return_value(Reply * reply) {
     switch(reply->reply_type) {
     case RT_INTEGER:
-        return INT2FIX(atoi(reply->data));
+        return parse_integer(reply->data, reply->length);
     case RT_OK:
         return rb_str_new(reply->data, reply->length);
     case RT_NONE:
@@ -51,157 +1204,4367 @@ static VALUE return_value(Reply * reply) {
         return Qnil;
     case RT_BULK:
         return rb_str_new(reply->data, reply->length);
+    case RT_MULTIBULK_NIL:
+        return Qnil;
+    case RT_MULTIBULK:
+        return return_multibulk(reply);
     case RT_ERROR:
-        rb_raise(cRedisError, reply->data);
+        rb_exc_raise(rb_exc_new(cRedisError, reply->data, reply->length));
     }
+    return Qnil;
 }
 
-/* API functions */
+/* Reads the elements following a multibulk reply straight into an array of
+   the right size. Every element has to be read, even if one of them is an
+   error, or the replies after this one would be out of step; errors are
+   put in the array instead of being raised. */
+static VALUE return_multibulk(Reply * reply) {
+    long i, count = (long) reply->length;
+    VALUE ary = rb_ary_new2(count);
+    Reply element;
 
-static VALUE Redis_initialize(VALUE self, VALUE conn_string) {
-    Redis * redis;
-    Data_Get_Struct(self, Redis, redis);
-    redis->connection_string = conn_string;
-    redis->connection = Connection_new(RSTRING_PTR(conn_string));
-    return self;
+    element.batch = reply->batch;
+    element.stats = reply->stats;
+    element.codec = reply->codec;
+    for(i = 0; i < count; i++) {
+        if(!Batch_next_reply(reply->batch, &(element.reply_type), &(element.data), &(element.length)))
+            break;
+        Stats_read(&element);
+        if(element.reply_type == RT_ERROR)
+            rb_ary_push(ary, rb_exc_new(cRedisError, element.data, element.length));
+        else
+            rb_ary_push(ary, return_value(&element));
+    }
+    return ary;
 }
 
-static VALUE Redis_connections(VALUE self) {
-    Redis * redis;
-    Data_Get_Struct(self, Redis, redis);
-    VALUE connections = rb_ary_new();
-    rb_ary_push(connections, redis->connection_string);
-    return connections;
-}
-
-
-REDIS_CMD_0(QUIT, quit, ANY)
-REDIS_CMD_1(AUTH, auth, STR, ANY)
-
-REDIS_CMD_1(EXISTS, exists, STR, BOOLEAN)
-REDIS_CMD_1(DEL, del, STR, ANY)
-REDIS_CMD_1(TYPE, type, STR, ANY)
-REDIS_CMD_0(RANDOMKEY, random_key, ANY)
-REDIS_CMD_2(RENAME, rename, STR, STR, STATUS)
-REDIS_CMD_2(RENAMENX, renamenx, STR, STR, STATUS)
-REDIS_CMD_0(DBSIZE, dbsize, ANY)
-REDIS_CMD_2(EXPIRE, expire, STR, INT, ANY)
-REDIS_CMD_2(EXPIREAT, expire_at, STR, INT, ANY)
-REDIS_CMD_1(TTL, ttl, STR, ANY)
-REDIS_CMD_1(SELECT, select, INT, ANY)
-REDIS_CMD_2(MOVE, move, STR, INT, STATUS)
-REDIS_CMD_0(FLUSHDB, flush_db, STATUS)
-REDIS_CMD_0(FLUSHALL, flush_all, STATUS)
-
-#define KEYS_RETURN \
-    VALUE ret = rb_str_split(rb_str_new(reply->data, reply->length), " ")
-
-REDIS_CMD_1(KEYS, keys, STR, KEYS_RETURN)
-
-REDIS_CMD_2(SET, set, STR, BLOB, ANY)
-REDIS_CMD_1(GET, get, STR, ANY)
-REDIS_CMD_2(GETSET, get_set, STR, BLOB, ANY)
-REDIS_CMD_2(SETNX, setnx, STR, BLOB, ANY)
-REDIS_CMD_1(INCR, incr, STR, ANY)
-REDIS_CMD_2(INCRBY, incrby, STR, INT, ANY)
-REDIS_CMD_1(DECR, decr, STR, ANY)
-REDIS_CMD_2(DECRBY, decrby, STR, INT, ANY)
-
-REDIS_CMD_2(RPUSH, rpush, STR, BLOB, ANY)
-REDIS_CMD_2(LPUSH, lpush, STR, BLOB, ANY)
-REDIS_CMD_1(LLEN, llen, STR, ANY)
-REDIS_CMD_3(LRANGE, lrange, STR, INT, INT, ANY)
-REDIS_CMD_3(LTRIM, ltrim, STR, INT, INT, ANY)
-REDIS_CMD_2(LINDEX, lindex, STR, INT, ANY)
-REDIS_CMD_3(LSET, lset, STR, INT, BLOB, ANY)
-REDIS_CMD_3(LREM, lrem, STR, INT, BLOB, ANY)
-REDIS_CMD_1(LPOP, lpop, STR, ANY)
-REDIS_CMD_1(RPOP, rpop, STR, ANY)
-REDIS_CMD_2(RPOPLPUSH, rpoplpush, STR, STR, ANY)
-
-REDIS_CMD_2(SADD, sadd, STR, BLOB, ANY)
-REDIS_CMD_2(SREM, srem, STR, BLOB, ANY)
-REDIS_CMD_1(SPOP, spop, STR, ANY)
-REDIS_CMD_3(SMOVE, smove, STR, STR, BLOB, ANY)
-REDIS_CMD_1(SCARD, scard, STR, ANY)
-REDIS_CMD_2(SISMEMBER, sismember, STR, BLOB, BOOLEAN)
-REDIS_CMD_1(SRANDMEMBER, srandmember, STR, ANY)
-
-REDIS_CMD_3(ZADD, zadd, STR, INT, BLOB, ANY)
-REDIS_CMD_2(ZREM, zrem, STR, BLOB, ANY)
-REDIS_CMD_3(ZINCRBY, zincrby, STR, INT, BLOB, ANY)
-REDIS_CMD_2(ZRANK, zrank, STR, BLOB, ANY)
-REDIS_CMD_2(ZREVRANK, zrevrank, STR, BLOB, ANY)
-REDIS_CMD_1(ZCARD, zcard, STR, ANY)
-REDIS_CMD_2(ZSCORE, zscore, STR, BLOB, INTEGER)
-REDIS_CMD_3(ZREMRANGEBYRANK, zremrangebyrank, STR, INT, INT, ANY)
-REDIS_CMD_3(ZREMRANGEBYSCORE, zremrangebyscore, STR, INT, INT, ANY)
-
-
-void Init_redis() {
+static VALUE return_boolean(Reply * reply) {
+    switch(reply->reply_type) {
+    case RT_INTEGER:
+        return *(reply->data) == '0' ? Qfalse : Qtrue;
+    case RT_ERROR:
+        return return_value(reply);
+    default:
+        rb_raise(cRedisError, "Unexpected return type from Redis");
+    }
+}
+
+static VALUE return_status(Reply * reply) {
+    switch(reply->reply_type) {
+    case RT_OK:
+        return Qtrue;
+    case RT_INTEGER:
+        /* This is retarded */
+        return *(reply->data) == '0' ? Qfalse : Qtrue;
+    case RT_ERROR:
+        return return_value(reply);
+    default:
+        rb_raise(cRedisError, "Unexpected return type from Redis");
+    }
+}
+
+/* Bulk replies of commands flagged CODEC, and the elements of multibulk
+   ones, are what Codec_encode stored */
+static VALUE return_decoded(Reply * reply) {
+    long i, count;
+    VALUE ary;
+    Reply element;
+
+    if(!reply->codec)
+        return return_value(reply);
+    if(reply->reply_type == RT_BULK)
+        return Codec_decode(reply->codec, reply->data, reply->length);
+    if(reply->reply_type != RT_MULTIBULK)
+        return return_value(reply);
+
+    count = (long) reply->length;
+    ary = rb_ary_new2(count);
+    element = *reply;
+    for(i = 0; i < count; i++) {
+        if(!Batch_next_reply(reply->batch, &(element.reply_type), &(element.data), &(element.length)))
+            break;
+        Stats_read(&element);
+        if(element.reply_type == RT_ERROR)
+            rb_ary_push(ary, rb_exc_new(cRedisError, element.data, element.length));
+        else if(element.reply_type == RT_BULK)
+            rb_ary_push(ary, Codec_decode(element.codec, element.data, element.length));
+        else
+            rb_ary_push(ary, return_value(&element));
+    }
+    return ary;
+}
+
+/* Scores and the like come back as bulk strings */
+static VALUE return_double(Reply * reply) {
+    switch(reply->reply_type) {
+    case RT_BULK:
+        return parse_double(reply->data, reply->length);
+    case RT_INTEGER:
+        return rb_Float(parse_integer(reply->data, reply->length));
+    default:
+        return return_value(reply);
+    }
+}
+
+/* Servers before Redis 2.0 answer KEYS with a single space separated bulk */
+static VALUE return_keys(Reply * reply) {
+    if(reply->reply_type == RT_BULK)
+        return rb_str_split(rb_str_new(reply->data, reply->length), " ");
+    return return_value(reply);
+}
+
+static VALUE return_hash(Reply * reply) {
+    VALUE ary, hash;
+    long i;
+
+    if(reply->reply_type != RT_MULTIBULK)
+        return return_value(reply);
+
+    ary = return_multibulk(reply);
+    hash = rb_hash_new();
+    for(i = 0; i + 1 < RARRAY_LEN(ary); i += 2)
+        rb_hash_aset(hash, RARRAY_AREF(ary, i), RARRAY_AREF(ary, i + 1));
+    return hash;
+}
+
+/* Combines the replies of a command that was sent to every node: counts are
+   added up, lists are concatenated and anything else is taken from the first
+   node. */
+static VALUE merge_replies(VALUE memo, VALUE value) {
+    if(memo == Qundef)
+        return value;
+    if(FIXNUM_P(memo) && FIXNUM_P(value))
+        return LONG2NUM(FIX2LONG(memo) + FIX2LONG(value));
+    if(RB_INTEGER_TYPE_P(memo) && RB_INTEGER_TYPE_P(value))
+        return rb_funcall(memo, '+', 1, value);
+    if(RB_TYPE_P(memo, T_ARRAY) && RB_TYPE_P(value, T_ARRAY))
+        return rb_ary_concat(memo, value);
+    return memo;
+}
+
+static VALUE next_reply(Batch * batch, ReplyHandler handler, Redis * redis) {
+    Reply reply;
+    reply.batch = batch;
+    reply.stats = redis->stats;
+    reply.codec = redis->codec;
+    if(!Batch_next_reply(batch, &(reply.reply_type), &(reply.data), &(reply.length)))
+        reply.reply_type = RT_NONE;
+    Stats_read(&reply);
+    return handler(&reply);
+}
+
+
+/* Command functions */
+
+static int Redis_node(Redis * redis, VALUE key) {
+    if(redis->connection_count == 1)
+        return 0;
+    StringValue(key);
+    return Ketama_get_server_ordinal(redis->ketama, RSTRING_PTR(key), RSTRING_LEN(key));
+}
+
+static void Command_route(Redis * redis, Command * cmd, VALUE key) {
+    int i;
+
+    if(NIL_P(key)) {
+        cmd->first = 0;
+        cmd->last = redis->connection_count - 1;
+    } else {
+        cmd->first = cmd->last = Redis_node(redis, key);
+    }
+
+    if(!redis->pipelined) {
+        for(i = cmd->first; i <= cmd->last; i++)
+            cmd->batches[i] = NULL;
+    }
+    if(cmd->fallbacks) {
+        for(i = cmd->first; i <= cmd->last; i++)
+            cmd->fallbacks[i] = NULL;
+    }
+
+    if(NIL_P(key) && cmd->cache && !command_read_only[cmd->id])
+        Cache_clear(cmd->cache);
+}
+
+/* The watch block a command is sent from, if any: either that of the
+   watcher itself or of the watcher a pipeline or transaction was made from */
+static Watch * Redis_watch_of(Redis * redis) {
+    Redis * parent;
+
+    if(redis->watch || NIL_P(redis->parent))
+        return redis->watch;
+    TypedData_Get_Struct(redis->parent, Redis, &redis_type, parent);
+    return parent->watch;
+}
+
+/* Read only commands are kept in fallbacks as well when the nodes have
+   replicas, to send them to the primaries if the replicas fail */
+static void Command_init(Redis * redis, Command * cmd, int id, VALUE key) {
+    cmd->id = id;
+    cmd->stats = redis->stats;
+    cmd->cache = redis->cache;
+    if(cmd->fallbacks && (!command_read_only[id] || Redis_watch_of(redis)))
+        cmd->fallbacks = NULL;
+    Command_route(redis, cmd, key);
+}
+
+static Batch * Command_batch(Command * cmd) {
+    if(!cmd->batches[cmd->node])
+        cmd->batches[cmd->node] = Batch_new();
+    return cmd->batches[cmd->node];
+}
+
+static Batch * Command_fallback(Command * cmd) {
+    if(!cmd->fallbacks[cmd->node])
+        cmd->fallbacks[cmd->node] = Batch_new();
+    return cmd->fallbacks[cmd->node];
+}
+
+/* Appends to the batch of the node being written, counting the bytes */
+static void Command_write(Command * cmd, const char * data, long length, int commands) {
+    Batch_write(Command_batch(cmd), data, length, commands);
+    if(cmd->fallbacks)
+        Batch_write(Command_fallback(cmd), data, length, commands);
+    if(cmd->stats)
+        cmd->stats->bytes_written += length;
+}
+
+static void Command_write_decimal(Command * cmd, long value) {
+    Batch_write_decimal(Command_batch(cmd), value);
+    if(cmd->fallbacks)
+        Batch_write_decimal(Command_fallback(cmd), value);
+    if(cmd->stats)
+        cmd->stats->bytes_written += decimal_length(value);
+}
+
+/* Drops a key the command is about to write from the near cache */
+static void Command_invalidate(Command * cmd, VALUE key) {
+    if(cmd->cache && !command_read_only[cmd->id])
+        Cache_invalidate(cmd->cache, key);
+}
+
+static void Command_invalidate_keys(Command * cmd, const VALUE * keys, long count, long step) {
+    long i;
+    for(i = 0; i < count; i += step)
+        Command_invalidate(cmd, keys[i]);
+}
+
+/* A command with several keys can only be sent when they all live on the
+   node its first key was routed to. */
+static void Command_check_key(Redis * redis, Command * cmd, VALUE key) {
+    if(redis->connection_count > 1 && Redis_node(redis, key) != cmd->first)
+        rb_raise(cRedisError, "Keys of a single command must live on the same server");
+}
+
+static void Command_check_keys(Redis * redis, Command * cmd, const VALUE * keys, long count, long step) {
+    long i;
+    for(i = step; i < count; i += step)
+        Command_check_key(redis, cmd, keys[i]);
+}
+
+
+/* Multibulk functions */
+
+static void write_multibulk_header(Command * cmd, long count) {
+    Command_write(cmd, "*", 1, 0);
+    Command_write_decimal(cmd, count);
+    Command_write(cmd, CRLF, sizeof(CRLF) - 1, 0);
+}
+
+static void write_bulk(Command * cmd, const char * data, long length) {
+    Command_write(cmd, "$", 1, 0);
+    Command_write_decimal(cmd, length);
+    Command_write(cmd, CRLF, sizeof(CRLF) - 1, 0);
+    Command_write(cmd, data, length, 0);
+    Command_write(cmd, CRLF, sizeof(CRLF) - 1, 0);
+}
+
+/* Strings are written as they are, anything else as its to_s */
+static void write_bulk_value(Command * cmd, VALUE value) {
+    if(!RB_TYPE_P(value, T_STRING))
+        value = rb_obj_as_string(value);
+    write_bulk(cmd, RSTRING_PTR(value), RSTRING_LEN(value));
+}
+
+typedef struct {
+    Redis * redis;
+    Batch ** batches;
+    Connection ** connections;
+    int first;
+    int last;
+    int result;
+    int command_id;
+    unsigned long long started;
+    Watch * watch;
+    int replicas;               /* send to a replica where there are any */
+    Node ** targets;            /* the node or replica each batch went to */
+} Execution;
+
+/* Whether a batch came back (1), timed out (0) or its connection failed
+   (-1), given the result of execute_timed. When a round trip gives up,
+   libredis aborts the batches still waiting with an error, so one without
+   an error came back even then. A connection that failed never got the
+   command, or lost it along with the reply. */
+static int batch_result(Batch * batch, int result) {
+    if(result > 0 || (batch && !Batch_error(batch)))
+        return 1;
+    return result < 0 && batch ? -1 : 0;
+}
+
+/* Executor_execute returns 0 for a timeout and for a connection that
+   failed alike, and the error texts of libredis are no contract. A round
+   trip that gave up before its timeout was up cannot have timed out, so
+   that is told apart by the time it took and returned as -1. */
+static int execute_timed(Executor * executor, int timeout) {
+    unsigned long long started = monotonic_nanoseconds();
+    int result = Executor_execute(executor, timeout);
+
+    if(result == 0 && monotonic_nanoseconds() - started < (unsigned long long) timeout * 1000000)
+        return -1;
+    return result;
+}
+
+static int is_watched(Execution * execution, int node) {
+    return execution->watch && execution->watch->node == node;
+}
+
+/* Replicas are picked by the power of two choices: of two random replicas
+   that are up, the one with the lower moving average of its latency. The
+   average of the other one decays a little, so a replica that was slow
+   once gets another go eventually. A replica that failed is left alone
+   for a while, and starts over. */
+
+#define REPLICA_LATENCY_WEIGHT 0.2
+#define REPLICA_LATENCY_DECAY 0.98
+#define REPLICA_DOWN_NANOSECONDS 1000000000ULL
+
+static unsigned long replica_random() {
+    static unsigned long state = 2463534242UL;
+
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    return state;
+}
+
+static Node * Node_pick_replica(Node * node) {
+    unsigned long long now = monotonic_nanoseconds();
+    int * up = ALLOCA_N(int, node->replica_count);
+    int i, count = 0, first, second;
+
+    for(i = 0; i < node->replica_count; i++) {
+        if(node->replicas[i].down_until <= now)
+            up[count++] = i;
+    }
+    if(count == 0)
+        return node;
+    if(count == 1)
+        return &(node->replicas[up[0]]);
+
+    first = replica_random() % count;
+    second = replica_random() % (count - 1);
+    if(second >= first)
+        second++;
+    if(node->replicas[up[second]].latency < node->replicas[up[first]].latency) {
+        i = first;
+        first = second;
+        second = i;
+    }
+    node->replicas[up[second]].latency *= REPLICA_LATENCY_DECAY;
+    return &(node->replicas[up[first]]);
+}
+
+static void Node_observe(Node * replica, int result, unsigned long long started) {
+    unsigned long long now = monotonic_nanoseconds();
+    double sample = (now - started) / 1000.0;
+
+    if(result <= 0) {
+        replica->down_until = now + REPLICA_DOWN_NANOSECONDS;
+        replica->latency = 0;
+    } else if(replica->latency == 0) {
+        replica->latency = sample;
+    } else {
+        replica->latency += REPLICA_LATENCY_WEIGHT * (sample - replica->latency);
+    }
+}
+
+typedef struct {
+    Executor * executor;
+    int timeout;
+    int result;
+} ExecutorRun;
+
+static void * run_executor_without_gvl(void * arg) {
+    ExecutorRun * run = (ExecutorRun *) arg;
+    run->result = execute_timed(run->executor, run->timeout);
+    return NULL;
+}
+
+/* Executes connections and batches added by hand, without the GVL */
+static int run_executor(Executor * executor, int timeout) {
+    ExecutorRun run;
+
+    run.executor = executor;
+    run.timeout = timeout;
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+    rb_thread_call_without_gvl(run_executor_without_gvl, &run, RUBY_UBF_IO, NULL);
+#else
+    run_executor_without_gvl(&run);
+#endif
+    return run.result;
+}
+
+/* Sends the setup of its node to each of the given connections, in one
+   round trip. Sets the result of each like batch_result, with 0 for one
+   that got an error reply, and returns the first error as an exception,
+   or nil. */
+static VALUE setup_connections(Redis * redis, Node ** nodes, Connection ** connections, int count, int * results) {
+    Batch ** batches = ALLOCA_N(Batch *, count);
+    Executor * executor = Executor_new();
+    VALUE error = Qnil;
+    ReplyType reply_type;
+    char * data, * message;
+    size_t length;
+    int i, j, result;
+
+    for(i = 0; i < count; i++) {
+        batches[i] = Batch_new();
+        Batch_write(batches[i], nodes[i]->setup, nodes[i]->setup_length, nodes[i]->setup_commands);
+        Executor_add(executor, connections[i], batches[i]);
+    }
+    result = run_executor(executor, redis->options.timeout);
+    Executor_free(executor);
+
+    for(i = 0; i < count; i++) {
+        results[i] = batch_result(batches[i], result);
+        if(results[i] <= 0 && NIL_P(error)) {
+            message = Batch_error(batches[i]);
+            error = rb_exc_new_str(results[i] < 0 ? cRedisConnectionError : cRedisTimeoutError,
+                                   rb_sprintf("Could not set up a connection to %s: %s", nodes[i]->address,
+                                              message ? message : Module_last_error(redis->module)));
+        }
+        for(j = 0; results[i] > 0 && j < nodes[i]->setup_commands; j++) {
+            if(!Batch_next_reply(batches[i], &reply_type, &data, &length)) {
+                results[i] = 0;
+                if(NIL_P(error))
+                    error = rb_exc_new_str(cRedisTimeoutError, rb_sprintf("Could not set up a connection to %s: no reply",
+                                                                          nodes[i]->address));
+            } else if(reply_type == RT_ERROR) {
+                results[i] = 0;
+                if(NIL_P(error))
+                    error = rb_exc_new_str(cRedisError, rb_sprintf("Could not set up a connection to %s: %.*s",
+                                                                   nodes[i]->address, (int) length, data));
+            }
+        }
+        Batch_free(batches[i]);
+    }
+    return error;
+}
+
+static void * execute_without_gvl(void * arg) {
+    Execution * execution = (Execution *) arg;
+    Executor * executor = Executor_new();
+    int i;
+
+    for(i = execution->first; i <= execution->last; i++) {
+        if(execution->batches[i])
+            Executor_add(executor, execution->connections[i], execution->batches[i]);
+    }
+    execution->result = execute_timed(executor, execution->redis->options.timeout);
+    Executor_free(executor);
+    return NULL;
+}
+
+/* Sends the setup of their node to the connections that have not had it */
+static void prepare_connections(Execution * execution) {
+    int count = 0, size = execution->last - execution->first + 1, i;
+    Node ** nodes = ALLOCA_N(Node *, size);
+    Connection ** connections = ALLOCA_N(Connection *, size);
+    int * results = ALLOCA_N(int, size);
+    VALUE error;
+
+    for(i = execution->first; i <= execution->last; i++) {
+        if(!execution->connections[i])
+            continue;
+        nodes[count] = is_watched(execution, i) ? &(execution->redis->nodes[i]) : execution->targets[i];
+        connections[count] = execution->connections[i];
+        if(!Node_is_ready(nodes[count], connections[count]))
+            count++;
+    }
+    if(!count)
+        return;
+
+    error = setup_connections(execution->redis, nodes, connections, count, results);
+    for(i = 0; i < count; i++) {
+        if(results[i] > 0)
+            Node_ready(nodes[i], connections[i]);
+    }
+    if(!NIL_P(error))
+        rb_exc_raise(error);
+}
+
+/* Checks out a connection for every node with a batch, always in node order
+   so two threads can never wait on each other, then waits for the replies
+   without holding the GVL so other threads can run in the meantime. Inside
+   a watch block the connection it holds is used instead. */
+static VALUE execute_checked_out(VALUE arg) {
+    Execution * execution = (Execution *) arg;
+    Node * node;
+    int i;
+
+    for(i = execution->first; i <= execution->last; i++) {
+        if(!execution->batches[i] || is_watched(execution, i))
+            continue;
+        node = &(execution->redis->nodes[i]);
+        if(execution->replicas && node->replica_count)
+            node = Node_pick_replica(node);
+        execution->targets[i] = node;
+        Node_check_held(node);
+    }
+
+    for(i = execution->first; i <= execution->last; i++) {
+        if(!execution->batches[i])
+            continue;
+        if(is_watched(execution, i))
+            execution->connections[i] = execution->watch->connection;
+        else
+            execution->connections[i] = Node_checkout(execution->targets[i]);
+    }
+    prepare_connections(execution);
+
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+    rb_thread_call_without_gvl(execute_without_gvl, execution, RUBY_UBF_IO, NULL);
+#else
+    execute_without_gvl(execution);
+#endif
+    return Qnil;
+}
+
+/* Every connection is judged by its own batch: one node timing out says
+   nothing about the connections of the others that answered */
+static VALUE checkin_connections(VALUE arg) {
+    Execution * execution = (Execution *) arg;
+    int i, result;
+
+    for(i = execution->first; i <= execution->last; i++) {
+        if(!execution->connections[i])
+            continue;
+        result = batch_result(execution->batches[i], execution->result);
+        if(is_watched(execution, i)) {
+            execution->watch->broken |= result <= 0;
+            continue;
+        }
+        Node_checkin(execution->targets[i], execution->connections[i], result);
+        if(execution->targets[i] != &(execution->redis->nodes[i]))
+            Node_observe(execution->targets[i], result, execution->started);
+    }
+    if(execution->redis->cache && !command_read_only[execution->command_id])
+        execution->redis->cache->generation++;
+    if(execution->redis->stats)
+        Stats_record(execution->redis->stats, execution->command_id, execution->result, execution->started);
+    return Qnil;
+}
+
+/* Sends every batch in the given range to its node, or a replica of it,
+   in one round trip. Returns the result of Executor_execute. */
+static int run_batches(Redis * redis, Batch ** batches, int first, int last, int command_id, int replicas) {
+    Execution execution;
+    int i;
+
+    execution.redis = redis;
+    execution.batches = batches;
+    execution.connections = ALLOCA_N(Connection *, redis->connection_count);
+    execution.targets = ALLOCA_N(Node *, redis->connection_count);
+    execution.first = first;
+    execution.last = last;
+    execution.result = -1;
+    execution.command_id = command_id;
+    execution.started = redis->stats || redis->replicated ? monotonic_nanoseconds() : 0;
+    execution.watch = Redis_watch_of(redis);
+    execution.replicas = replicas;
+    for(i = first; i <= last; i++)
+        execution.connections[i] = NULL;
+
+    rb_ensure(execute_checked_out, (VALUE) &execution, checkin_connections, (VALUE) &execution);
+    pool_report();
+    return execution.result;
+}
+
+/* Sends every batch in the given range to its node in one round trip.
+   Raises RedisTimeoutError or RedisConnectionError with the first error
+   found if anything failed. */
+static void execute_batches(Redis * redis, Batch ** batches, int first, int last, int command_id) {
+    char * error = NULL;
+    int i, result;
+
+    if((result = run_batches(redis, batches, first, last, command_id, 0)) > 0)
+        return;
+    for(i = first; i <= last && !error; i++) {
+        if(batches[i] && (error = Batch_error(batches[i])))
+            result = batch_result(batches[i], result);
+    }
+    rb_raise(result < 0 ? cRedisConnectionError : cRedisTimeoutError, "%s", error ? error : Module_last_error(redis->module));
+}
+
+typedef struct {
+    Redis * redis;
+    Command * cmd;
+    ReplyHandler handler;
+} CommandCall;
+
+/* A command with fallbacks goes to replicas first, and to the primaries
+   only when that fails */
+static VALUE run_command(VALUE arg) {
+    CommandCall * call = (CommandCall *) arg;
+    Command * cmd = call->cmd;
+    Batch ** batches = cmd->batches;
+    VALUE ret = Qundef;
+    int i;
+
+    if(!cmd->fallbacks) {
+        execute_batches(call->redis, batches, cmd->first, cmd->last, cmd->id);
+    } else if(run_batches(call->redis, batches, cmd->first, cmd->last, cmd->id, 1) <= 0) {
+        batches = cmd->fallbacks;
+        execute_batches(call->redis, batches, cmd->first, cmd->last, cmd->id);
+    }
+    for(i = cmd->first; i <= cmd->last; i++)
+        ret = merge_replies(ret, next_reply(batches[i], call->handler, call->redis));
+    return ret;
+}
+
+static VALUE free_command_batches(VALUE arg) {
+    Command * cmd = ((CommandCall *) arg)->cmd;
+    int i;
+
+    for(i = cmd->first; i <= cmd->last; i++) {
+        if(cmd->batches[i])
+            Batch_free(cmd->batches[i]);
+        cmd->batches[i] = NULL;
+        if(cmd->fallbacks && cmd->fallbacks[i])
+            Batch_free(cmd->fallbacks[i]);
+    }
+    return Qnil;
+}
+
+static VALUE Pipeline_queue(Redis * redis, Command * cmd, ReplyHandler handler);
+
+static VALUE Command_execute(Redis * redis, Command * cmd, ReplyHandler handler) {
+    CommandCall call;
+
+    if(redis->pipelined)
+        return Pipeline_queue(redis, cmd, handler);
+
+    call.redis = redis;
+    call.cmd = cmd;
+    call.handler = handler;
+    return rb_ensure(run_command, (VALUE) &call, free_command_batches, (VALUE) &call);
+}
+
+
+/* Future functions */
+
+static VALUE Future_new() {
+    VALUE future = rb_obj_alloc(cRedisFuture);
+    rb_ivar_set(future, id_ready, Qfalse);
+    return future;
+}
+
+static void Future_set(VALUE future, VALUE value) {
+    rb_ivar_set(future, id_value, value);
+    rb_ivar_set(future, id_ready, Qtrue);
+}
+
+static VALUE Future_ready(VALUE self) {
+    return rb_ivar_get(self, id_ready);
+}
+
+static void Async_wait(VALUE async, VALUE future);
+
+/* Returns the reply, raising it if it was an error. A future returned by
+   Redis#async waits for its reply; one from a pipeline raises until the
+   pipeline has been executed. */
+static VALUE Future_value(VALUE self) {
+    VALUE value;
+
+    if(!RTEST(rb_ivar_get(self, id_ready))) {
+        if(!rb_ivar_defined(self, id_async))
+            rb_raise(cRedisError, "Value not available until the pipeline has been executed");
+        Async_wait(rb_ivar_get(self, id_async), self);
+    }
+
+    value = rb_ivar_get(self, id_value);
+    if(rb_obj_is_kind_of(value, rb_eException))
+        rb_exc_raise(value);
+    return value;
+}
+
+
+/* Pipeline functions */
+
+static VALUE Pipeline_queue(Redis * redis, Command * cmd, ReplyHandler handler) {
+    VALUE future = Future_new();
+
+    if(redis->queue_length == redis->queue_capacity) {
+        redis->queue_capacity = redis->queue_capacity ? redis->queue_capacity * 2 : 16;
+        REALLOC_N(redis->queue, QueuedReply, redis->queue_capacity);
+    }
+    redis->queue[redis->queue_length].handler = handler;
+    redis->queue[redis->queue_length].node = cmd->first == cmd->last ? cmd->first : -1;
+    redis->queue[redis->queue_length].script = -1;
+    redis->queue_length++;
+    rb_ary_push(redis->futures, future);
+    return future;
+}
+
+static void Pipeline_reset(Redis * redis) {
+    int i;
+
+    for(i = 0; i < redis->connection_count; i++) {
+        if(redis->batches[i]) {
+            Batch_free(redis->batches[i]);
+            redis->batches[i] = NULL;
+        }
+    }
+    redis->queue_length = 0;
+    redis->futures = rb_ary_new();
+}
+
+typedef struct {
+    Redis * redis;
+    Batch ** batches;
+    QueuedReply * queued;
+} QueuedCall;
+
+/* Like next_reply, and a script run from a pipeline is marked loaded on
+   the node, or not, by its reply */
+static VALUE next_queued_reply(QueuedCall * call, int node) {
+    Reply reply;
+
+    reply.batch = call->batches[node];
+    reply.stats = call->redis->stats;
+    reply.codec = call->redis->codec;
+    if(!Batch_next_reply(reply.batch, &(reply.reply_type), &(reply.data), &(reply.length)))
+        reply.reply_type = RT_NONE;
+    Stats_read(&reply);
+    if(call->queued->script >= 0)
+        Scripts_note(call->redis->scripts, call->queued->script, call->queued->version, node, &reply);
+    return call->queued->handler(&reply);
+}
+
+static VALUE read_queued_reply(VALUE arg) {
+    QueuedCall * call = (QueuedCall *) arg;
+    VALUE ret = Qundef;
+    int i;
+
+    if(call->queued->node >= 0)
+        return next_queued_reply(call, call->queued->node);
+
+    for(i = 0; i < call->redis->connection_count; i++)
+        ret = merge_replies(ret, next_queued_reply(call, i));
+    return ret;
+}
+
+
+/* API functions */
+
+/* The path of a unix socket, given as "unix:///path", "unix:/path" or
+   "/path", or NULL for "host:port" */
+static const char * unix_socket_path(const char * address) {
+    if(!strncmp(address, "unix:", 5))
+        address += 5;
+    else if(address[0] != '/')
+        return NULL;
+    return strncmp(address, "//", 2) ? address : address + 2;
+}
+
+static VALUE check_address(VALUE address) {
+    address = rb_str_new_frozen(StringValue(address));
+    if(unix_socket_path(RSTRING_PTR(address)) && !*unix_socket_path(RSTRING_PTR(address)))
+        rb_raise(rb_eArgError, "%s: no path to a unix socket", RSTRING_PTR(address));
+    return address;
+}
+
+static void Redis_add_server(Redis * redis, VALUE server, int pool_size) {
+    VALUE address = server;
+    unsigned long weight = DEFAULT_WEIGHT;
+    char * colon;
+    int port = DEFAULT_PORT;
+
+    if(RB_TYPE_P(server, T_ARRAY)) {
+        address = rb_ary_entry(server, 0);
+        if(RARRAY_LEN(server) > 1)
+            weight = NUM2ULONG(rb_ary_entry(server, 1));
+    }
+    address = check_address(address);
+
+    Node_init(&(redis->nodes[redis->connection_count++]), StringValueCStr(address), pool_size, &(redis->options));
+    rb_ary_push(redis->connection_strings, address);
+
+    /* A unix socket has no port, so its whole address stands in for the host */
+    if(redis->ketama && unix_socket_path(RSTRING_PTR(address))) {
+        Ketama_add_server(redis->ketama, RSTRING_PTR(address), 0, weight);
+    } else if(redis->ketama) {
+        VALUE host = address;
+        colon = strrchr(RSTRING_PTR(address), ':');
+        if(colon) {
+            host = rb_str_new(RSTRING_PTR(address), colon - RSTRING_PTR(address));
+            port = atoi(colon + 1);
+        }
+        Ketama_add_server(redis->ketama, StringValueCStr(host), port, weight);
+    }
+}
+
+/* Takes a list of replica addresses for a single server, or one such list
+   per server */
+static void Redis_add_replicas(Redis * redis, VALUE replicas, int pool_size) {
+    Node * node;
+    VALUE list;
+    long i, j;
+
+    Check_Type(replicas, T_ARRAY);
+    if(redis->connection_count == 1 && !RB_TYPE_P(rb_ary_entry(replicas, 0), T_ARRAY))
+        replicas = rb_ary_new3(1, replicas);
+    if(RARRAY_LEN(replicas) != redis->connection_count)
+        rb_raise(rb_eArgError, "replicas must have a list of replicas for every server");
+
+    for(i = 0; i < redis->connection_count; i++) {
+        list = rb_Array(rb_ary_entry(replicas, i));
+        node = &(redis->nodes[i]);
+        node->replicas = ALLOC_N(Node, RARRAY_LEN(list));
+        for(j = 0; j < RARRAY_LEN(list); j++) {
+            VALUE address = check_address(rb_ary_entry(list, j));
+            Node_init(&(node->replicas[node->replica_count++]), StringValueCStr(address), pool_size, &(redis->options));
+        }
+        redis->replicated |= node->replica_count > 0;
+    }
+}
+
+static Cache * Redis_cache_from_option(VALUE option) {
+    size_t max_bytes = DEFAULT_CACHE_BYTES;
+    double ttl = 0;
+    VALUE value;
+
+    if(RB_TYPE_P(option, T_HASH)) {
+        value = rb_hash_aref(option, ID2SYM(rb_intern("max_bytes")));
+        if(!NIL_P(value))
+            max_bytes = NUM2SIZET(value);
+        value = rb_hash_aref(option, ID2SYM(rb_intern("ttl")));
+        if(!NIL_P(value))
+            ttl = NUM2DBL(value);
+        if(ttl < 0)
+            rb_raise(rb_eArgError, "near cache ttl must not be negative");
+    }
+    return Cache_new(max_bytes, (unsigned long long) (ttl * 1e9));
+}
+
+static int milliseconds_option(VALUE options, const char * name, int value) {
+    VALUE option = rb_hash_aref(options, ID2SYM(rb_intern(name)));
+    double seconds;
+
+    if(NIL_P(option))
+        return value;
+    seconds = NUM2DBL(option);
+    if(seconds <= 0)
+        rb_raise(rb_eArgError, "%s must be positive", name);
+    return seconds * 1000 < 1 ? 1 : (int) (seconds * 1000);
+}
+
+static void Redis_connection_options(ConnectionOptions * connection, VALUE options) {
+    VALUE option;
+
+    connection->timeout = milliseconds_option(options, "timeout", connection->timeout);
+    connection->connect_timeout = milliseconds_option(options, "connect_timeout", connection->connect_timeout);
+    option = rb_hash_aref(options, ID2SYM(rb_intern("nodelay")));
+    if(!NIL_P(option))
+        connection->nodelay = RTEST(option);
+    connection->keepalive = RTEST(rb_hash_aref(options, ID2SYM(rb_intern("keepalive"))));
+    option = rb_hash_aref(options, ID2SYM(rb_intern("send_buffer")));
+    if(!NIL_P(option))
+        connection->send_buffer = NUM2INT(option);
+    option = rb_hash_aref(options, ID2SYM(rb_intern("receive_buffer")));
+    if(!NIL_P(option))
+        connection->receive_buffer = NUM2INT(option);
+    option = rb_hash_aref(options, ID2SYM(rb_intern("reconnect_attempts")));
+    if(!NIL_P(option))
+        connection->reconnect_attempts = NUM2INT(option);
+    option = rb_hash_aref(options, ID2SYM(rb_intern("reconnect_delay")));
+    if(!NIL_P(option))
+        connection->reconnect_delay = NUM2DBL(option);
+    if(connection->reconnect_attempts < 0 || connection->reconnect_delay < 0)
+        rb_raise(rb_eArgError, "reconnect_attempts and reconnect_delay must not be negative");
+    option = rb_hash_aref(options, ID2SYM(rb_intern("db")));
+    if(!NIL_P(option) && (connection->db = NUM2INT(option)) < 0)
+        rb_raise(rb_eArgError, "db must not be negative");
+    option = rb_hash_aref(options, ID2SYM(rb_intern("password")));
+    if(!NIL_P(option))
+        connection->password = rb_str_new_frozen(StringValue(option));
+}
+
+/* Makes the password and db of an instance the setup of its nodes and
+   their replicas, see Node_set_setup */
+static void Redis_setup(Redis * redis) {
+    VALUE setup = rb_str_buf_new(64);
+    int commands = 0, i;
+
+    if(!NIL_P(redis->options.password)) {
+        rb_str_buf_cat_ascii(setup, "*2" CRLF "$4" CRLF "AUTH" CRLF);
+        rb_str_catf(setup, "$%ld" CRLF, RSTRING_LEN(redis->options.password));
+        rb_str_buf_append(setup, redis->options.password);
+        rb_str_buf_cat_ascii(setup, CRLF);
+        commands++;
+    }
+    if(redis->options.db >= 0) {
+        rb_str_buf_cat_ascii(setup, "*2" CRLF "$6" CRLF "SELECT" CRLF);
+        rb_str_catf(setup, "$%d" CRLF "%d" CRLF, snprintf(NULL, 0, "%d", redis->options.db), redis->options.db);
+        commands++;
+    }
+    for(i = 0; i < redis->connection_count; i++)
+        Node_set_setup(&(redis->nodes[i]), RSTRING_PTR(setup), RSTRING_LEN(setup), commands);
+}
+
+/* Accepts a single "host:port" string, or an array of servers to shard the
+   keyspace over. Each server in the array is either a "host:port" string
+   or a ["host:port", weight] pair. A unix socket is given by its path, as
+   "unix:///tmp/redis.sock" or just "/tmp/redis.sock".
+
+   Options:
+     :pool_size - connections kept per server, shared by all threads
+     :stats      - keep latency and traffic counters, see Redis#stats
+     :near_cache - cache GET replies in process; true, or a hash with
+                   :max_bytes (16mb by default) and :ttl in seconds
+     :replicas   - addresses of replicas to send read only commands to: a
+                   list for a single server, or a list per server
+     :codec      - serializes the values of set, get and the like: :marshal,
+                   :json or an object with dump and load
+     :compression - compresses those values, with :zlib or :lz
+     :compress_threshold - the size from which values are compressed, 1kb
+                   by default
+     :timeout    - seconds to wait for the replies of a round trip, 0.5 by
+                   default
+     :reconnect_attempts - times a command that only reads is sent again
+                   when its connection was dropped, 1 by default
+     :reconnect_delay - seconds to wait before the second attempt, doubled
+                   for every one after that, 0.05 by default
+     :auto_pipeline - send the commands of threads that run at the same
+                   time together, see AutoPipeline_call
+     :password, :db - sent as AUTH and SELECT on every connection before
+                   its first command
+     :connect_timeout - seconds to wait for a connection, 1 by default
+     :nodelay    - set TCP_NODELAY, true by default
+     :keepalive  - send TCP keepalives
+     :send_buffer, :receive_buffer - socket buffer sizes in bytes */
+static VALUE Redis_initialize(int argc, VALUE * argv, VALUE self) {
+    Redis * redis;
+    VALUE servers, options, option;
+    long i, count;
+    int pool_size = DEFAULT_POOL_SIZE;
+
+    rb_scan_args(argc, argv, "11", &servers, &options);
+    TypedData_Get_Struct(self, Redis, &redis_type, redis);
+    if(redis->nodes)
+        rb_raise(cRedisError, "Redis instance is already initialized");
+
+    if(!NIL_P(options)) {
+        Check_Type(options, T_HASH);
+        option = rb_hash_aref(options, ID2SYM(rb_intern("pool_size")));
+        if(!NIL_P(option))
+            pool_size = NUM2INT(option);
+        if(pool_size < 1)
+            rb_raise(rb_eArgError, "pool_size must be at least 1");
+        if(RTEST(rb_hash_aref(options, ID2SYM(rb_intern("stats")))))
+            redis->stats = ZALLOC(Stats);
+        option = rb_hash_aref(options, ID2SYM(rb_intern("near_cache")));
+        if(RTEST(option))
+            redis->cache = Redis_cache_from_option(option);
+        Redis_connection_options(&(redis->options), options);
+        if(!NIL_P(rb_hash_aref(options, ID2SYM(rb_intern("codec")))) ||
+           !NIL_P(rb_hash_aref(options, ID2SYM(rb_intern("compression"))))) {
+            redis->codec = ZALLOC(Codec);
+            redis->codec->serializer = Qnil;
+            Codec_configure(redis->codec, options);
+        }
+        if(RTEST(rb_hash_aref(options, ID2SYM(rb_intern("auto_pipeline")))))
+            redis->auto_pipeline = AutoPipeline_new();
+    }
+
+    if(!RB_TYPE_P(servers, T_ARRAY))
+        servers = rb_ary_new3(1, servers);
+    count = RARRAY_LEN(servers);
+    if(count == 0)
+        rb_raise(rb_eArgError, "at least one server is required");
+
+    redis->nodes = ALLOC_N(Node, count);
+    redis->connection_strings = rb_ary_new2(count);
+    redis->scripts = Scripts_new();
+    if(count > 1)
+        redis->ketama = Ketama_new();
+
+    for(i = 0; i < count; i++)
+        Redis_add_server(redis, rb_ary_entry(servers, i), pool_size);
+
+    if(redis->ketama)
+        Ketama_create_continuum(redis->ketama);
+
+    if(!NIL_P(options)) {
+        option = rb_hash_aref(options, ID2SYM(rb_intern("replicas")));
+        if(!NIL_P(option))
+            Redis_add_replicas(redis, option, pool_size);
+    }
+    if(redis->options.db >= 0 || !NIL_P(redis->options.password))
+        Redis_setup(redis);
+    return self;
+}
+
+static VALUE Redis_connections(VALUE self) {
+    Redis * redis;
+    TypedData_Get_Struct(self, Redis, &redis_type, redis);
+    return rb_ary_dup(redis->connection_strings);
+}
+
+/* The replicas of every server with the moving average of their latency
+   in seconds, nil before the first command, and whether they are up */
+static VALUE Redis_replicas(VALUE self) {
+    Redis * redis;
+    Node * replica;
+    VALUE replicas, info;
+    int i, j;
+
+    TypedData_Get_Struct(self, Redis, &redis_type, redis);
+    replicas = rb_ary_new();
+    for(i = 0; i < redis->connection_count; i++) {
+        for(j = 0; j < redis->nodes[i].replica_count; j++) {
+            replica = &(redis->nodes[i].replicas[j]);
+            info = rb_hash_new();
+            rb_hash_aset(info, ID2SYM(rb_intern("address")), rb_str_new_cstr(replica->address));
+            rb_hash_aset(info, ID2SYM(rb_intern("primary")), rb_ary_entry(redis->connection_strings, i));
+            rb_hash_aset(info, ID2SYM(rb_intern("latency")), replica->latency ? DBL2NUM(replica->latency / 1e6) : Qnil);
+            rb_hash_aset(info, ID2SYM(rb_intern("up")), replica->down_until <= monotonic_nanoseconds() ? Qtrue : Qfalse);
+            rb_ary_push(replicas, info);
+        }
+    }
+    return replicas;
+}
+
+/* Returns the counters kept since the instance was created or last reset,
+   or nil if it was created without the :stats option. Pipelines count
+   towards the instance they were made from, as a single PIPELINE command.
+   Latencies include waiting for a free connection; the histogram maps the
+   upper bound of each bucket in microseconds to the number of calls. */
+static VALUE Redis_stats(VALUE self) {
+    Redis * redis;
+    VALUE stats, commands;
+    int i;
+
+    TypedData_Get_Struct(self, Redis, &redis_type, redis);
+    if(!redis->stats)
+        return Qnil;
+
+    commands = rb_hash_new();
+    for(i = 0; i < redis->stats->command_count; i++) {
+        if(redis->stats->commands[i].calls)
+            rb_hash_aset(commands, rb_str_new_cstr(command_names[i]), CommandStats_to_hash(&(redis->stats->commands[i])));
+    }
+
+    stats = rb_hash_new();
+    rb_hash_aset(stats, ID2SYM(rb_intern("bytes_written")), ULL2NUM(redis->stats->bytes_written));
+    rb_hash_aset(stats, ID2SYM(rb_intern("bytes_read")), ULL2NUM(redis->stats->bytes_read));
+    rb_hash_aset(stats, ID2SYM(rb_intern("error_replies")), ULL2NUM(redis->stats->error_replies));
+    rb_hash_aset(stats, ID2SYM(rb_intern("commands")), commands);
+    return stats;
+}
+
+static VALUE Redis_reset_stats(VALUE self) {
+    Redis * redis;
+    TypedData_Get_Struct(self, Redis, &redis_type, redis);
+
+    if(redis->stats) {
+        xfree(redis->stats->commands);
+        MEMZERO(redis->stats, Stats, 1);
+    }
+    return Qnil;
+}
+
+/* Hit and miss counters of the near cache, or nil if it is not enabled */
+static VALUE Redis_near_cache_stats(VALUE self) {
+    Redis * redis;
+    VALUE stats;
+
+    TypedData_Get_Struct(self, Redis, &redis_type, redis);
+    if(!redis->cache)
+        return Qnil;
+
+    stats = rb_hash_new();
+    rb_hash_aset(stats, ID2SYM(rb_intern("hits")), ULL2NUM(redis->cache->hits));
+    rb_hash_aset(stats, ID2SYM(rb_intern("misses")), ULL2NUM(redis->cache->misses));
+    rb_hash_aset(stats, ID2SYM(rb_intern("evictions")), ULL2NUM(redis->cache->evictions));
+    rb_hash_aset(stats, ID2SYM(rb_intern("invalidations")), ULL2NUM(redis->cache->invalidations));
+    rb_hash_aset(stats, ID2SYM(rb_intern("entries")), SIZET2NUM(RHASH_SIZE(redis->cache->index)));
+    rb_hash_aset(stats, ID2SYM(rb_intern("bytes")), SIZET2NUM(redis->cache->bytes));
+    return stats;
+}
+
+/* Drops the given keys from the near cache, or all of it without keys.
+   Meant for keys that were changed by other clients, for instance as
+   reported by server assisted client side caching. */
+static VALUE Redis_invalidate(int argc, VALUE * argv, VALUE self) {
+    Redis * redis;
+    int i;
+
+    TypedData_Get_Struct(self, Redis, &redis_type, redis);
+    if(!redis->cache)
+        return Qnil;
+    if(argc == 0)
+        Cache_clear(redis->cache);
+    for(i = 0; i < argc; i++)
+        Cache_invalidate(redis->cache, argv[i]);
+    return Qnil;
+}
+
+/* Bytes of heap memory currently held by libredis, for all instances */
+static VALUE Redis_allocated_bytes(VALUE self) {
+    return SIZET2NUM(Module_get_allocated(module));
+}
+
+/* Lets an instance borrow the servers, stats and cache of another one */
+static Redis * Redis_share(VALUE self, VALUE parent) {
+    Redis * redis, * parent_redis;
+
+    if(!rb_obj_is_kind_of(parent, cRedis))
+        rb_raise(rb_eTypeError, "expected a Redis instance");
+
+    TypedData_Get_Struct(self, Redis, &redis_type, redis);
+    TypedData_Get_Struct(parent, Redis, &redis_type, parent_redis);
+    if(!parent_redis->nodes)
+        rb_raise(cRedisError, "Redis instance is not initialized");
+    redis->parent = parent;
+    redis->connection_strings = parent_redis->connection_strings;
+    redis->nodes = parent_redis->nodes;
+    redis->connection_count = parent_redis->connection_count;
+    redis->ketama = parent_redis->ketama;
+    redis->stats = parent_redis->stats;
+    redis->cache = parent_redis->cache;
+    redis->scripts = parent_redis->scripts;
+    redis->codec = parent_redis->codec;
+    redis->auto_pipeline = parent_redis->auto_pipeline;
+    redis->options = parent_redis->options;
+    redis->replicated = parent_redis->replicated;
+    return redis;
+}
+
+static VALUE Pipeline_initialize(VALUE self, VALUE parent) {
+    Redis * redis = Redis_share(self, parent);
+
+    redis->pipelined = 1;
+    redis->batches = ZALLOC_N(Batch *, redis->connection_count);
+    redis->futures = rb_ary_new();
+    return self;
+}
+
+/* Reads the reply of every queued command into its future */
+static VALUE Pipeline_read_replies(Redis * redis) {
+    long i, count = redis->queue_length;
+    VALUE futures = redis->futures;
+    VALUE results = rb_ary_new2(count);
+
+    for(i = 0; i < count; i++) {
+        QueuedCall call;
+        int state = 0;
+        VALUE value;
+
+        call.redis = redis;
+        call.batches = redis->batches;
+        call.queued = &(redis->queue[i]);
+        value = rb_protect(read_queued_reply, (VALUE) &call, &state);
+        if(state) {
+            value = rb_errinfo();
+            rb_set_errinfo(Qnil);
+        }
+        Future_set(RARRAY_AREF(futures, i), value);
+        rb_ary_push(results, value);
+    }
+    return results;
+}
+
+static VALUE Pipeline_run(VALUE self) {
+    Redis * redis;
+    TypedData_Get_Struct(self, Redis, &redis_type, redis);
+
+    execute_batches(redis, redis->batches, 0, redis->connection_count - 1, pipeline_command_id);
+    return Pipeline_read_replies(redis);
+}
+
+static VALUE Pipeline_discard(VALUE self) {
+    Redis * redis;
+    TypedData_Get_Struct(self, Redis, &redis_type, redis);
+    Pipeline_reset(redis);
+    return Qnil;
+}
+
+/* Sends all queued commands in a single round trip. Returns an array with
+   one result per command; commands that failed get their RedisError in
+   place of a result. */
+static VALUE Pipeline_execute(VALUE self) {
+    Redis * redis;
+    TypedData_Get_Struct(self, Redis, &redis_type, redis);
+
+    if(redis->queue_length == 0)
+        return rb_ary_new();
+    return rb_ensure(Pipeline_run, self, Pipeline_discard, self);
+}
+
+static VALUE Redis_pipelined(VALUE self) {
+    Redis * redis;
+    VALUE pipeline;
+
+    TypedData_Get_Struct(self, Redis, &redis_type, redis);
+    if(redis->pipelined) {
+        rb_yield(self);
+        return Qnil;
+    }
+
+    pipeline = rb_class_new_instance(1, &self, cRedisPipeline);
+    rb_yield(pipeline);
+    return Pipeline_execute(pipeline);
+}
+
+
+/* Transaction functions
+
+   Redis#multi queues commands like a pipeline, between a MULTI and an
+   EXEC, and sends all of it in one batch: a transaction takes a single
+   round trip. All of its commands have to go to the same server. The
+   server answers MULTI and every queued command with a status, which are
+   read past, and EXEC with the results of the commands.
+
+   Redis#watch holds one connection for the duration of its block, so the
+   WATCH, the reads made in the block and the transaction that follows all
+   go over it. When a watched key changes before EXEC, the server drops the
+   transaction and the block is run again. */
+
+#define MULTI_REQUEST "*1\r\n$5\r\nMULTI\r\n"
+#define EXEC_REQUEST "*1\r\n$4\r\nEXEC\r\n"
+
+/* Starts every batch with MULTI; only the batch of the node the commands
+   went to is ever sent */
+static void Transaction_begin(Redis * redis) {
+    int i;
+
+    for(i = 0; i < redis->connection_count; i++) {
+        redis->batches[i] = Batch_new();
+        Batch_write(redis->batches[i], MULTI_REQUEST, sizeof(MULTI_REQUEST) - 1, 1);
+    }
+}
+
+static VALUE Transaction_initialize(VALUE self, VALUE parent) {
+    Redis * redis;
+
+    Pipeline_initialize(self, parent);
+    TypedData_Get_Struct(self, Redis, &redis_type, redis);
+    Transaction_begin(redis);
+    return self;
+}
+
+/* The node all queued commands go to */
+static int Transaction_node(Redis * redis, Watch * watch) {
+    int node = redis->queue[0].node;
+    long i;
+
+    for(i = 1; i < redis->queue_length; i++) {
+        if(redis->queue[i].node != node)
+            node = -2;
+    }
+    if(node == -1 && redis->connection_count == 1)
+        node = 0;
+    if(node < 0)
+        rb_raise(cRedisError, "The commands of a transaction must all go to the same server");
+    if(watch && watch->node != node)
+        rb_raise(cRedisError, "A transaction must go to the server of the watched keys");
+    return node;
+}
+
+static VALUE Transaction_run(VALUE self) {
+    Redis * redis;
+    Watch * watch;
+    Batch * batch;
+    Reply reply;
+    VALUE error = Qnil;
+    long i;
+    int node;
+
+    TypedData_Get_Struct(self, Redis, &redis_type, redis);
+    watch = Redis_watch_of(redis);
+    node = Transaction_node(redis, watch);
+    batch = redis->batches[node];
+    Batch_write(batch, EXEC_REQUEST, sizeof(EXEC_REQUEST) - 1, 1);
+    if(redis->stats)
+        redis->stats->bytes_written += sizeof(MULTI_REQUEST) + sizeof(EXEC_REQUEST) - 2;
+
+    execute_batches(redis, redis->batches, node, node, multi_command_id);
+    if(watch)
+        watch->active = 0;
+
+    /* The replies to MULTI and to queueing each command */
+    reply.batch = batch;
+    reply.stats = redis->stats;
+    reply.codec = redis->codec;
+    for(i = 0; i <= redis->queue_length; i++) {
+        if(!Batch_next_reply(batch, &(reply.reply_type), &(reply.data), &(reply.length)))
+            rb_raise(cRedisError, "Missing reply to a queued command");
+        Stats_read(&reply);
+        if(reply.reply_type == RT_ERROR && NIL_P(error))
+            error = rb_exc_new(cRedisError, reply.data, reply.length);
+    }
+
+    if(!Batch_next_reply(batch, &(reply.reply_type), &(reply.data), &(reply.length)))
+        rb_raise(cRedisError, "Missing reply to EXEC");
+    Stats_read(&reply);
+    switch(reply.reply_type) {
+    case RT_MULTIBULK:
+        break;
+    case RT_MULTIBULK_NIL:
+        if(watch)
+            watch->aborted = 1;
+        for(i = 0; i < redis->queue_length; i++)
+            Future_set(RARRAY_AREF(redis->futures, i), Qnil);
+        return Qnil;
+    case RT_ERROR:
+        rb_exc_raise(NIL_P(error) ? rb_exc_new(cRedisError, reply.data, reply.length) : error);
+    default:
+        rb_raise(cRedisError, "Unexpected reply to EXEC");
+    }
+
+    for(i = 0; i < redis->queue_length; i++)
+        redis->queue[i].node = node;
+    return Pipeline_read_replies(redis);
+}
+
+static VALUE Transaction_discard(VALUE self) {
+    Redis * redis;
+    TypedData_Get_Struct(self, Redis, &redis_type, redis);
+    Pipeline_reset(redis);
+    Transaction_begin(redis);
+    return Qnil;
+}
+
+/* Sends MULTI, all queued commands and EXEC in a single round trip.
+   Returns an array with one result per command, or nil if a watched key
+   changed and the server dropped the transaction. */
+static VALUE Transaction_execute(VALUE self) {
+    Redis * redis;
+    TypedData_Get_Struct(self, Redis, &redis_type, redis);
+
+    if(redis->queue_length == 0)
+        return rb_ary_new();
+    return rb_ensure(Transaction_run, self, Transaction_discard, self);
+}
+
+static VALUE Redis_multi(VALUE self) {
+    Redis * redis;
+    VALUE transaction;
+
+    TypedData_Get_Struct(self, Redis, &redis_type, redis);
+    if(redis->pipelined)
+        rb_raise(cRedisError, "transactions cannot be pipelined");
+
+    transaction = rb_class_new_instance(1, &self, cRedisTransaction);
+    rb_yield(transaction);
+    return Transaction_execute(transaction);
+}
+
+/* Sends WATCH or UNWATCH over the connection of a watch block */
+static VALUE Watch_command(Redis * redis, int id, const char * name, long argc, const VALUE * keys) {
+    Command cmd;
+    long i;
+
+    cmd.batches = ALLOCA_N(Batch *, redis->connection_count);
+    cmd.fallbacks = NULL;
+    Command_init(redis, &cmd, id, Qnil);
+    cmd.node = cmd.first = cmd.last = redis->watch->node;
+
+    write_multibulk_header(&cmd, argc + 1);
+    write_bulk(&cmd, name, strlen(name));
+    for(i = 0; i < argc; i++)
+        write_bulk_value(&cmd, keys[i]);
+    Command_write(&cmd, NULL, 0, 1);
+    return Command_execute(redis, &cmd, return_status);
+}
+
+typedef struct {
+    VALUE self;
+    Redis * redis;
+    long argc;
+    VALUE * keys;
+    Watch watch;
+    Redis * watcher;
+} WatchCall;
+
+static VALUE Watch_run(VALUE arg) {
+    WatchCall * call = (WatchCall *) arg;
+    Node * node = &(call->redis->nodes[call->watch.node]);
+    VALUE watcher, result;
+
+    Node_check_held(node);
+    call->watch.connection = Node_checkout(node);
+    Node_add_watcher(node);
+    watcher = rb_obj_alloc(cRedis);
+    call->watcher = Redis_share(watcher, call->self);
+    call->watcher->watch = &(call->watch);
+
+    Watch_command(call->watcher, watch_command_id, "WATCH", call->argc, call->keys);
+    call->watch.active = 1;
+    result = rb_yield(watcher);
+    if(call->watch.active)
+        Watch_command(call->watcher, unwatch_command_id, "UNWATCH", 0, NULL);
+    call->watch.active = 0;
+    return result;
+}
+
+/* Gives the connection back. If the block raised while keys were still
+   watched the connection is replaced rather than cleaned up. */
+static VALUE Watch_release(VALUE arg) {
+    WatchCall * call = (WatchCall *) arg;
+
+    if(call->watcher)
+        call->watcher->watch = NULL;
+    if(call->watch.connection) {
+        Node_remove_watcher(&(call->redis->nodes[call->watch.node]));
+        Node_checkin(&(call->redis->nodes[call->watch.node]), call->watch.connection, call->watch.broken || call->watch.active ? 0 : 1);
+    }
+    return Qnil;
+}
+
+/* Watches the given keys, which must live on the same server, and yields
+   a Redis instance that sends everything over one connection. A
+   transaction made from it with multi is dropped by the server if any of
+   the keys changed in the meantime, in which case the block is run again
+   with fresh watches. Returns the result of the block. The instance
+   yielded is only good inside the block, and for the thread running it. */
+static VALUE Redis_watch(int argc, VALUE * argv, VALUE self) {
+    WatchCall call;
+    VALUE * keys;
+    VALUE result;
+    int i;
+
+    rb_need_block();
+    rb_check_arity(argc, 1, UNLIMITED_ARGUMENTS);
+    TypedData_Get_Struct(self, Redis, &redis_type, call.redis);
+    if(call.redis->pipelined)
+        rb_raise(cRedisError, "watch cannot be pipelined");
+    if(Redis_watch_of(call.redis))
+        rb_raise(cRedisError, "watch blocks cannot be nested");
+
+    keys = ALLOCA_N(VALUE, argc);
+    for(i = 0; i < argc; i++) {
+        keys[i] = encode_argument('k', argv[i]);
+        if(i > 0 && Redis_node(call.redis, keys[i]) != Redis_node(call.redis, keys[0]))
+            rb_raise(cRedisError, "Keys of a single command must live on the same server");
+    }
+
+    call.self = self;
+    call.argc = argc;
+    call.keys = keys;
+    do {
+        MEMZERO(&(call.watch), Watch, 1);
+        call.watch.node = Redis_node(call.redis, keys[0]);
+        call.watcher = NULL;
+        result = rb_ensure(Watch_run, (VALUE) &call, Watch_release, (VALUE) &call);
+    } while(call.watch.aborted);
+    return result;
+}
+
+
+/* Async functions
+
+   Redis#async returns a Redis::Async, which has every command of Redis but
+   queues it and returns a future straight away. A background thread sends
+   whatever was queued in the meantime as one pipeline, so many calls in
+   flight take a single round trip, and wakes up the threads and fibers
+   waiting on the futures. Waiting is done with a Mutex and a
+   ConditionVariable, which hand over to a Fiber scheduler when one is set,
+   so a fiber waiting for its reply does not block its thread. */
+
+static long Async_queue_length(VALUE pipeline) {
+    Redis * redis;
+    TypedData_Get_Struct(pipeline, Redis, &redis_type, redis);
+    return redis->queue_length;
+}
+
+static VALUE Async_new(VALUE parent) {
+    VALUE async = rb_obj_alloc(cRedisAsync);
+
+    rb_ivar_set(async, id_redis, parent);
+    rb_ivar_set(async, id_lock, rb_mutex_new());
+    rb_ivar_set(async, id_work, rb_class_new_instance(0, NULL, cConditionVariable));
+    rb_ivar_set(async, id_done, rb_class_new_instance(0, NULL, cConditionVariable));
+    rb_ivar_set(async, id_pending, rb_class_new_instance(1, &parent, cRedisPipeline));
+    rb_ivar_set(async, id_thread, Qnil);
+    rb_ivar_set(async, id_closed, Qfalse);
+    return async;
+}
+
+/* Waits for queued commands, and swaps in a new pipeline for the commands
+   that come in while these are sent. Returns nil once closed. */
+static VALUE Async_take(VALUE self) {
+    VALUE pending = rb_ivar_get(self, id_pending);
+    VALUE parent;
+
+    while(!Async_queue_length(pending) && !RTEST(rb_ivar_get(self, id_closed)))
+        rb_funcall(rb_ivar_get(self, id_work), id_wait, 1, rb_ivar_get(self, id_lock));
+    if(!Async_queue_length(pending))
+        return Qnil;
+
+    parent = rb_ivar_get(self, id_redis);
+    rb_ivar_set(self, id_pending, rb_class_new_instance(1, &parent, cRedisPipeline));
+    return pending;
+}
+
+static VALUE Async_broadcast(VALUE self) {
+    return rb_funcall(rb_ivar_get(self, id_done), id_broadcast, 0);
+}
+
+static void Async_fail(VALUE futures, VALUE error) {
+    long i;
+
+    for(i = 0; i < RARRAY_LEN(futures); i++) {
+        if(!RTEST(Future_ready(RARRAY_AREF(futures, i))))
+            Future_set(RARRAY_AREF(futures, i), error);
+    }
+}
+
+typedef struct {
+    VALUE self;
+    VALUE futures;              /* of the pipeline being sent, nil between pipelines */
+} AsyncRun;
+
+/* If the pipeline fails as a whole, every future still waiting gets the
+   error. Anything else, such as an Interrupt or the thread being killed,
+   stops the thread; see Async_stopped. */
+static VALUE Async_loop(VALUE arg) {
+    AsyncRun * run = (AsyncRun *) arg;
+    VALUE self = run->self;
+    VALUE pipeline, error;
+    Redis * redis;
+    int state;
+
+    while(RTEST(pipeline = rb_mutex_synchronize(rb_ivar_get(self, id_lock), Async_take, self))) {
+        TypedData_Get_Struct(pipeline, Redis, &redis_type, redis);
+        run->futures = redis->futures;
+
+        rb_protect(Pipeline_execute, pipeline, &state);
+        if(state) {
+            error = rb_errinfo();
+            if(!rb_obj_is_kind_of(error, rb_eStandardError))
+                rb_jump_tag(state);
+            rb_set_errinfo(Qnil);
+            Async_fail(run->futures, error);
+        }
+        rb_mutex_synchronize(rb_ivar_get(self, id_lock), Async_broadcast, self);
+        run->futures = Qnil;
+    }
+    return Qnil;
+}
+
+/* Fails the futures of the pipeline being sent and of the commands queued
+   since, so nothing waits on a thread that is gone, and lets the next
+   command start a new one */
+static VALUE Async_stopped_locked(VALUE arg) {
+    AsyncRun * run = (AsyncRun *) arg;
+    VALUE self = run->self;
+    VALUE error = rb_exc_new_cstr(cRedisError, "Redis::Async thread stopped before the reply came in");
+    VALUE pending = rb_ivar_get(self, id_pending);
+    VALUE parent = rb_ivar_get(self, id_redis);
+    Redis * redis;
+
+    if(!NIL_P(run->futures))
+        Async_fail(run->futures, error);
+    TypedData_Get_Struct(pending, Redis, &redis_type, redis);
+    if(redis->queue_length) {
+        Async_fail(redis->futures, error);
+        rb_ivar_set(self, id_pending, rb_class_new_instance(1, &parent, cRedisPipeline));
+    }
+    rb_ivar_set(self, id_thread, Qnil);
+    return rb_funcall(rb_ivar_get(self, id_done), id_broadcast, 0);
+}
+
+static VALUE Async_stopped(VALUE arg) {
+    AsyncRun * run = (AsyncRun *) arg;
+    return rb_mutex_synchronize(rb_ivar_get(run->self, id_lock), Async_stopped_locked, arg);
+}
+
+/* The body of the background thread */
+static VALUE Async_run(void * arg) {
+    AsyncRun run;
+
+    run.self = (VALUE) arg;
+    run.futures = Qnil;
+    return rb_ensure(Async_loop, (VALUE) &run, Async_stopped, (VALUE) &run);
+}
+
+typedef struct {
+    VALUE async;
+    ID method;
+    int argc;
+    VALUE * argv;
+} AsyncCall;
+
+static VALUE Async_queue(VALUE arg) {
+    AsyncCall * call = (AsyncCall *) arg;
+    VALUE self = call->async;
+    VALUE future;
+
+    if(RTEST(rb_ivar_get(self, id_closed)))
+        rb_raise(cRedisError, "Redis::Async has been closed");
+
+    future = rb_funcallv(rb_ivar_get(self, id_pending), call->method, call->argc, call->argv);
+    rb_ivar_set(future, id_async, self);
+
+    if(NIL_P(rb_ivar_get(self, id_thread)))
+        rb_ivar_set(self, id_thread, rb_thread_create(Async_run, (void *) self));
+    rb_funcall(rb_ivar_get(self, id_work), id_signal, 0);
+    return future;
+}
+
+/* Queues a call of the given method of the pending pipeline */
+static VALUE Async_call(VALUE self, ID method, int argc, VALUE * argv) {
+    AsyncCall call;
+
+    call.async = self;
+    call.method = method;
+    call.argc = argc;
+    call.argv = argv;
+    return rb_mutex_synchronize(rb_ivar_get(self, id_lock), Async_queue, (VALUE) &call);
+}
+
+/* Every command of Redis::Async, which queues the command of the same name */
+static VALUE Async_command(int argc, VALUE * argv, VALUE self) {
+    return Async_call(self, rb_frame_this_func(), argc, argv);
+}
+
+typedef struct {
+    VALUE async;
+    VALUE future;
+} AsyncWait;
+
+static VALUE Async_wait_for_reply(VALUE arg) {
+    AsyncWait * wait = (AsyncWait *) arg;
+
+    while(!RTEST(Future_ready(wait->future)))
+        rb_funcall(rb_ivar_get(wait->async, id_done), id_wait, 1, rb_ivar_get(wait->async, id_lock));
+    return Qnil;
+}
+
+static void Async_wait(VALUE async, VALUE future) {
+    AsyncWait wait;
+
+    wait.async = async;
+    wait.future = future;
+    rb_mutex_synchronize(rb_ivar_get(async, id_lock), Async_wait_for_reply, (VALUE) &wait);
+}
+
+static VALUE Async_close_locked(VALUE self) {
+    rb_ivar_set(self, id_closed, Qtrue);
+    return rb_funcall(rb_ivar_get(self, id_work), id_signal, 0);
+}
+
+/* Sends what is still queued, then stops the background thread */
+static VALUE Async_close(VALUE self) {
+    VALUE thread;
+
+    rb_mutex_synchronize(rb_ivar_get(self, id_lock), Async_close_locked, self);
+    thread = rb_ivar_get(self, id_thread);
+    if(!NIL_P(thread))
+        rb_funcall(thread, rb_intern("join"), 0);
+    return Qnil;
+}
+
+static VALUE Redis_async(VALUE self) {
+    Redis * redis;
+    TypedData_Get_Struct(self, Redis, &redis_type, redis);
+
+    if(redis->pipelined)
+        rb_raise(cRedisError, "a pipeline cannot be used asynchronously");
+    if(!rb_ivar_defined(self, id_async))
+        rb_ivar_set(self, id_async, Async_new(self));
+    return rb_ivar_get(self, id_async);
+}
+
+
+/* Encoding functions
+
+   A command from the command table is encoded in one go: its arguments are
+   converted first, so nothing can raise halfway, then the precomputed
+   header and the arguments are gathered in a buffer on the stack and
+   appended to the batch at once. Only arguments too big to be worth
+   copying twice are appended on their own. */
+
+#define ENCODE_BUFFER_SIZE (16 * 1024)
+#define ENCODE_COPY_MAX (4 * 1024)
+
+typedef struct {
+    Command * cmd;
+    long length;
+    char data[ENCODE_BUFFER_SIZE];
+} Encoder;
+
+static int format_decimal(char * buffer, long value) {
+    char digits[24];
+    unsigned long n = value < 0 ? -(unsigned long) value : (unsigned long) value;
+    int count = 0, length = 0;
+
+    do {
+        digits[count++] = '0' + n % 10;
+        n /= 10;
+    } while(n);
+    if(value < 0)
+        buffer[length++] = '-';
+    while(count)
+        buffer[length++] = digits[--count];
+    return length;
+}
+
+static void Encoder_flush(Encoder * encoder) {
+    if(encoder->length) {
+        Command_write(encoder->cmd, encoder->data, encoder->length, 0);
+        encoder->length = 0;
+    }
+}
+
+static void Encoder_append(Encoder * encoder, const char * data, long length) {
+    if(length > ENCODE_COPY_MAX) {
+        Encoder_flush(encoder);
+        Command_write(encoder->cmd, data, length, 0);
+        return;
+    }
+    if(encoder->length + length > ENCODE_BUFFER_SIZE)
+        Encoder_flush(encoder);
+    memcpy(encoder->data + encoder->length, data, length);
+    encoder->length += length;
+}
+
+/* Appends "$<length>\r\n<data>\r\n" */
+static void Encoder_bulk(Encoder * encoder, const char * data, long length) {
+    char prefix[32];
+    int prefix_length = 1;
+
+    prefix[0] = '$';
+    prefix_length += format_decimal(prefix + 1, length);
+    prefix[prefix_length++] = '\r';
+    prefix[prefix_length++] = '\n';
+    Encoder_append(encoder, prefix, prefix_length);
+    Encoder_append(encoder, data, length);
+    Encoder_append(encoder, CRLF, sizeof(CRLF) - 1);
+}
+
+static char CommandSpec_argument(const CommandSpec * spec, int i) {
+    return spec->arguments[i < spec->min_args ? i : spec->min_args - 1];
+}
+
+/* Formats a double with the fewest digits that read back as the same
+   value, which is what Float#to_s does too */
+static int format_double(char * buffer, size_t size, double value) {
+    int precision, length = 0;
+
+    for(precision = 15; precision <= 17; precision++) {
+        length = snprintf(buffer, size, "%.*g", precision, value);
+        if(strtod(buffer, NULL) == value)
+            break;
+    }
+    return length;
+}
+
+/* Converts an argument to what is sent: strings as they are, integers,
+   Bignums included, in decimal and anything else as its to_s. Fixnums and
+   Floats are left as they are for the encoder to format. Scores are either
+   numbers or strings such as "-inf" and "(1.5". */
+static VALUE encode_argument(char kind, VALUE value) {
+    if(kind == 'f' && !RB_TYPE_P(value, T_STRING) && !RB_INTEGER_TYPE_P(value)) {
+        value = rb_Float(value);
+        if(isnan(RFLOAT_VALUE(value)))
+            rb_raise(rb_eArgError, "NaN is not a valid score");
+        return value;
+    }
+    if(kind == 'i' || (kind == 'f' && RB_INTEGER_TYPE_P(value))) {
+        if(!RB_INTEGER_TYPE_P(value))
+            value = rb_Integer(value);
+        return FIXNUM_P(value) ? value : rb_big2str(value, 10);
+    }
+    return RB_TYPE_P(value, T_STRING) ? value : rb_obj_as_string(value);
+}
+
+/* Writes a command with arguments converted by encode_argument */
+static void Command_encode(Command * cmd, const CommandSpec * spec, int argc, const VALUE * args) {
+    Encoder encoder;
+    char number[32];
+    int i;
+
+    encoder.cmd = cmd;
+    encoder.length = 0;
+
+    if(spec->max_args == UNLIMITED_ARGUMENTS) {
+        number[0] = '*';
+        i = 1 + format_decimal(number + 1, argc + 1);
+        number[i++] = '\r';
+        number[i++] = '\n';
+        Encoder_append(&encoder, number, i);
+    }
+    Encoder_append(&encoder, spec->header, spec->header_length);
+
+    for(i = 0; i < argc; i++) {
+        if(FIXNUM_P(args[i]))
+            Encoder_bulk(&encoder, number, format_decimal(number, FIX2LONG(args[i])));
+        else if(RB_FLOAT_TYPE_P(args[i]))
+            Encoder_bulk(&encoder, number, format_double(number, sizeof(number), RFLOAT_VALUE(args[i])));
+        else
+            Encoder_bulk(&encoder, RSTRING_PTR(args[i]), RSTRING_LEN(args[i]));
+    }
+    Command_write(cmd, encoder.data, encoder.length, 1);
+}
+
+/* Converts the arguments of a command of the command table, values
+   through the codec if the command has the CODEC flag */
+static void encode_arguments(Redis * redis, const CommandSpec * spec, int argc, const VALUE * argv, VALUE * args) {
+    int i;
+
+    for(i = 0; i < argc; i++) {
+        if((spec->flags & CODEC) && redis->codec && CommandSpec_argument(spec, i) == 'v')
+            args[i] = Codec_encode(redis->codec, argv[i]);
+        else
+            args[i] = encode_argument(CommandSpec_argument(spec, i), argv[i]);
+    }
+}
+
+/* Checks that the keys of a command of the command table live on the node
+   of its first and drops them from the near cache */
+static void Command_prepare_keys(Redis * redis, Command * cmd, const CommandSpec * spec, int argc, const VALUE * args) {
+    int i;
+
+    for(i = 0; i < argc; i++) {
+        if(CommandSpec_argument(spec, i) != 'k')
+            continue;
+        if(i > 0)
+            Command_check_key(redis, cmd, args[i]);
+        Command_invalidate(cmd, args[i]);
+    }
+}
+
+/* Auto pipeline functions
+
+   With :auto_pipeline, a command that one thread sends while another is
+   waiting for replies joins the commands queued behind it, and they all
+   go out together in one round trip once the replies are in. The first
+   thread to find nothing in flight sends the queued commands and hands
+   every thread its reply. Only commands of the command table that go to
+   a single node are queued this way: they are written in one go, so the
+   commands of different threads never interleave in a batch. */
+
+static AutoPipeline * AutoPipeline_new(void) {
+    AutoPipeline * pipeline = ZALLOC(AutoPipeline);
+    pipeline->mutex = rb_mutex_new();
+    pipeline->condition = rb_class_new_instance(0, NULL, cConditionVariable);
+    return pipeline;
+}
+
+static void AutoPipeline_mark(AutoPipeline * pipeline) {
+    rb_gc_mark(pipeline->mutex);
+    rb_gc_mark(pipeline->condition);
+    if(pipeline->filling)
+        rb_gc_mark(pipeline->filling->values);
+}
+
+static void AutoFlush_free(AutoFlush * flush, int count) {
+    int i;
+
+    for(i = 0; i < count; i++) {
+        if(flush->batches[i])
+            Batch_free(flush->batches[i]);
+    }
+    xfree(flush->batches);
+    xfree(flush->queue);
+    xfree(flush->specs);
+    xfree(flush);
+}
+
+static void AutoPipeline_free(AutoPipeline * pipeline, int count) {
+    if(pipeline->filling)
+        AutoFlush_free(pipeline->filling, count);
+    xfree(pipeline);
+}
+
+static int Redis_auto_pipelines(Redis * redis, const CommandSpec * spec) {
+    return redis->auto_pipeline && !redis->pipelined && !redis->replicated &&
+        spec->arguments[0] == 'k' && !Redis_watch_of(redis);
+}
+
+typedef struct {
+    Redis * redis;
+    AutoFlush * flush;
+    long index;
+    VALUE values;               /* keeps the replies from being collected */
+} AutoWait;
+
+static VALUE AutoPipeline_sleep(VALUE arg) {
+    AutoWait * wait = (AutoWait *) arg;
+
+    if(!wait->flush->done && wait->redis->auto_pipeline->flushing)
+        rb_funcall(wait->redis->auto_pipeline->condition, id_wait, 1, wait->redis->auto_pipeline->mutex);
+    return Qnil;
+}
+
+static VALUE AutoPipeline_wake(VALUE arg) {
+    AutoWait * wait = (AutoWait *) arg;
+
+    wait->flush->done = 1;
+    wait->redis->auto_pipeline->flushing = 0;
+    return rb_funcall(wait->redis->auto_pipeline->condition, id_broadcast, 0);
+}
+
+/* Writes the commands still waited for and sends them */
+static VALUE AutoFlush_execute(VALUE arg) {
+    AutoWait * wait = (AutoWait *) arg;
+    AutoFlush * flush = wait->flush;
+    Redis * redis = wait->redis;
+    Command cmd;
+    VALUE args;
+    long i;
+
+    /* Not Command_init, which would drop the batches written so far */
+    cmd.batches = flush->batches;
+    cmd.fallbacks = NULL;
+    cmd.stats = redis->stats;
+    cmd.cache = redis->cache;
+    for(i = 0; i < flush->queue_length; i++) {
+        if(!flush->specs[i])
+            continue;
+        args = RARRAY_AREF(flush->values, i);
+        cmd.id = flush->specs[i]->id;
+        cmd.first = cmd.last = cmd.node = flush->queue[i].node;
+        Command_encode(&cmd, flush->specs[i], RARRAY_LENINT(args), RARRAY_CONST_PTR(args));
+    }
+    execute_batches(redis, flush->batches, 0, redis->connection_count - 1, pipeline_command_id);
+    return Qnil;
+}
+
+/* Lets any other thread that is ready to run add its commands first */
+static VALUE AutoFlush_run(VALUE arg) {
+    AutoWait * wait = (AutoWait *) arg;
+    AutoFlush * flush = wait->flush;
+    QueuedCall call;
+    VALUE value;
+    long i;
+    int state = 0;
+
+    rb_thread_schedule();
+    wait->redis->auto_pipeline->filling = NULL;
+    rb_protect(AutoFlush_execute, arg, &state);
+    if(state) {
+        value = rb_errinfo();
+        rb_set_errinfo(Qnil);
+        for(i = 0; i < flush->queue_length; i++)
+            rb_ary_store(flush->values, i, value);
+        return Qnil;
+    }
+
+    call.redis = wait->redis;
+    call.batches = flush->batches;
+    for(i = 0; i < flush->queue_length; i++) {
+        if(!flush->specs[i]) {
+            rb_ary_store(flush->values, i, Qnil);
+            continue;
+        }
+        call.queued = &(flush->queue[i]);
+        value = rb_protect(read_queued_reply, (VALUE) &call, &state);
+        if(state) {
+            value = rb_errinfo();
+            rb_set_errinfo(Qnil);
+        }
+        rb_ary_store(flush->values, i, value);
+    }
+    return Qnil;
+}
+
+static VALUE AutoFlush_finish(VALUE arg) {
+    AutoWait * wait = (AutoWait *) arg;
+    AutoFlush * flush = wait->flush;
+    int i;
+
+    for(i = 0; i < wait->redis->connection_count; i++) {
+        if(flush->batches[i])
+            Batch_free(flush->batches[i]);
+        flush->batches[i] = NULL;
+    }
+    return rb_mutex_synchronize(wait->redis->auto_pipeline->mutex, AutoPipeline_wake, arg);
+}
+
+static VALUE AutoFlush_flush(RB_BLOCK_CALL_FUNC_ARGLIST(yielded, arg)) {
+    return rb_ensure(AutoFlush_run, arg, AutoFlush_finish, arg);
+}
+
+/* Interrupts of the thread that sends the queue, from Thread#raise or
+   Thread#kill, wait until every thread has its reply */
+static void AutoFlush_send(AutoWait * wait) {
+    VALUE mask = rb_hash_new();
+
+    rb_hash_aset(mask, rb_cObject, ID2SYM(rb_intern("never")));
+    wait->redis->auto_pipeline->flushing = 1;
+    rb_block_call(rb_cThread, rb_intern("handle_interrupt"), 1, &mask, AutoFlush_flush, (VALUE) wait);
+}
+
+static VALUE AutoPipeline_wait(VALUE arg) {
+    AutoWait * wait = (AutoWait *) arg;
+    VALUE value;
+
+    while(!wait->flush->done) {
+        if(!wait->redis->auto_pipeline->flushing)
+            AutoFlush_send(wait);
+        else
+            rb_mutex_synchronize(wait->redis->auto_pipeline->mutex, AutoPipeline_sleep, arg);
+    }
+
+    value = RARRAY_AREF(wait->values, wait->index);
+    if(rb_obj_is_kind_of(value, rb_eException))
+        rb_exc_raise(value);
+    return value;
+}
+
+/* The last thread to pick up its reply frees the queue. One interrupted
+   before its queue is taken to be sent takes its command out; one
+   interrupted later still has it sent, and its reply dropped. */
+static VALUE AutoPipeline_release(VALUE arg) {
+    AutoWait * wait = (AutoWait *) arg;
+
+    if(wait->redis->auto_pipeline->filling == wait->flush)
+        wait->flush->specs[wait->index] = NULL;
+    if(--wait->flush->waiters == 0 && wait->flush->done)
+        AutoFlush_free(wait->flush, wait->redis->connection_count);
+    return Qnil;
+}
+
+/* Queues a command of the command table, with its arguments already
+   encoded, and waits for its reply. The command is only written once its
+   queue is taken to be sent, so one given up on before that never goes
+   out. */
+static VALUE AutoPipeline_call(Redis * redis, const CommandSpec * spec, int argc, VALUE * args) {
+    AutoPipeline * pipeline = redis->auto_pipeline;
+    AutoFlush * flush = pipeline->filling;
+    AutoWait wait;
+    Command cmd;
+
+    if(!flush) {
+        flush = pipeline->filling = ZALLOC(AutoFlush);
+        flush->batches = ZALLOC_N(Batch *, redis->connection_count);
+        flush->values = rb_ary_new();
+    }
+
+    /* Nothing is written to the batches yet, see AutoFlush_execute */
+    cmd.batches = flush->batches;
+    cmd.fallbacks = NULL;
+    cmd.id = spec->id;
+    cmd.stats = redis->stats;
+    cmd.cache = redis->cache;
+    cmd.first = cmd.last = cmd.node = Redis_node(redis, args[0]);
+    Command_prepare_keys(redis, &cmd, spec, argc, args);
+
+    if(flush->queue_length == flush->queue_capacity) {
+        flush->queue_capacity = flush->queue_capacity ? flush->queue_capacity * 2 : 16;
+        REALLOC_N(flush->queue, QueuedReply, flush->queue_capacity);
+        REALLOC_N(flush->specs, const CommandSpec *, flush->queue_capacity);
+    }
+    rb_ary_store(flush->values, flush->queue_length, rb_ary_new_from_values(argc, args));
+    flush->specs[flush->queue_length] = spec;
+    flush->queue[flush->queue_length].handler = spec->handler;
+    flush->queue[flush->queue_length].node = cmd.node;
+    flush->queue[flush->queue_length].script = -1;
+    flush->waiters++;
+
+    wait.redis = redis;
+    wait.flush = flush;
+    wait.index = flush->queue_length++;
+    wait.values = flush->values;
+    return rb_ensure(AutoPipeline_wait, (VALUE) &wait, AutoPipeline_release, (VALUE) &wait);
+}
+
+/* Runs a command that only reads again when the connection it went over
+   turned out to be dropped, at once the first time and after a delay that
+   doubles every time after that. A connection can drop after the server
+   ran a command, so writes are never sent twice; neither are timeouts,
+   pipelines and watch blocks. */
+static VALUE Redis_reconnecting(Redis * redis, int command_id, VALUE (*function)(VALUE), VALUE arg) {
+    double delay = redis->options.reconnect_delay;
+    VALUE result;
+    int attempt, state;
+
+    if(!redis->options.reconnect_attempts || !command_read_only[command_id] || redis->pipelined || Redis_watch_of(redis))
+        return function(arg);
+
+    for(attempt = 0; ; attempt++) {
+        result = rb_protect(function, arg, &state);
+        if(!state)
+            return result;
+        if(attempt >= redis->options.reconnect_attempts || !rb_obj_is_kind_of(rb_errinfo(), cRedisConnectionError))
+            rb_jump_tag(state);
+        rb_set_errinfo(Qnil);
+        if(attempt > 0) {
+            rb_thread_wait_for(rb_time_interval(DBL2NUM(delay)));
+            delay = delay * 2 < MAX_RECONNECT_DELAY ? delay * 2 : MAX_RECONNECT_DELAY;
+        }
+    }
+}
+
+typedef struct {
+    const CommandSpec * spec;
+    int argc;
+    VALUE * argv;
+    VALUE self;
+} CommandArguments;
+
+static VALUE Command_call_once(VALUE arg) {
+    CommandArguments * call = (CommandArguments *) arg;
+    const CommandSpec * spec = call->spec;
+    int argc = call->argc;
+    Redis * redis;
+    Command cmd;
+    VALUE * args;
+
+    TypedData_Get_Struct(call->self, Redis, &redis_type, redis);
+
+    args = ALLOCA_N(VALUE, argc);
+    encode_arguments(redis, spec, argc, call->argv, args);
+
+    if(Redis_auto_pipelines(redis, spec))
+        return AutoPipeline_call(redis, spec, argc, args);
+
+    COMMAND_BATCHES(redis, cmd);
+    Command_init(redis, &cmd, spec->id, spec->arguments[0] == 'k' ? args[0] : Qnil);
+    Command_prepare_keys(redis, &cmd, spec, argc, args);
+
+    FOR_EACH_NODE()
+        Command_encode(&cmd, spec, argc, args);
+    return Command_execute(redis, &cmd, spec->handler);
+}
+
+/* Sends a command of the command table with the given arguments */
+static VALUE Command_call(const CommandSpec * spec, int argc, VALUE * argv, VALUE self) {
+    CommandArguments call;
+    Redis * redis;
+
+    rb_check_arity(argc, spec->min_args, spec->max_args);
+    TypedData_Get_Struct(self, Redis, &redis_type, redis);
+    call.spec = spec;
+    call.argc = argc;
+    call.argv = argv;
+    call.self = self;
+    return Redis_reconnecting(redis, spec->id, Command_call_once, (VALUE) &call);
+}
+
+/* Fills in what is derived from the table entry of a command */
+static void CommandSpec_prepare(CommandSpec * spec) {
+    const char * repeat = strchr(spec->arguments, '*');
+    char header[64];
+
+    spec->id = Command_id(spec->name);
+    command_read_only[spec->id] = spec->flags & READ_ONLY;
+    spec->min_args = repeat ? (int) (repeat - spec->arguments) : (int) strlen(spec->arguments);
+    spec->max_args = repeat ? UNLIMITED_ARGUMENTS : spec->min_args;
+
+    spec->header_length = 0;
+    if(!repeat)
+        spec->header_length += snprintf(header, sizeof(header), "*%d" CRLF, spec->min_args + 1);
+    spec->header_length += snprintf(header + spec->header_length, sizeof(header) - spec->header_length,
+                                    "$%d" CRLF "%s" CRLF, (int) strlen(spec->name), spec->name);
+    spec->header = ALLOC_N(char, spec->header_length);
+    memcpy(spec->header, header, spec->header_length);
+}
+
+
+/* Command table */
+
+#define CUSTOM_COMMAND COMMAND
+#define COMMAND(name, method, ruby_name, arguments, reply, flags)      \
+    static VALUE Redis_##method(int argc, VALUE * argv, VALUE self);
+#include "commands.h"
+#undef COMMAND
+
+enum {
+#define COMMAND(name, method, ruby_name, arguments, reply, flags)      \
+    COMMAND_##name,
+#include "commands.h"
+#undef COMMAND
+    COMMAND_COUNT
+};
+
+static CommandSpec command_table[] = {
+#define COMMAND(name, method, ruby_name, arguments, reply, flags)      \
+    { #name, ruby_name, arguments, reply, flags, Redis_##method },
+#include "commands.h"
+#undef COMMAND
+};
+
+#undef CUSTOM_COMMAND
+#define CUSTOM_COMMAND(name, method, ruby_name, arguments, reply, flags)
+#define COMMAND(name, method, ruby_name, arguments, reply, flags)      \
+    static VALUE Redis_##method(int argc, VALUE * argv, VALUE self) {   \
+        return Command_call(&(command_table[COMMAND_##name]), argc, argv, self); \
+    }
+#include "commands.h"
+#undef COMMAND
+#undef CUSTOM_COMMAND
+
+
+static int write_hash_pair(VALUE key, VALUE value, VALUE arg) {
+    Command * cmd = (Command *) arg;
+    write_bulk_value(cmd, key);
+    write_bulk_value(cmd, value);
+    return ST_CONTINUE;
+}
+
+static int encode_hash_value(VALUE key, VALUE value, VALUE arg) {
+    VALUE * pair = (VALUE *) arg;
+    Redis * redis = (Redis *) pair[1];
+    rb_hash_aset(pair[0], key, Codec_encode(redis->codec, value));
+    return ST_CONTINUE;
+}
+
+static VALUE Redis_scatter(Redis * redis, const CommandSpec * spec, VALUE keys, VALUE values);
+static int Redis_scatters(Redis * redis);
+
+static VALUE Redis_mset_scattered(Redis * redis, VALUE hash, VALUE keys, VALUE encoded) {
+    VALUE values = rb_ary_new2(RARRAY_LEN(keys));
+    VALUE value;
+    long i;
+
+    for(i = 0; i < RARRAY_LEN(keys); i++) {
+        value = rb_hash_aref(hash, RARRAY_AREF(keys, i));
+        rb_ary_push(values, redis->codec ? Codec_encode(redis->codec, value) : encode_argument('v', value));
+    }
+    return Redis_scatter(redis, &(command_table[COMMAND_MSET]), encoded, values);
+}
+
+/* Sets every key of the hash to its value in a single command, or one per
+   node with keys on several */
+static VALUE Redis_mset(int argc, VALUE * argv, VALUE self) {
+    VALUE hash, keys, encoded, pair[2];
+    long i;
+
+    rb_check_arity(argc, 1, 1);
+    hash = argv[0];
+    Check_Type(hash, T_HASH);
+    if(RHASH_SIZE(hash) == 0)
+        rb_raise(rb_eArgError, "no keys given");
+    keys = rb_funcall(hash, rb_intern("keys"), 0);
+    encoded = rb_ary_new2(RARRAY_LEN(keys));
+    for(i = 0; i < RARRAY_LEN(keys); i++)
+        rb_ary_push(encoded, encode_argument('k', RARRAY_AREF(keys, i)));
+
+    SETUP(MSET, RARRAY_AREF(encoded, 0));
+    if(Redis_scatters(redis))
+        return Redis_mset_scattered(redis, hash, keys, encoded);
+    Command_check_keys(redis, &cmd, RARRAY_CONST_PTR(encoded), RARRAY_LEN(encoded), 1);
+    Command_invalidate_keys(&cmd, RARRAY_CONST_PTR(encoded), RARRAY_LEN(encoded), 1);
+    if(redis->codec) {
+        pair[0] = rb_hash_new();
+        pair[1] = (VALUE) redis;
+        rb_hash_foreach(hash, encode_hash_value, (VALUE) pair);
+        hash = pair[0];
+    }
+    FOR_EACH_NODE() {
+        WRITE_MULTIBULK(MSET, RHASH_SIZE(hash) * 2);
+        rb_hash_foreach(hash, write_hash_pair, (VALUE) &cmd);
+        FINISH_MULTIBULK();
+    }
+    RB_GC_GUARD(keys);
+    RB_GC_GUARD(encoded);
+    EXECUTE(STATUS);
+}
+
+/* GET goes through the near cache when there is one */
+static VALUE Redis_get_once(VALUE arg) {
+    CommandArguments * call = (CommandArguments *) arg;
+    VALUE self = call->self;
+    unsigned long long generation = 0;
+    VALUE key, value;
+
+    key = encode_argument('k', call->argv[0]);
+
+    SETUP(GET, key);
+    if(redis->cache && !redis->pipelined) {
+        value = Cache_lookup(redis->cache, key);
+        if(value != Qundef)
+            return value;
+        generation = redis->cache->generation;
+    }
+
+    if(Redis_auto_pipelines(redis, &(command_table[COMMAND_GET]))) {
+        value = AutoPipeline_call(redis, &(command_table[COMMAND_GET]), 1, &key);
+        return redis->cache ? Cache_store(redis->cache, key, value, generation) : value;
+    }
+
+    FOR_EACH_NODE()
+        Command_encode(&cmd, &(command_table[COMMAND_GET]), 1, &key);
+    if(!redis->cache || redis->pipelined)
+        EXECUTE(DECODED);
+    return Cache_store(redis->cache, key, Command_execute(redis, &cmd, DECODED), generation);
+}
+
+static VALUE Redis_get(int argc, VALUE * argv, VALUE self) {
+    CommandArguments call;
+    Redis * redis;
+
+    rb_check_arity(argc, 1, 1);
+    TypedData_Get_Struct(self, Redis, &redis_type, redis);
+    call.spec = &(command_table[COMMAND_GET]);
+    call.argc = argc;
+    call.argv = argv;
+    call.self = self;
+    return Redis_reconnecting(redis, call.spec->id, Redis_get_once, (VALUE) &call);
+}
+
+/* PING is read only, so it would go to a replica; this one goes to every
+   primary */
+static VALUE Redis_ping_every_node(VALUE self) {
+    SETUP(PING, Qnil);
+    cmd.fallbacks = NULL;
+    FOR_EACH_NODE() {
+        WRITE_MULTIBULK(PING, 0);
+        FINISH_MULTIBULK();
+    }
+    EXECUTE(STATUS);
+}
+
+/* SELECT and AUTH change the setup of every connection of the pool, see
+   Node_set_setup. A PING goes to every node straight away, so a server
+   that does not take them raises here, and the setup is put back the way
+   it was. Pipelines and watch blocks cannot change it for the pool. */
+static VALUE Redis_change_setup(VALUE self, int db, VALUE password) {
+    Redis * redis;
+    int previous_db, state;
+    VALUE previous_password;
+
+    TypedData_Get_Struct(self, Redis, &redis_type, redis);
+    if(!NIL_P(redis->parent))
+        rb_raise(cRedisError, "select and auth cannot be sent from a pipeline or watch block");
+
+    previous_db = redis->options.db;
+    previous_password = redis->options.password;
+    redis->options.db = db;
+    redis->options.password = password;
+    Redis_setup(redis);
+    if(redis->cache)
+        Cache_clear(redis->cache);
+
+    rb_protect(Redis_ping_every_node, self, &state);
+    if(state) {
+        redis->options.db = previous_db;
+        redis->options.password = previous_password;
+        Redis_setup(redis);
+        rb_jump_tag(state);
+    }
+    RB_GC_GUARD(previous_password);
+    return rb_str_new_cstr("OK");
+}
+
+static VALUE Redis_select(int argc, VALUE * argv, VALUE self) {
+    Redis * redis;
+    int db;
+
+    rb_check_arity(argc, 1, 1);
+    TypedData_Get_Struct(self, Redis, &redis_type, redis);
+    if((db = NUM2INT(argv[0])) < 0)
+        rb_raise(rb_eArgError, "db must not be negative");
+    return Redis_change_setup(self, db, redis->options.password);
+}
+
+static VALUE Redis_auth(int argc, VALUE * argv, VALUE self) {
+    Redis * redis;
+
+    rb_check_arity(argc, 1, 1);
+    TypedData_Get_Struct(self, Redis, &redis_type, redis);
+    return Redis_change_setup(self, redis->options.db, rb_str_new_frozen(StringValue(argv[0])));
+}
+
+
+/* Scatter-gather functions
+
+   With several servers, mget, mset and del split their keys up by node
+   and send one command to every node with keys on it, all in a single
+   round trip. A node that fails or runs out of time only costs its own
+   keys: mget puts a RedisError where their values would have been, and
+   mset and del raise a RedisPartialError with the keys that failed and
+   what the other nodes answered. Pipelines and watch blocks send these
+   commands like any other, to a single node. */
+
+typedef struct Scatter {
+    Redis * redis;
+    Command * cmd;
+    const CommandSpec * spec;
+    VALUE (*gather)(struct Scatter *);
+    VALUE keys;                 /* encoded */
+    VALUE values;               /* encoded, for mset, otherwise nil */
+    int * nodes;                /* of every key */
+    Batch ** replies;           /* where the reply of each node is read from */
+    Reply * first;              /* the reply of each node, RT_NONE if it failed */
+    VALUE * errors;             /* why a node failed */
+} Scatter;
+
+static int Redis_scatters(Redis * redis) {
+    return redis->connection_count > 1 && !redis->pipelined && !Redis_watch_of(redis);
+}
+
+static void Scatter_write(Scatter * scatter) {
+    Command * cmd = scatter->cmd;
+    long i, *counts = ALLOCA_N(long, scatter->redis->connection_count);
+    long count = RARRAY_LEN(scatter->keys);
+    int step = NIL_P(scatter->values) ? 1 : 2;
+
+    MEMZERO(counts, long, scatter->redis->connection_count);
+    for(i = 0; i < count; i++)
+        counts[scatter->nodes[i]]++;
+
+    for(cmd->node = cmd->first; cmd->node <= cmd->last; cmd->node++) {
+        if(!counts[cmd->node])
+            continue;
+        write_multibulk_header(cmd, counts[cmd->node] * step + 1);
+        write_bulk(cmd, scatter->spec->name, strlen(scatter->spec->name));
+        for(i = 0; i < count; i++) {
+            if(scatter->nodes[i] != cmd->node)
+                continue;
+            write_bulk_value(cmd, RARRAY_AREF(scatter->keys, i));
+            if(step == 2)
+                write_bulk_value(cmd, RARRAY_AREF(scatter->values, i));
+        }
+        Command_write(cmd, NULL, 0, 1);
+    }
+}
+
+/* Reads the reply of every node whose batch is in the given array. A node
+   whose batch failed or has no reply is left at RT_NONE. */
+static int Scatter_read(Scatter * scatter, Batch ** batches, int result) {
+    int i, failed = 0;
+    char * error;
+
+    for(i = 0; i < scatter->redis->connection_count; i++) {
+        if(!batches[i])
+            continue;
+        scatter->replies[i] = batches[i];
+        scatter->errors[i] = Qnil;
+        scatter->first[i].batch = batches[i];
+        scatter->first[i].stats = scatter->redis->stats;
+        scatter->first[i].codec = scatter->redis->codec;
+        error = Batch_error(batches[i]);
+        if(error || !Batch_next_reply(batches[i], &(scatter->first[i].reply_type), &(scatter->first[i].data), &(scatter->first[i].length))) {
+            scatter->first[i].reply_type = RT_NONE;
+            scatter->errors[i] = rb_exc_new_cstr(batch_result(batches[i], result) < 0 ? cRedisConnectionError : cRedisTimeoutError,
+                                                 error ? error : "Timed out waiting for the reply");
+            failed = 1;
+            continue;
+        }
+        Stats_read(&(scatter->first[i]));
+        if(scatter->first[i].reply_type == RT_ERROR)
+            scatter->errors[i] = rb_exc_new(cRedisError, scatter->first[i].data, scatter->first[i].length);
+    }
+    return failed;
+}
+
+static VALUE Scatter_gather_values(Scatter * scatter);
+static VALUE Scatter_gather_counts(Scatter * scatter);
+
+/* Sends the batches, then the copies of the failed ones to the primaries
+   when they went to replicas */
+static VALUE Scatter_execute(VALUE arg) {
+    Scatter * scatter = (Scatter *) arg;
+    Command * cmd = scatter->cmd;
+    Batch ** retry;
+    int i, failed, result;
+
+    result = run_batches(scatter->redis, cmd->batches, cmd->first, cmd->last, cmd->id, cmd->fallbacks != NULL);
+    failed = Scatter_read(scatter, cmd->batches, result);
+    if(failed && cmd->fallbacks) {
+        retry = ALLOCA_N(Batch *, scatter->redis->connection_count);
+        for(i = 0; i < scatter->redis->connection_count; i++)
+            retry[i] = cmd->batches[i] && scatter->first[i].reply_type == RT_NONE ? cmd->fallbacks[i] : NULL;
+        result = run_batches(scatter->redis, retry, cmd->first, cmd->last, cmd->id, 0);
+        Scatter_read(scatter, retry, result);
+    }
+    return scatter->gather(scatter);
+}
+
+static VALUE Scatter_free(VALUE arg) {
+    CommandCall call;
+    call.cmd = ((Scatter *) arg)->cmd;
+    return free_command_batches((VALUE) &call);
+}
+
+/* Values in the order of the keys. The elements of every node come in the
+   order its keys were written in, so each is read from the batch of the
+   node of the key it belongs to. */
+static VALUE Scatter_gather_values(Scatter * scatter) {
+    long i, count = RARRAY_LEN(scatter->keys);
+    long * left = ALLOCA_N(long, scatter->redis->connection_count);
+    VALUE values = rb_ary_new2(count);
+    Reply element;
+    int node;
+
+    for(node = 0; node < scatter->redis->connection_count; node++) {
+        left[node] = scatter->first[node].reply_type == RT_MULTIBULK ? (long) scatter->first[node].length : 0;
+        if(scatter->replies[node] && NIL_P(scatter->errors[node]) && scatter->first[node].reply_type != RT_MULTIBULK)
+            scatter->errors[node] = rb_exc_new_cstr(cRedisError, "Unexpected return type from Redis");
+    }
+
+    element.stats = scatter->redis->stats;
+    element.codec = scatter->redis->codec;
+    for(i = 0; i < count; i++) {
+        node = scatter->nodes[i];
+        element.batch = scatter->replies[node];
+        if(!NIL_P(scatter->errors[node])) {
+            rb_ary_push(values, scatter->errors[node]);
+        } else if(!left[node]-- || !Batch_next_reply(element.batch, &(element.reply_type), &(element.data), &(element.length))) {
+            rb_ary_push(values, rb_exc_new_cstr(cRedisError, "Missing reply"));
+        } else {
+            Stats_read(&element);
+            if(element.reply_type == RT_ERROR)
+                rb_ary_push(values, rb_exc_new(cRedisError, element.data, element.length));
+            else
+                rb_ary_push(values, scatter->spec->handler(&element));
+        }
+    }
+    return values;
+}
+
+/* The replies of mset and del merged, or a RedisPartialError if some node
+   failed */
+static VALUE Scatter_gather_counts(Scatter * scatter) {
+    VALUE result = Qundef, errors = Qnil, error;
+    long i, count = RARRAY_LEN(scatter->keys);
+    int node;
+
+    for(node = 0; node < scatter->redis->connection_count; node++) {
+        if(scatter->replies[node] && NIL_P(scatter->errors[node]))
+            result = merge_replies(result, scatter->spec->handler(&(scatter->first[node])));
+    }
+    for(i = 0; i < count; i++) {
+        if(NIL_P(scatter->errors[scatter->nodes[i]]))
+            continue;
+        if(NIL_P(errors))
+            errors = rb_hash_new();
+        rb_hash_aset(errors, RARRAY_AREF(scatter->keys, i), scatter->errors[scatter->nodes[i]]);
+    }
+    if(result == Qundef)
+        result = Qnil;
+    if(NIL_P(errors))
+        return result;
+
+    error = rb_exc_new_str(cRedisPartialError, rb_sprintf("%s failed for %ld of %ld keys",
+                                                          scatter->spec->name, RHASH_SIZE(errors), count));
+    rb_ivar_set(error, id_errors, errors);
+    rb_ivar_set(error, id_result, result);
+    rb_exc_raise(error);
+    return Qnil;
+}
+
+/* Sends a command of the command table for keys, and values for mset, on
+   several nodes */
+static VALUE Redis_scatter(Redis * redis, const CommandSpec * spec, VALUE keys, VALUE values) {
+    long i, count = RARRAY_LEN(keys);
+    int node, node_count = redis->connection_count;
+    Scatter scatter;
+    Command cmd;
+
+    COMMAND_BATCHES(redis, cmd);
+    Command_init(redis, &cmd, spec->id, RARRAY_AREF(keys, 0));
+
+    /* Spread over every node like a command without a key, but without
+       clearing the whole near cache as that would */
+    cmd.first = 0;
+    cmd.last = node_count - 1;
+    for(node = 0; node < node_count; node++) {
+        cmd.batches[node] = NULL;
+        if(cmd.fallbacks)
+            cmd.fallbacks[node] = NULL;
+    }
+
+    scatter.redis = redis;
+    scatter.cmd = &cmd;
+    scatter.spec = spec;
+    scatter.keys = keys;
+    scatter.values = values;
+    scatter.gather = spec == &(command_table[COMMAND_MGET]) ? Scatter_gather_values : Scatter_gather_counts;
+    scatter.nodes = ALLOCA_N(int, count);
+    scatter.replies = ALLOCA_N(Batch *, node_count);
+    scatter.first = ALLOCA_N(Reply, node_count);
+    scatter.errors = ALLOCA_N(VALUE, node_count);
+    for(node = 0; node < node_count; node++) {
+        scatter.replies[node] = NULL;
+        scatter.first[node].reply_type = RT_NONE;
+        scatter.errors[node] = Qnil;
+    }
+    for(i = 0; i < count; i++) {
+        scatter.nodes[i] = Redis_node(redis, RARRAY_AREF(keys, i));
+        Command_invalidate(&cmd, RARRAY_AREF(keys, i));
+    }
+
+    Scatter_write(&scatter);
+    return rb_ensure(Scatter_execute, (VALUE) &scatter, Scatter_free, (VALUE) &scatter);
+}
+
+/* Sends a command of the command table with only keys as arguments,
+   scattered over the nodes they live on */
+static VALUE Command_call_scattered(const CommandSpec * spec, int argc, VALUE * argv, VALUE self) {
+    Redis * redis;
+    VALUE keys;
+    int i;
+
+    TypedData_Get_Struct(self, Redis, &redis_type, redis);
+    if(argc == 0 || !Redis_scatters(redis))
+        return Command_call(spec, argc, argv, self);
+
+    keys = rb_ary_new2(argc);
+    for(i = 0; i < argc; i++)
+        rb_ary_push(keys, encode_argument('k', argv[i]));
+    return Redis_scatter(redis, spec, keys, Qnil);
+}
+
+static VALUE Redis_mget(int argc, VALUE * argv, VALUE self) {
+    return Command_call_scattered(&(command_table[COMMAND_MGET]), argc, argv, self);
+}
+
+static VALUE Redis_del(int argc, VALUE * argv, VALUE self) {
+    return Command_call_scattered(&(command_table[COMMAND_DEL]), argc, argv, self);
+}
+
+
+/* Streaming functions
+
+   Large values can be moved between the server and an IO without ever
+   being held in a Ruby string of their own. Going out, the value is read
+   from the IO a chunk at a time into the batch; coming back, it is handed
+   to the IO a chunk at a time straight from the reply buffer. libredis
+   still holds the whole request or reply while it is on the wire. */
+
+#define STREAM_CHUNK_SIZE (64 * 1024)
+
+typedef struct {
+    CommandCall call;           /* first, so free_command_batches can be used */
+    VALUE key;
+    VALUE io;                   /* nil to yield the chunks instead */
+    long length;
+} StreamCall;
+
+static VALUE set_from_io(VALUE arg) {
+    StreamCall * stream = (StreamCall *) arg;
+    Command * cmd = stream->call.cmd;
+    VALUE buffer = rb_str_buf_new(STREAM_CHUNK_SIZE);
+    VALUE chunk;
+    long remaining = stream->length, wanted;
+
+    cmd->node = cmd->first;
+    Command_invalidate(cmd, stream->key);
+    write_multibulk_header(cmd, 3);
+    write_bulk(cmd, "SET", 3);
+    write_bulk_value(cmd, stream->key);
+    Command_write(cmd, "$", 1, 0);
+    Command_write_decimal(cmd, stream->length);
+    Command_write(cmd, CRLF, sizeof(CRLF) - 1, 0);
+
+    while(remaining > 0) {
+        wanted = remaining < STREAM_CHUNK_SIZE ? remaining : STREAM_CHUNK_SIZE;
+        chunk = rb_funcall(stream->io, id_read, 2, LONG2NUM(wanted), buffer);
+        if(NIL_P(chunk) || RSTRING_LEN(StringValue(chunk)) == 0)
+            rb_raise(rb_eEOFError, "end of file reached with %ld of %ld bytes left to read", remaining, stream->length);
+        /* More than asked for would run past the length already sent */
+        if(RSTRING_LEN(chunk) > wanted)
+            rb_raise(rb_eIOError, "read returned %ld bytes when %ld were asked for", RSTRING_LEN(chunk), wanted);
+        Command_write(cmd, RSTRING_PTR(chunk), RSTRING_LEN(chunk), 0);
+        remaining -= RSTRING_LEN(chunk);
+    }
+    Command_write(cmd, CRLF, sizeof(CRLF) - 1, 1);
+
+    return run_command((VALUE) &(stream->call));
+}
+
+static VALUE get_to_io(VALUE arg) {
+    StreamCall * stream = (StreamCall *) arg;
+    Command * cmd = stream->call.cmd;
+    Batch * batch;
+    VALUE chunk;
+    Reply reply;
+    size_t offset, size;
+
+    cmd->node = cmd->first;
+    write_multibulk_header(cmd, 2);
+    write_bulk(cmd, "GET", 3);
+    write_bulk_value(cmd, stream->key);
+    Command_write(cmd, NULL, 0, 1);
+
+    execute_batches(stream->call.redis, cmd->batches, cmd->first, cmd->last, cmd->id);
+
+    batch = cmd->batches[cmd->first];
+    reply.batch = batch;
+    reply.stats = stream->call.redis->stats;
+    reply.codec = NULL;
+    if(!Batch_next_reply(batch, &(reply.reply_type), &(reply.data), &(reply.length)))
+        reply.reply_type = RT_NONE;
+    Stats_read(&reply);
+    if(reply.reply_type != RT_BULK)
+        return return_value(&reply);
+
+    chunk = rb_str_buf_new(STREAM_CHUNK_SIZE);
+    for(offset = 0; offset < reply.length; offset += size) {
+        size = reply.length - offset < STREAM_CHUNK_SIZE ? reply.length - offset : STREAM_CHUNK_SIZE;
+        rb_str_resize(chunk, size);
+        memcpy(RSTRING_PTR(chunk), reply.data + offset, size);
+        if(NIL_P(stream->io))
+            rb_yield(chunk);
+        else
+            rb_funcall(stream->io, id_write, 1, chunk);
+    }
+    return SIZET2NUM(reply.length);
+}
+
+static VALUE Command_stream(Redis * redis, Command * cmd, VALUE key, VALUE io, long length, VALUE (*body)(VALUE)) {
+    StreamCall stream;
+
+    if(redis->pipelined)
+        rb_raise(cRedisError, "streaming commands cannot be pipelined");
+    /* The value goes over as it is; a codec would need all of it at once */
+    if(redis->codec)
+        rb_raise(rb_eArgError, "streaming commands cannot be used with a codec or compression");
+
+    /* The reply is read straight off the primary's batch, so a copy in a
+       fallback batch would never be looked at */
+    cmd->fallbacks = NULL;
+
+    stream.call.redis = redis;
+    stream.call.cmd = cmd;
+    stream.call.handler = return_status;
+    stream.key = key;
+    stream.io = io;
+    stream.length = length;
+    return rb_ensure(body, (VALUE) &stream, free_command_batches, (VALUE) &stream);
+}
+
+/* Sets key to the next length bytes read from io, a chunk at a time */
+static VALUE Redis_set_from_io(VALUE self, VALUE key, VALUE io, VALUE length) {
+    SETUP(SET, key);
+    if(NUM2LONG(length) < 0)
+        rb_raise(rb_eArgError, "negative length");
+    return Command_stream(redis, &cmd, key, io, NUM2LONG(length), set_from_io);
+}
+
+/* Writes the value of key to io a chunk at a time. Returns the number of
+   bytes written, or nil if the key does not exist. */
+static VALUE Redis_get_to_io(VALUE self, VALUE key, VALUE io) {
+    SETUP(GET, key);
+    return Command_stream(redis, &cmd, key, io, 0, get_to_io);
+}
+
+/* Yields the value of key a chunk at a time. The same string is reused for
+   every chunk, so it has to be copied to be kept. */
+static VALUE Redis_get_stream(VALUE self, VALUE key) {
+    RETURN_ENUMERATOR(self, 1, &key);
+    SETUP(GET, key);
+    return Command_stream(redis, &cmd, key, Qnil, 0, get_to_io);
+}
+
+
+/* Scan functions
+
+   The SCAN family walks a keyspace, set, sorted set or hash a page at a
+   time, so no single reply holds all of it. SCAN itself is keyless, and
+   with several servers each one is walked in turn with a cursor of its
+   own. With :prefetch the next page is asked for through Redis#async
+   before the current one is yielded, so it is on its way while the caller
+   works; at most two pages are held at any time. */
+
+enum { SCAN_KEYS, SCAN_SET, SCAN_SORTED_SET, SCAN_HASH };
+
+static const char * scan_commands[] = { "SCAN", "SSCAN", "ZSCAN", "HSCAN" };
+
+static int scan_command_ids[4];
+
+/* Sends one page of a SCAN family command to the given node. Returns the
+   [cursor, elements] reply, or a future in a pipeline. A cursor is only
+   good on the server that handed it out, so pages always go to the
+   primary, never to a replica that may change from one page to the next. */
+static VALUE Redis_scan_page(VALUE self, VALUE kind, VALUE key, VALUE cursor, VALUE match, VALUE count, VALUE node) {
+    Redis * redis;
+    Command cmd;
+    const char * command = scan_commands[FIX2INT(kind)];
+    long argc = 1 + !NIL_P(key) + (NIL_P(match) ? 0 : 2) + (NIL_P(count) ? 0 : 2);
+
+    TypedData_Get_Struct(self, Redis, &redis_type, redis);
+    COMMAND_BATCHES(redis, cmd);
+    cmd.fallbacks = NULL;
+    Command_init(redis, &cmd, scan_command_ids[FIX2INT(kind)], Qnil);
+    cmd.node = cmd.first = cmd.last = FIX2INT(node);
+
+    write_multibulk_header(&cmd, argc + 1);
+    write_bulk(&cmd, command, strlen(command));
+    if(!NIL_P(key))
+        write_bulk_value(&cmd, key);
+    write_bulk_value(&cmd, cursor);
+    if(!NIL_P(match)) {
+        write_bulk(&cmd, "MATCH", 5);
+        write_bulk_value(&cmd, match);
+    }
+    if(!NIL_P(count)) {
+        write_bulk(&cmd, "COUNT", 5);
+        write_bulk_value(&cmd, count);
+    }
+    Command_write(&cmd, NULL, 0, 1);
+    EXECUTE(ANY);
+}
+
+typedef struct {
+    VALUE redis;
+    VALUE async;                /* to prefetch with, or nil */
+    VALUE args[6];              /* the arguments of scan_page */
+    int pairs;                  /* yield elements two at a time */
+} Scan;
+
+static VALUE Scan_request(Scan * scan, VALUE cursor) {
+    static ID id_scan_page;
+
+    if(!id_scan_page)
+        id_scan_page = rb_intern("scan_page");
+    scan->args[2] = cursor;
+    if(NIL_P(scan->async))
+        return rb_funcallv(scan->redis, id_scan_page, 6, scan->args);
+    return Async_call(scan->async, id_scan_page, 6, scan->args);
+}
+
+/* Scores come back as Floats, the same as from zscore */
+static VALUE Scan_pair_value(Scan * scan, VALUE value) {
+    if(FIX2INT(scan->args[0]) != SCAN_SORTED_SET || !RB_TYPE_P(value, T_STRING))
+        return value;
+    return parse_double(RSTRING_PTR(value), RSTRING_LEN(value));
+}
+
+static void Scan_node(Scan * scan, int node) {
+    VALUE page, reply, cursor, elements;
+    long i;
+
+    scan->args[5] = INT2FIX(node);
+    page = Scan_request(scan, rb_str_new_cstr("0"));
+    for(;;) {
+        reply = NIL_P(scan->async) ? page : Future_value(page);
+        if(!RB_TYPE_P(reply, T_ARRAY) || RARRAY_LEN(reply) != 2)
+            rb_raise(cRedisError, "Unexpected reply to %s", scan_commands[FIX2INT(scan->args[0])]);
+        cursor = RARRAY_AREF(reply, 0);
+        elements = RARRAY_AREF(reply, 1);
+        if(!RB_TYPE_P(elements, T_ARRAY))
+            rb_raise(cRedisError, "Unexpected reply to %s", scan_commands[FIX2INT(scan->args[0])]);
+
+        if(!NIL_P(scan->async) && strcmp(StringValueCStr(cursor), "0"))
+            page = Scan_request(scan, cursor);
+
+        if(scan->pairs) {
+            for(i = 0; i + 1 < RARRAY_LEN(elements); i += 2)
+                rb_yield_values(2, RARRAY_AREF(elements, i), Scan_pair_value(scan, RARRAY_AREF(elements, i + 1)));
+        } else {
+            for(i = 0; i < RARRAY_LEN(elements); i++)
+                rb_yield(RARRAY_AREF(elements, i));
+        }
+
+        if(!strcmp(StringValueCStr(cursor), "0"))
+            break;
+        if(NIL_P(scan->async))
+            page = Scan_request(scan, cursor);
+    }
+}
+
+/* Takes the :match, :count and :prefetch options and walks every node, or
+   just the one owning the key */
+static VALUE Redis_scan(VALUE self, int kind, VALUE key, VALUE options) {
+    static ID keywords[3];
+    VALUE values[3];
+    Redis * redis;
+    Scan scan;
+    int node;
+
+    TypedData_Get_Struct(self, Redis, &redis_type, redis);
+    if(redis->pipelined)
+        rb_raise(cRedisError, "scans cannot be pipelined");
+    if(!keywords[0]) {
+        keywords[0] = rb_intern("match");
+        keywords[1] = rb_intern("count");
+        keywords[2] = rb_intern("prefetch");
+    }
+    rb_get_kwargs(options, keywords, 0, 3, values);
+
+    scan.redis = self;
+    scan.async = values[2] != Qundef && RTEST(values[2]) ? Redis_async(self) : Qnil;
+    scan.args[0] = INT2FIX(kind);
+    scan.args[1] = NIL_P(key) ? Qnil : encode_argument('k', key);
+    scan.args[3] = values[0] == Qundef ? Qnil : values[0];
+    scan.args[4] = values[1] == Qundef ? Qnil : values[1];
+    scan.pairs = kind == SCAN_SORTED_SET || kind == SCAN_HASH;
+
+    if(NIL_P(key)) {
+        for(node = 0; node < redis->connection_count; node++)
+            Scan_node(&scan, node);
+    } else {
+        Scan_node(&scan, Redis_node(redis, scan.args[1]));
+    }
+    return self;
+}
+
+/* Yields every key, optionally only those matching :match */
+static VALUE Redis_scan_each(int argc, VALUE * argv, VALUE self) {
+    VALUE options;
+
+    RETURN_ENUMERATOR(self, argc, argv);
+    rb_scan_args(argc, argv, ":", &options);
+    return Redis_scan(self, SCAN_KEYS, Qnil, options);
+}
+
+/* Yields every member of a set */
+static VALUE Redis_sscan_each(int argc, VALUE * argv, VALUE self) {
+    VALUE key, options;
+
+    RETURN_ENUMERATOR(self, argc, argv);
+    rb_scan_args(argc, argv, "1:", &key, &options);
+    return Redis_scan(self, SCAN_SET, key, options);
+}
+
+/* Yields every member of a sorted set with its score */
+static VALUE Redis_zscan_each(int argc, VALUE * argv, VALUE self) {
+    VALUE key, options;
+
+    RETURN_ENUMERATOR(self, argc, argv);
+    rb_scan_args(argc, argv, "1:", &key, &options);
+    return Redis_scan(self, SCAN_SORTED_SET, key, options);
+}
+
+/* Yields every field of a hash with its value */
+static VALUE Redis_hscan_each(int argc, VALUE * argv, VALUE self) {
+    VALUE key, options;
+
+    RETURN_ENUMERATOR(self, argc, argv);
+    rb_scan_args(argc, argv, "1:", &key, &options);
+    return Redis_scan(self, SCAN_HASH, key, options);
+}
+
+
+/* Bulk load functions
+
+   Redis#bulk_load sends a stream of commands in chunks of a bounded
+   number of commands and bytes. Every node gets connections of its own for
+   the load, one per chunk it can have in flight. Entries are only taken
+   from the enumerator while there is room in the window of their node;
+   once a node has a full window, the chunks of every node go out in one
+   round trip and are freed again. Commands without a key go to every
+   node, like anywhere else. A chunk that fails, or an entry that cannot
+   be sent at all, is reported and the load goes on with the next one. */
+
+typedef struct {
+    Batch * batch;
+    long commands;
+    long bytes;
+} LoadChunk;
+
+typedef struct {
+    Redis * redis;
+    VALUE entries;
+    int command_id;
+    int window;
+    long chunk_size;
+    long chunk_bytes;
+    Connection ** connections;  /* window per node */
+    LoadChunk * chunks;         /* window + 1 per node; the full ones, then the one being filled */
+    int * full;                 /* full chunks per node */
+    Batch ** filling;           /* the batch being filled for each node */
+    const CommandSpec * spec;   /* of the last command, to skip the lookup */
+    ID spec_name;
+    VALUE on_error;
+    long sent;                  /* chunks so far */
+    long commands;
+    long failed;
+    unsigned long long bytes;
+    VALUE errors;
+} Loader;
+
+static const CommandSpec * Loader_spec(Loader * loader, VALUE name) {
+    const char * method;
+    int i;
+
+    if(!SYMBOL_P(name))
+        rb_raise(rb_eArgError, "commands to load must start with a Symbol");
+    if(loader->spec && SYM2ID(name) == loader->spec_name)
+        return loader->spec;
+
+    method = rb_id2name(SYM2ID(name));
+    for(i = 0; i < COMMAND_COUNT; i++) {
+        if(!strcasecmp(command_table[i].name, method) && i != COMMAND_MSET) {
+            loader->spec = &(command_table[i]);
+            loader->spec_name = SYM2ID(name);
+            return loader->spec;
+        }
+    }
+    rb_raise(rb_eArgError, "cannot load %s", method);
+    return NULL;
+}
+
+/* A report lists the server, nil for an entry that was never sent */
+static VALUE Loader_new_report(Loader * loader, int node, long commands, long failed, VALUE error) {
+    VALUE report = rb_hash_new();
+
+    rb_hash_aset(report, ID2SYM(rb_intern("server")), node < 0 ? Qnil : rb_ary_entry(loader->redis->connection_strings, node));
+    rb_hash_aset(report, ID2SYM(rb_intern("chunk")), LONG2NUM(loader->sent));
+    rb_hash_aset(report, ID2SYM(rb_intern("commands")), LONG2NUM(commands));
+    rb_hash_aset(report, ID2SYM(rb_intern("failed")), LONG2NUM(failed));
+    rb_hash_aset(report, ID2SYM(rb_intern("error")), error);
+    return report;
+}
+
+static void Loader_push_report(Loader * loader, VALUE report, long failed) {
+    rb_ary_push(loader->errors, report);
+    loader->failed += failed;
+    if(!NIL_P(loader->on_error))
+        rb_funcall(loader->on_error, rb_intern("call"), 1, report);
+}
+
+static void Loader_report(Loader * loader, int node, LoadChunk * chunk, long failed, VALUE error) {
+    Loader_push_report(loader, Loader_new_report(loader, node, chunk->commands, failed, error), failed);
+}
+
+/* Reports an entry that raised before it got into a chunk, with the
+   entry itself under :entry */
+static void Loader_reject(Loader * loader, VALUE entry, VALUE error) {
+    VALUE report = Loader_new_report(loader, -1, 1, 1, rb_funcall(error, rb_intern("message"), 0));
+
+    rb_hash_aset(report, ID2SYM(rb_intern("entry")), entry);
+    loader->commands++;
+    Loader_push_report(loader, report, 1);
+}
+
+/* Reads the replies of a chunk. Returns 0 if the connection it went over
+   is out of step and has to be replaced. */
+static int Loader_read(Loader * loader, int node, LoadChunk * chunk) {
+    VALUE error = Qnil;
+    long i, failed = 0;
+    Reply reply;
+    char * message = Batch_error(chunk->batch);
+
+    if(message) {
+        Loader_report(loader, node, chunk, chunk->commands, rb_str_new_cstr(message));
+        return 0;
+    }
+
+    reply.batch = chunk->batch;
+    reply.stats = loader->redis->stats;
+    reply.codec = NULL;
+    for(i = 0; i < chunk->commands; i++) {
+        if(!Batch_next_reply(chunk->batch, &(reply.reply_type), &(reply.data), &(reply.length))) {
+            Loader_report(loader, node, chunk, failed + chunk->commands - i, rb_str_new_cstr("Timed out waiting for the replies"));
+            return 0;
+        }
+        Stats_read(&reply);
+        if(reply.reply_type == RT_ERROR) {
+            if(NIL_P(error))
+                error = rb_str_new(reply.data, reply.length);
+            failed++;
+        } else if(reply.reply_type == RT_MULTIBULK) {
+            return_multibulk(&reply);
+        }
+    }
+    if(failed)
+        Loader_report(loader, node, chunk, failed, error);
+    return 1;
+}
+
+/* Opens the connections the full chunks are about to go over, and sends
+   them the setup of their node. A connection that cannot be set up is
+   closed again, and the error returned to report its chunks with. */
+static VALUE Loader_connect(Loader * loader) {
+    Redis * redis = loader->redis;
+    int size = redis->connection_count * loader->window;
+    Node ** nodes = ALLOCA_N(Node *, size);
+    Connection ** connections = ALLOCA_N(Connection *, size);
+    int * slots = ALLOCA_N(int, size);
+    int * results = ALLOCA_N(int, size);
+    int node, i, slot, count = 0;
+    VALUE error;
+
+    for(node = 0; node < redis->connection_count; node++) {
+        for(i = 0; i < loader->full[node]; i++) {
+            slot = node * loader->window + i;
+            if(loader->connections[slot])
+                continue;
+            loader->connections[slot] = Node_connection(&(redis->nodes[node]));
+            if(!redis->nodes[node].setup)
+                continue;
+            nodes[count] = &(redis->nodes[node]);
+            connections[count] = loader->connections[slot];
+            slots[count++] = slot;
+        }
+    }
+    if(!count)
+        return Qnil;
+
+    error = setup_connections(redis, nodes, connections, count, results);
+    for(i = 0; i < count; i++) {
+        if(results[i] > 0)
+            continue;
+        Connection_free(loader->connections[slots[i]]);
+        loader->connections[slots[i]] = NULL;
+    }
+    return NIL_P(error) ? Qnil : rb_funcall(error, rb_intern("message"), 0);
+}
+
+/* Sends the chunks of every node in one round trip, the one being filled
+   too when finishing */
+static void Loader_flush(Loader * loader, int finish) {
+    Redis * redis = loader->redis;
+    int node, i, slot, count = 0, full = 0, result = 0;
+    Executor * executor;
+    VALUE error;
+    unsigned long long started = monotonic_nanoseconds();
+    LoadChunk * chunk;
+
+    for(node = 0; node < redis->connection_count; node++) {
+        if(finish && loader->filling[node]) {
+            loader->chunks[node * (loader->window + 1) + loader->full[node]].batch = loader->filling[node];
+            loader->filling[node] = NULL;
+            loader->full[node]++;
+        }
+        full += loader->full[node];
+    }
+    if(!full)
+        return;
+    error = Loader_connect(loader);
+
+    executor = Executor_new();
+    for(node = 0; node < redis->connection_count; node++) {
+        for(i = 0; i < loader->full[node]; i++) {
+            slot = node * loader->window + i;
+            if(!loader->connections[slot])
+                continue;
+            Executor_add(executor, loader->connections[slot], loader->chunks[node * (loader->window + 1) + i].batch);
+            count++;
+        }
+    }
+    if(count)
+        result = run_executor(executor, redis->options.timeout);
+    Executor_free(executor);
+    if(redis->stats && count)
+        Stats_record(redis->stats, loader->command_id, result, started);
+    if(redis->cache)
+        redis->cache->generation++;
+
+    for(node = 0; node < redis->connection_count; node++) {
+        for(i = 0; i < loader->full[node]; i++) {
+            slot = node * loader->window + i;
+            chunk = &(loader->chunks[node * (loader->window + 1) + i]);
+            if(!loader->connections[slot]) {
+                Loader_report(loader, node, chunk, chunk->commands, error);
+            } else if(!Loader_read(loader, node, chunk)) {
+                Connection_free(loader->connections[slot]);
+                loader->connections[slot] = NULL;
+            }
+            loader->sent++;
+            Batch_free(chunk->batch);
+            chunk->batch = NULL;
+            chunk->commands = 0;
+            chunk->bytes = 0;
+        }
+
+        /* The chunk being filled moves up to the first slot */
+        if(loader->full[node]) {
+            slot = node * (loader->window + 1);
+            loader->chunks[slot] = loader->chunks[slot + loader->full[node]];
+            loader->chunks[slot + loader->full[node]].commands = 0;
+            loader->chunks[slot + loader->full[node]].bytes = 0;
+        }
+        loader->full[node] = 0;
+    }
+}
+
+typedef struct {
+    Loader * loader;
+    VALUE entry;
+    const CommandSpec * spec;
+    VALUE args;                 /* encoded */
+    int node;                   /* -1 for every node */
+} LoadEntry;
+
+/* Looks up the command of an entry, encodes its arguments and checks its
+   keys, raising for anything that cannot be sent */
+static VALUE Loader_parse(VALUE arg) {
+    LoadEntry * load = (LoadEntry *) arg;
+    Redis * redis = load->loader->redis;
+    VALUE entry = rb_Array(load->entry);
+    const VALUE * argv;
+    VALUE * args;
+    Command cmd;
+    long i, argc;
+
+    if(RARRAY_LEN(entry) == 2 && !SYMBOL_P(RARRAY_AREF(entry, 0))) {
+        load->spec = &(command_table[COMMAND_SET]);
+        argc = 2;
+        argv = RARRAY_CONST_PTR(entry);
+    } else {
+        if(RARRAY_LEN(entry) == 0)
+            rb_raise(rb_eArgError, "cannot load an empty command");
+        load->spec = Loader_spec(load->loader, RARRAY_AREF(entry, 0));
+        argc = RARRAY_LEN(entry) - 1;
+        rb_check_arity(argc, load->spec->min_args, load->spec->max_args);
+        argv = RARRAY_CONST_PTR(entry) + 1;
+    }
+    args = ALLOCA_N(VALUE, argc);
+    encode_arguments(redis, load->spec, argc, argv, args);
+    load->args = rb_ary_new4(argc, args);
+    RB_GC_GUARD(entry);
+
+    load->node = cmd.first = load->spec->arguments[0] == 'k' ? Redis_node(redis, args[0]) : -1;
+    for(i = 1; i < argc; i++) {
+        if(CommandSpec_argument(load->spec, i) == 'k')
+            Command_check_key(redis, &cmd, args[i]);
+    }
+    return Qnil;
+}
+
+/* Counts a command into the chunk being filled for a node. Returns 1 once
+   that fills up the window of the node. */
+static int Loader_count(Loader * loader, int node, long bytes) {
+    LoadChunk * chunk = &(loader->chunks[node * (loader->window + 1) + loader->full[node]]);
+
+    chunk->commands++;
+    chunk->bytes += bytes;
+    loader->commands++;
+    loader->bytes += bytes;
+    if(chunk->commands < loader->chunk_size && chunk->bytes < loader->chunk_bytes)
+        return 0;
+
+    chunk->batch = loader->filling[node];
+    loader->filling[node] = NULL;
+    return ++loader->full[node] == loader->window;
+}
+
+/* Adds a command, [:name, arguments...], or a [key, value] pair to SET */
+static void Loader_add(Loader * loader, VALUE entry) {
+    Redis * redis = loader->redis;
+    LoadEntry load;
+    const VALUE * args;
+    Command cmd;
+    VALUE error;
+    long i, argc, bytes = 16;
+    int state, flush = 0;
+
+    load.loader = loader;
+    load.entry = entry;
+    rb_protect(Loader_parse, (VALUE) &load, &state);
+    if(state) {
+        error = rb_errinfo();
+        if(!rb_obj_is_kind_of(error, rb_eStandardError))
+            rb_jump_tag(state);
+        rb_set_errinfo(Qnil);
+        Loader_reject(loader, entry, error);
+        return;
+    }
+    argc = RARRAY_LEN(load.args);
+    args = RARRAY_CONST_PTR(load.args);
+
+    cmd.batches = loader->filling;
+    cmd.fallbacks = NULL;
+    cmd.id = load.spec->id;
+    cmd.stats = redis->stats;
+    cmd.cache = redis->cache;
+    cmd.first = load.node < 0 ? 0 : load.node;
+    cmd.last = load.node < 0 ? redis->connection_count - 1 : load.node;
+    for(i = 0; i < argc; i++) {
+        if(CommandSpec_argument(load.spec, i) == 'k')
+            Command_invalidate(&cmd, args[i]);
+    }
+    if(load.node < 0 && cmd.cache && !command_read_only[cmd.id])
+        Cache_clear(cmd.cache);
+    for(i = 0; i < argc; i++)
+        bytes += RB_TYPE_P(args[i], T_STRING) ? RSTRING_LEN(args[i]) + 16 : 32;
+
+    for(cmd.node = cmd.first; cmd.node <= cmd.last; cmd.node++) {
+        Command_encode(&cmd, load.spec, argc, args);
+        flush |= Loader_count(loader, cmd.node, bytes);
+    }
+    RB_GC_GUARD(load.args);
+    if(flush)
+        Loader_flush(loader, 0);
+}
+
+static VALUE Loader_add_i(RB_BLOCK_CALL_FUNC_ARGLIST(entry, arg)) {
+    Loader_add((Loader *) arg, argc > 1 ? rb_ary_new4(argc, argv) : entry);
+    return Qnil;
+}
+
+static VALUE Loader_run(VALUE arg) {
+    Loader * loader = (Loader *) arg;
+
+    rb_block_call(loader->entries, rb_intern("each"), 0, NULL, Loader_add_i, (VALUE) loader);
+    Loader_flush(loader, 1);
+    return Qnil;
+}
+
+static VALUE Loader_free(VALUE arg) {
+    Loader * loader = (Loader *) arg;
+    int i, count = loader->redis->connection_count;
+
+    for(i = 0; i < count * loader->window; i++) {
+        if(loader->connections[i])
+            Connection_free(loader->connections[i]);
+    }
+    for(i = 0; i < count * (loader->window + 1); i++) {
+        if(loader->chunks[i].batch)
+            Batch_free(loader->chunks[i].batch);
+    }
+    for(i = 0; i < loader->redis->connection_count; i++) {
+        if(loader->filling[i])
+            Batch_free(loader->filling[i]);
+    }
+    xfree(loader->connections);
+    xfree(loader->chunks);
+    xfree(loader->full);
+    xfree(loader->filling);
+    return Qnil;
+}
+
+/* Sends every entry of an enumerable, [:command, arguments...] or a
+   [key, value] pair to SET, and returns counts and timings of the load.
+
+   Options:
+     :window      - chunks in flight per server, 4 by default
+     :chunk_size  - commands per chunk, 1000 by default
+     :chunk_bytes - bytes per chunk, roughly, 1mb by default
+
+   Failed chunks, chunks with error replies and entries that could not be
+   sent, like a command with keys on several servers, are listed under
+   :errors and yielded to the block if there is one. */
+static VALUE Redis_bulk_load(int argc, VALUE * argv, VALUE self) {
+    static ID keywords[3];
+    VALUE entries, options, values[3], result;
+    Redis * redis;
+    Loader loader;
+    unsigned long long started;
+    double seconds;
+
+    rb_scan_args(argc, argv, "1:", &entries, &options);
+    TypedData_Get_Struct(self, Redis, &redis_type, redis);
+    if(redis->pipelined || Redis_watch_of(redis))
+        rb_raise(cRedisError, "bulk loads cannot be pipelined");
+    if(!keywords[0]) {
+        keywords[0] = rb_intern("window");
+        keywords[1] = rb_intern("chunk_size");
+        keywords[2] = rb_intern("chunk_bytes");
+    }
+    rb_get_kwargs(options, keywords, 0, 3, values);
+
+    MEMZERO(&loader, Loader, 1);
+    loader.redis = redis;
+    loader.command_id = Command_id("BULK_LOAD");
+    loader.window = values[0] == Qundef ? DEFAULT_LOAD_WINDOW : NUM2INT(values[0]);
+    loader.chunk_size = values[1] == Qundef ? DEFAULT_LOAD_CHUNK_SIZE : NUM2LONG(values[1]);
+    loader.chunk_bytes = values[2] == Qundef ? DEFAULT_LOAD_CHUNK_BYTES : NUM2LONG(values[2]);
+    if(loader.window < 1 || loader.chunk_size < 1 || loader.chunk_bytes < 1)
+        rb_raise(rb_eArgError, "window, chunk_size and chunk_bytes must be positive");
+    loader.on_error = rb_block_given_p() ? rb_block_proc() : Qnil;
+    loader.entries = entries;
+    loader.errors = rb_ary_new();
+
+    loader.connections = ZALLOC_N(Connection *, redis->connection_count * loader.window);
+    loader.chunks = ZALLOC_N(LoadChunk, redis->connection_count * (loader.window + 1));
+    loader.full = ZALLOC_N(int, redis->connection_count);
+    loader.filling = ZALLOC_N(Batch *, redis->connection_count);
+
+    started = monotonic_nanoseconds();
+    rb_ensure(Loader_run, (VALUE) &loader, Loader_free, (VALUE) &loader);
+    seconds = (monotonic_nanoseconds() - started) / 1e9;
+
+    result = rb_hash_new();
+    rb_hash_aset(result, ID2SYM(rb_intern("commands")), LONG2NUM(loader.commands));
+    rb_hash_aset(result, ID2SYM(rb_intern("failed")), LONG2NUM(loader.failed));
+    rb_hash_aset(result, ID2SYM(rb_intern("chunks")), LONG2NUM(loader.sent));
+    rb_hash_aset(result, ID2SYM(rb_intern("bytes")), ULL2NUM(loader.bytes));
+    rb_hash_aset(result, ID2SYM(rb_intern("seconds")), DBL2NUM(seconds));
+    rb_hash_aset(result, ID2SYM(rb_intern("commands_per_second")), DBL2NUM(seconds > 0 ? loader.commands / seconds : 0));
+    rb_hash_aset(result, ID2SYM(rb_intern("errors")), loader.errors);
+    RB_GC_GUARD(loader.on_error);
+    return result;
+}
+
+
+/* Script functions
+
+   A registered script is called with EVALSHA, so its source only goes
+   over the wire to a server that does not have it cached yet. When a
+   server answers NOSCRIPT, SCRIPT LOAD and the EVALSHA are sent to it
+   again together in one batch. Pipelines and transactions cannot wait for
+   the answer, so they send the source with EVAL to any server the script
+   is not known to be loaded on; that caches it as well. */
+
+static VALUE cDigestSHA1;
+
+/* Registers the source of a script under the given name, and returns its
+   SHA1. Registering a name again replaces the script. */
+static VALUE Redis_register_script(VALUE self, VALUE name, VALUE source) {
+    Redis * redis;
+    Scripts * scripts;
+    Script * script;
+    VALUE position, sha;
+
+    TypedData_Get_Struct(self, Redis, &redis_type, redis);
+    if(!redis->scripts)
+        rb_raise(cRedisError, "Redis instance is not initialized");
+    scripts = redis->scripts;
+
+    if(!cDigestSHA1) {
+        rb_require("digest/sha1");
+        cDigestSHA1 = rb_path2class("Digest::SHA1");
+    }
+    source = rb_str_new_frozen(StringValue(source));
+    sha = rb_str_new_frozen(rb_funcall(cDigestSHA1, rb_intern("hexdigest"), 1, source));
+
+    position = rb_hash_aref(scripts->index, name);
+    if(NIL_P(position)) {
+        REALLOC_N(scripts->entries, Script, scripts->count + 1);
+        script = &(scripts->entries[scripts->count]);
+        script->loaded = ZALLOC_N(char, redis->connection_count);
+        script->version = ++scripts->versions;
+        rb_hash_aset(scripts->index, name, LONG2FIX(scripts->count));
+        scripts->count++;
+    } else {
+        script = &(scripts->entries[FIX2LONG(position)]);
+        if(!rb_str_equal(script->sha, sha)) {
+            MEMZERO(script->loaded, char, redis->connection_count);
+            script->version = ++scripts->versions;
+        }
+    }
+    script->sha = sha;
+    script->source = source;
+    return sha;
+}
+
+static long Redis_script(Redis * redis, VALUE name) {
+    VALUE position = rb_hash_aref(redis->scripts->index, name);
+
+    if(NIL_P(position))
+        rb_raise(rb_eArgError, "no script registered as %"PRIsVALUE, rb_inspect(name));
+    return FIX2LONG(position);
+}
+
+static void Script_write(Command * cmd, const char * command, VALUE body, VALUE keys, VALUE args) {
+    long i;
+
+    write_multibulk_header(cmd, 3 + RARRAY_LEN(keys) + RARRAY_LEN(args));
+    write_bulk(cmd, command, strlen(command));
+    write_bulk_value(cmd, body);
+    Command_write(cmd, "$", 1, 0);
+    Command_write_decimal(cmd, decimal_length(RARRAY_LEN(keys)));
+    Command_write(cmd, CRLF, sizeof(CRLF) - 1, 0);
+    Command_write_decimal(cmd, RARRAY_LEN(keys));
+    Command_write(cmd, CRLF, sizeof(CRLF) - 1, 0);
+    for(i = 0; i < RARRAY_LEN(keys); i++)
+        write_bulk_value(cmd, RARRAY_AREF(keys, i));
+    for(i = 0; i < RARRAY_LEN(args); i++)
+        write_bulk_value(cmd, RARRAY_AREF(args, i));
+    Command_write(cmd, NULL, 0, 1);
+}
+
+typedef struct {
+    CommandCall call;           /* first, so free_command_batches can be used */
+    long position;              /* in the registry, which can move while the GVL is released */
+    unsigned long version;
+    VALUE sha;
+    VALUE source;
+    VALUE keys;
+    VALUE args;
+} ScriptCall;
+
+static VALUE run_script(VALUE arg) {
+    ScriptCall * call = (ScriptCall *) arg;
+    Redis * redis = call->call.redis;
+    Command * cmd = call->call.cmd;
+    VALUE * values = ALLOCA_N(VALUE, redis->connection_count);
+    char * reload = ALLOCA_N(char, redis->connection_count);
+    VALUE ret = Qundef;
+    Reply reply;
+    int i, retry = 0;
+
+    execute_batches(redis, cmd->batches, cmd->first, cmd->last, cmd->id);
+    for(i = cmd->first; i <= cmd->last; i++) {
+        reply.batch = cmd->batches[i];
+        reply.stats = redis->stats;
+        reply.codec = redis->codec;
+        if(!Batch_next_reply(reply.batch, &(reply.reply_type), &(reply.data), &(reply.length)))
+            reply.reply_type = RT_NONE;
+        Stats_read(&reply);
+        reload[i] = is_noscript(&reply);
+        retry |= reload[i];
+        Scripts_note(redis->scripts, call->position, call->version, i, &reply);
+        if(!reload[i])
+            values[i] = call->call.handler(&reply);
+    }
+
+    if(retry) {
+        for(cmd->node = cmd->first; cmd->node <= cmd->last; cmd->node++) {
+            Batch_free(cmd->batches[cmd->node]);
+            cmd->batches[cmd->node] = NULL;
+            if(!reload[cmd->node])
+                continue;
+            write_multibulk_header(cmd, 3);
+            write_bulk(cmd, "SCRIPT", 6);
+            write_bulk(cmd, "LOAD", 4);
+            write_bulk_value(cmd, call->source);
+            Command_write(cmd, NULL, 0, 1);
+            Script_write(cmd, "EVALSHA", call->sha, call->keys, call->args);
+        }
+        execute_batches(redis, cmd->batches, cmd->first, cmd->last, cmd->id);
+        for(i = cmd->first; i <= cmd->last; i++) {
+            if(!reload[i])
+                continue;
+            next_reply(cmd->batches[i], return_value, redis);
+            reply.batch = cmd->batches[i];
+            if(!Batch_next_reply(reply.batch, &(reply.reply_type), &(reply.data), &(reply.length)))
+                reply.reply_type = RT_NONE;
+            Stats_read(&reply);
+            Scripts_note(redis->scripts, call->position, call->version, i, &reply);
+            values[i] = call->call.handler(&reply);
+        }
+    }
+
+    for(i = cmd->first; i <= cmd->last; i++)
+        ret = merge_replies(ret, values[i]);
+    return ret;
+}
+
+/* Runs a registered script with the given keys and arguments. A script
+   with keys is sent to the server they live on; one without goes to every
+   server, like any other command without a key. */
+static VALUE Redis_run_script(int argc, VALUE * argv, VALUE self) {
+    VALUE name, keys, args;
+    ScriptCall call;
+    Script * script;
+    VALUE future;
+    int loaded = 1;
+    long i, position;
+
+    rb_scan_args(argc, argv, "12", &name, &keys, &args);
+    keys = rb_ary_dup(rb_Array(keys));
+    args = rb_Array(args);
+    for(i = 0; i < RARRAY_LEN(keys); i++)
+        rb_ary_store(keys, i, encode_argument('k', RARRAY_AREF(keys, i)));
+
+    SETUP(EVALSHA, RARRAY_LEN(keys) ? RARRAY_AREF(keys, 0) : Qnil);
+    position = Redis_script(redis, name);
+    script = &(redis->scripts->entries[position]);
+    Command_check_keys(redis, &cmd, RARRAY_CONST_PTR(keys), RARRAY_LEN(keys), 1);
+    Command_invalidate_keys(&cmd, RARRAY_CONST_PTR(keys), RARRAY_LEN(keys), 1);
+
+    if(redis->pipelined) {
+        FOR_EACH_NODE()
+            loaded &= script->loaded[cmd.node];
+        FOR_EACH_NODE()
+            Script_write(&cmd, loaded ? "EVALSHA" : "EVAL", loaded ? script->sha : script->source, keys, args);
+        future = Command_execute(redis, &cmd, ANY);
+        redis->queue[redis->queue_length - 1].script = position;
+        redis->queue[redis->queue_length - 1].version = script->version;
+        return future;
+    }
+
+    FOR_EACH_NODE()
+        Script_write(&cmd, "EVALSHA", script->sha, keys, args);
+    call.call.redis = redis;
+    call.call.cmd = &cmd;
+    call.call.handler = ANY;
+    call.position = position;
+    call.version = script->version;
+    call.sha = script->sha;
+    call.source = script->source;
+    call.keys = keys;
+    call.args = args;
+    return rb_ensure(run_script, (VALUE) &call, free_command_batches, (VALUE) &call);
+}
+
+
+/* Subscriber functions
+
+   A subscriber keeps a connection of its own to every server it has
+   channels on. Channels are sharded over the servers like keys, the same
+   as Redis#publish; patterns go to every server. Waiting for messages is
+   done without the GVL, in poll and recv, and whatever came in is then
+   parsed in place and handed out one message at a time. A pipe wakes the
+   wait up when the thread is interrupted, the subscriber is closed or a
+   new server gets a connection. */
+
+#define PUSH_MAX_ELEMENTS 4
+
+typedef struct {
+    char type;                  /* '$' for a bulk, else the type of the line */
+    const char * data;
+    long length;
+} PushElement;
+
+static const char * find_crlf(const char * data, const char * end) {
+    const char * p = data;
+
+    while((p = memchr(p, '\r', end - p)) && p + 1 < end) {
+        if(p[1] == '\n')
+            return p;
+        p++;
+    }
+    return NULL;
+}
+
+/* Parses one pushed message at the start of data into its elements.
+   Returns its length, or 0 if it is not all there yet. A message that is
+   not an array comes back as a single element. */
+static long parse_push(const char * data, long length, PushElement * elements, int * count) {
+    const char * p = data, * end = data + length, * line;
+    long i, n, size;
+
+    *count = 0;
+    if(!(line = find_crlf(p, end)))
+        return 0;
+    if(*p != '*') {
+        elements[0].type = *p;
+        elements[0].data = p + 1;
+        elements[0].length = line - p - 1;
+        *count = 1;
+        return line + 2 - data;
+    }
+
+    n = strtol(p + 1, NULL, 10);
+    p = line + 2;
+    for(i = 0; i < n; i++) {
+        PushElement element;
+
+        if(!(line = find_crlf(p, end)))
+            return 0;
+        element.type = *p;
+        element.data = p + 1;
+        element.length = line - p - 1;
+        p = line + 2;
+        if(element.type == '$') {
+            size = strtol(element.data, NULL, 10);
+            element.data = NULL;
+            element.length = -1;
+            if(size >= 0) {
+                if(end - p < size + 2)
+                    return 0;
+                element.data = p;
+                element.length = size;
+                p += size + 2;
+            }
+        }
+        if(*count < PUSH_MAX_ELEMENTS)
+            elements[(*count)++] = element;
+    }
+    return p - data;
+}
+
+static int push_is(const PushElement * element, const char * name) {
+    return element->length == (long) strlen(name) && !memcmp(element->data, name, element->length);
+}
+
+static VALUE push_string(const PushElement * element) {
+    return element->data ? rb_str_new(element->data, element->length) : Qnil;
+}
+
+static void Subscriber_mark(Subscriber * subscriber) {
+    rb_gc_mark(subscriber->redis);
+}
+
+static void Subscriber_close_connections(Subscriber * subscriber) {
+    int i;
+
+    for(i = 0; i < subscriber->node_count; i++) {
+        if(subscriber->nodes[i].fd >= 0)
+            close(subscriber->nodes[i].fd);
+        subscriber->nodes[i].fd = -1;
+        subscriber->nodes[i].subscriptions = 0;
+        xfree(subscriber->nodes[i].buffer);
+        subscriber->nodes[i].buffer = NULL;
+    }
+}
+
+static void Subscriber_free(Subscriber * subscriber) {
+    if(subscriber->nodes) {
+        Subscriber_close_connections(subscriber);
+        xfree(subscriber->nodes);
+    }
+    if(subscriber->wakeup[0] >= 0) {
+        close(subscriber->wakeup[0]);
+        close(subscriber->wakeup[1]);
+    }
+    xfree(subscriber);
+}
+
+static size_t Subscriber_memsize(const Subscriber * subscriber) {
+    size_t size = sizeof(Subscriber) + subscriber->node_count * sizeof(SubscriberNode);
+    int i;
+
+    for(i = 0; i < subscriber->node_count; i++)
+        size += subscriber->nodes[i].size;
+    return size;
+}
+
+static const rb_data_type_t subscriber_type = {
+    "Redis::Subscriber",
+    {
+        (void (*)(void *)) Subscriber_mark,
+        (void (*)(void *)) Subscriber_free,
+        (size_t (*)(const void *)) Subscriber_memsize,
+    },
+    0, 0,
+    RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+static VALUE Subscriber_alloc(VALUE klass) {
+    Subscriber * subscriber = ZALLOC(Subscriber);
+
+    subscriber->redis = Qnil;
+    subscriber->wakeup[0] = subscriber->wakeup[1] = -1;
+    return TypedData_Wrap_Struct(klass, &subscriber_type, subscriber);
+}
+
+static VALUE Subscriber_initialize(VALUE self, VALUE parent) {
+    Subscriber * subscriber;
+    Redis * redis;
+    int i;
+
+    if(!rb_obj_is_kind_of(parent, cRedis))
+        rb_raise(rb_eTypeError, "expected a Redis instance");
+    TypedData_Get_Struct(self, Subscriber, &subscriber_type, subscriber);
+    TypedData_Get_Struct(parent, Redis, &redis_type, redis);
+    if(!redis->nodes)
+        rb_raise(cRedisError, "Redis instance is not initialized");
+    if(subscriber->nodes)
+        rb_raise(cRedisError, "Subscriber is already initialized");
+
+    if(pipe(subscriber->wakeup) < 0)
+        rb_sys_fail("pipe");
+    fcntl(subscriber->wakeup[0], F_SETFL, O_NONBLOCK);
+    fcntl(subscriber->wakeup[1], F_SETFL, O_NONBLOCK);
+
+    subscriber->redis = parent;
+    subscriber->node_count = redis->connection_count;
+    subscriber->nodes = ZALLOC_N(SubscriberNode, redis->connection_count);
+    for(i = 0; i < subscriber->node_count; i++)
+        subscriber->nodes[i].fd = -1;
+    return self;
+}
+
+static void Subscriber_wake(Subscriber * subscriber) {
+    ssize_t written = write(subscriber->wakeup[1], "", 1);
+    (void) written;
+}
+
+typedef struct {
+    const char * address;
+    const ConnectionOptions * options;
+    int fd;
+    int error;
+} Connect;
+
+/* Connects without blocking for longer than the connect timeout */
+static int connect_with_timeout(int fd, const struct sockaddr * address, socklen_t length, int timeout) {
+    int flags = fcntl(fd, F_GETFL), error = 0;
+    socklen_t error_length = sizeof(error);
+    struct pollfd pending;
+
+    fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+    if(connect(fd, address, length) < 0) {
+        if(errno != EINPROGRESS)
+            return errno;
+        pending.fd = fd;
+        pending.events = POLLOUT;
+        if(poll(&pending, 1, timeout) <= 0)
+            return ETIMEDOUT;
+        if(getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &error_length) < 0)
+            return errno;
+        if(error)
+            return error;
+    }
+    fcntl(fd, F_SETFL, flags);
+    return 0;
+}
+
+/* The same options libredis sets on its connections */
+static void set_socket_options(int fd, int family, const ConnectionOptions * options) {
+    int one = 1;
+
+    if(options->send_buffer > 0)
+        setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &(options->send_buffer), sizeof(int));
+    if(options->receive_buffer > 0)
+        setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &(options->receive_buffer), sizeof(int));
+    if(family == AF_UNIX)
+        return;
+    if(options->nodelay)
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if(options->keepalive)
+        setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &one, sizeof(one));
+}
+
+static void connect_unix_socket(Connect * connect_call, const char * path) {
+    struct sockaddr_un address;
+
+    if(strlen(path) >= sizeof(address.sun_path)) {
+        connect_call->error = ENAMETOOLONG;
+        return;
+    }
+    MEMZERO(&address, struct sockaddr_un, 1);
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, path);
+    if((connect_call->fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+        connect_call->error = errno;
+        return;
+    }
+    set_socket_options(connect_call->fd, AF_UNIX, connect_call->options);
+    connect_call->error = connect_with_timeout(connect_call->fd, (struct sockaddr *) &address, sizeof(address),
+                                               connect_call->options->connect_timeout);
+    if(connect_call->error) {
+        close(connect_call->fd);
+        connect_call->fd = -1;
+    }
+}
+
+static void * connect_without_gvl(void * arg) {
+    Connect * connect_call = (Connect *) arg;
+    struct addrinfo hints, * addresses, * address;
+    char host[256];
+    const char * colon = strrchr(connect_call->address, ':');
+    const char * port = "6379";
+
+    if(unix_socket_path(connect_call->address)) {
+        connect_unix_socket(connect_call, unix_socket_path(connect_call->address));
+        return NULL;
+    }
+
+    snprintf(host, sizeof(host), "%.*s", colon ? (int) (colon - connect_call->address) : 255, connect_call->address);
+    if(colon)
+        port = colon + 1;
+
+    MEMZERO(&hints, struct addrinfo, 1);
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if(getaddrinfo(host, port, &hints, &addresses)) {
+        connect_call->error = EHOSTUNREACH;
+        return NULL;
+    }
+    connect_call->error = ECONNREFUSED;
+    for(address = addresses; address; address = address->ai_next) {
+        connect_call->fd = socket(address->ai_family, address->ai_socktype, address->ai_protocol);
+        if(connect_call->fd < 0)
+            continue;
+        connect_call->error = connect_with_timeout(connect_call->fd, address->ai_addr, address->ai_addrlen,
+                                                   connect_call->options->connect_timeout);
+        if(!connect_call->error) {
+            set_socket_options(connect_call->fd, address->ai_family, connect_call->options);
+            break;
+        }
+        close(connect_call->fd);
+        connect_call->fd = -1;
+    }
+    freeaddrinfo(addresses);
+    return NULL;
+}
+
+static void Subscriber_send(SubscriberNode * node, VALUE request) {
+    const char * data = RSTRING_PTR(request);
+    long length = RSTRING_LEN(request);
+    ssize_t written;
+
+    while(length > 0) {
+        written = send(node->fd, data, length, 0);
+        if(written < 0 && errno == EINTR)
+            continue;
+        if(written < 0)
+            rb_raise(cRedisError, "Could not send to subscriber connection: %s", strerror(errno));
+        data += written;
+        length -= written;
+    }
+}
+
+static void append_bulk(VALUE request, const char * data, long length) {
+    char header[32];
+
+    rb_str_buf_cat(request, header, snprintf(header, sizeof(header), "$%ld\r\n", length));
+    rb_str_buf_cat(request, data, length);
+    rb_str_buf_cat(request, CRLF, 2);
+}
+
+static SubscriberNode * Subscriber_connect(Subscriber * subscriber, Redis * redis, int index) {
+    SubscriberNode * node = &(subscriber->nodes[index]);
+    Connect connect_call;
+    VALUE request;
+
+    if(node->fd >= 0)
+        return node;
+
+    connect_call.address = redis->nodes[index].address;
+    connect_call.options = &(redis->options);
+    connect_call.fd = -1;
+    connect_call.error = 0;
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+    rb_thread_call_without_gvl(connect_without_gvl, &connect_call, RUBY_UBF_IO, NULL);
+#else
+    connect_without_gvl(&connect_call);
+#endif
+    if(connect_call.fd < 0)
+        rb_raise(cRedisError, "Could not connect to %s: %s", connect_call.address, strerror(connect_call.error));
+
+    if(!node->buffer) {
+        node->buffer = ALLOC_N(char, SUBSCRIBER_BUFFER_SIZE);
+        node->size = SUBSCRIBER_BUFFER_SIZE;
+    }
+    node->start = node->end = 0;
+    node->fd = connect_call.fd;
+    Subscriber_wake(subscriber);
+
+    /* Its reply is read along with the messages, and only raises if it is
+       an error. Channels are the same in every db, so SELECT is left out. */
+    if(!NIL_P(redis->options.password)) {
+        request = rb_str_new_cstr("*2\r\n");
+        append_bulk(request, "AUTH", 4);
+        append_bulk(request, RSTRING_PTR(redis->options.password), RSTRING_LEN(redis->options.password));
+        Subscriber_send(node, request);
+    }
+    return node;
+}
+
+/* Sends a (un)subscribe command. Channels go to the servers they live on,
+   patterns to every server; unless connect is set, servers without a
+   connection are left out. */
+static VALUE Subscriber_command(VALUE self, const char * name, int argc, VALUE * argv, int channels, int connect) {
+    Subscriber * subscriber;
+    Redis * redis;
+    VALUE request, * names;
+    int i, n, count;
+
+    TypedData_Get_Struct(self, Subscriber, &subscriber_type, subscriber);
+    if(!subscriber->nodes)
+        rb_raise(cRedisError, "Subscriber is not initialized");
+    if(subscriber->closed)
+        rb_raise(cRedisError, "Subscriber is closed");
+    TypedData_Get_Struct(subscriber->redis, Redis, &redis_type, redis);
+
+    names = ALLOCA_N(VALUE, argc + 1);
+    for(i = 0; i < argc; i++)
+        names[i] = encode_argument('k', argv[i]);
+
+    for(n = 0; n < subscriber->node_count; n++) {
+        if(!connect && subscriber->nodes[n].fd < 0)
+            continue;
+
+        count = 0;
+        for(i = 0; i < argc; i++)
+            count += !channels || Redis_node(redis, names[i]) == n;
+        if(argc > 0 && count == 0)
+            continue;
+
+        request = rb_sprintf("*%d\r\n", count + 1);
+        append_bulk(request, name, strlen(name));
+        for(i = 0; i < argc; i++) {
+            if(!channels || Redis_node(redis, names[i]) == n)
+                append_bulk(request, RSTRING_PTR(names[i]), RSTRING_LEN(names[i]));
+        }
+        Subscriber_send(Subscriber_connect(subscriber, redis, n), request);
+    }
+    return self;
+}
+
+/* Subscribes to the given channels */
+static VALUE Subscriber_subscribe(int argc, VALUE * argv, VALUE self) {
+    rb_check_arity(argc, 1, UNLIMITED_ARGUMENTS);
+    return Subscriber_command(self, "SUBSCRIBE", argc, argv, 1, 1);
+}
+
+/* Unsubscribes from the given channels, or from all of them */
+static VALUE Subscriber_unsubscribe(int argc, VALUE * argv, VALUE self) {
+    return Subscriber_command(self, "UNSUBSCRIBE", argc, argv, 1, 0);
+}
+
+/* Subscribes to the channels matching the given patterns */
+static VALUE Subscriber_psubscribe(int argc, VALUE * argv, VALUE self) {
+    rb_check_arity(argc, 1, UNLIMITED_ARGUMENTS);
+    return Subscriber_command(self, "PSUBSCRIBE", argc, argv, 0, 1);
+}
+
+/* Unsubscribes from the given patterns, or from all of them */
+static VALUE Subscriber_punsubscribe(int argc, VALUE * argv, VALUE self) {
+    return Subscriber_command(self, "PUNSUBSCRIBE", argc, argv, 0, 0);
+}
+
+/* Channels and patterns subscribed to, as last reported by the servers */
+static VALUE Subscriber_subscriptions(VALUE self) {
+    Subscriber * subscriber;
+    long count = 0;
+    int i;
+
+    TypedData_Get_Struct(self, Subscriber, &subscriber_type, subscriber);
+    for(i = 0; i < subscriber->node_count; i++)
+        count += subscriber->nodes[i].subscriptions;
+    return LONG2NUM(count);
+}
+
+typedef struct {
+    Subscriber * subscriber;
+    struct pollfd * fds;        /* the connections, then the wakeup pipe */
+    int * nodes;
+    int count;
+    int error;                  /* errno, or -1 for a connection closed by the server */
+} SubscriberWait;
+
+static void * wait_for_messages(void * arg) {
+    SubscriberWait * wait = (SubscriberWait *) arg;
+    SubscriberNode * node;
+    ssize_t received;
+    int i;
+
+    if(poll(wait->fds, wait->count + 1, -1) < 0) {
+        wait->error = errno == EINTR ? 0 : errno;
+        return NULL;
+    }
+    for(i = 0; i < wait->count; i++) {
+        if(!(wait->fds[i].revents & (POLLIN | POLLHUP | POLLERR)))
+            continue;
+        node = &(wait->subscriber->nodes[wait->nodes[i]]);
+        received = recv(node->fd, node->buffer + node->end, node->size - node->end, 0);
+        if(received > 0)
+            node->end += received;
+        else if(received == 0)
+            wait->error = -1;
+        else if(errno != EINTR && errno != EAGAIN)
+            wait->error = errno;
+    }
+    return NULL;
+}
+
+static void stop_waiting_for_messages(void * arg) {
+    Subscriber_wake((Subscriber *) arg);
+}
+
+/* Makes room in the buffer of every connection, then waits until at least
+   one of them has data or the wakeup pipe is written to */
+static void Subscriber_wait(Subscriber * subscriber) {
+    SubscriberWait wait;
+    SubscriberNode * node;
+    char drain[64];
+    int i;
+
+    wait.subscriber = subscriber;
+    wait.fds = ALLOCA_N(struct pollfd, subscriber->node_count + 1);
+    wait.nodes = ALLOCA_N(int, subscriber->node_count);
+    wait.count = 0;
+    wait.error = 0;
+    for(i = 0; i < subscriber->node_count; i++) {
+        node = &(subscriber->nodes[i]);
+        if(node->fd < 0)
+            continue;
+        if(node->start > 0) {
+            memmove(node->buffer, node->buffer + node->start, node->end - node->start);
+            node->end -= node->start;
+            node->start = 0;
+        }
+        if(node->end == node->size) {
+            node->size *= 2;
+            REALLOC_N(node->buffer, char, node->size);
+        }
+        wait.fds[wait.count].fd = node->fd;
+        wait.fds[wait.count].events = POLLIN;
+        wait.fds[wait.count].revents = 0;
+        wait.nodes[wait.count++] = i;
+    }
+    wait.fds[wait.count].fd = subscriber->wakeup[0];
+    wait.fds[wait.count].events = POLLIN;
+    wait.fds[wait.count].revents = 0;
+
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+    rb_thread_call_without_gvl(wait_for_messages, &wait, stop_waiting_for_messages, subscriber);
+#else
+    wait_for_messages(&wait);
+#endif
+    while(read(subscriber->wakeup[0], drain, sizeof(drain)) > 0);
+    rb_thread_check_ints();
+
+    if(wait.error == -1)
+        rb_raise(cRedisError, "Subscriber connection closed by the server");
+    if(wait.error)
+        rb_raise(cRedisError, "Could not read from subscriber connection: %s", strerror(wait.error));
+}
+
+typedef struct {
+    VALUE self;
+    Subscriber * subscriber;
+    VALUE queue;                /* nil to yield the messages instead */
+} SubscriberRun;
+
+static void Subscriber_deliver(SubscriberRun * run, VALUE channel, VALUE message, VALUE pattern) {
+    static ID id_push;
+    VALUE values[3];
+    int count = NIL_P(pattern) ? 2 : 3;
+
+    values[0] = channel;
+    values[1] = message;
+    values[2] = pattern;
+    if(NIL_P(run->queue)) {
+        rb_yield_values2(count, values);
+        return;
+    }
+    if(!id_push)
+        id_push = rb_intern("push");
+    rb_funcall(run->queue, id_push, 1, rb_ary_new_from_values(count, values));
+}
+
+/* Handles one pushed message. Returns 1 once nothing is subscribed to any
+   more. */
+static int Subscriber_handle(SubscriberRun * run, SubscriberNode * node, PushElement * elements, int count) {
+    long total = 0;
+    int i;
+
+    if(count == 1 && elements[0].type == '-')
+        rb_exc_raise(rb_exc_new(cRedisError, elements[0].data, elements[0].length));
+    if(count < 3 || elements[0].type != '$')
+        return 0;
+
+    if(push_is(&elements[0], "message")) {
+        Subscriber_deliver(run, push_string(&elements[1]), push_string(&elements[2]), Qnil);
+    } else if(count == 4 && push_is(&elements[0], "pmessage")) {
+        Subscriber_deliver(run, push_string(&elements[2]), push_string(&elements[3]), push_string(&elements[1]));
+    } else if(elements[2].type == ':') {
+        node->subscriptions = strtol(elements[2].data, NULL, 10);
+        if(push_is(&elements[0], "unsubscribe") || push_is(&elements[0], "punsubscribe")) {
+            for(i = 0; i < run->subscriber->node_count; i++)
+                total += run->subscriber->nodes[i].subscriptions;
+            return total == 0;
+        }
+    }
+    return 0;
+}
+
+static VALUE Subscriber_run(VALUE arg) {
+    SubscriberRun * run = (SubscriberRun *) arg;
+    Subscriber * subscriber = run->subscriber;
+    SubscriberNode * node;
+    PushElement elements[PUSH_MAX_ELEMENTS];
+    long length;
+    int i, count;
+
+    for(;;) {
+        for(i = 0; i < subscriber->node_count; i++) {
+            node = &(subscriber->nodes[i]);
+            while(!subscriber->closed && node->fd >= 0 && node->end > node->start) {
+                length = parse_push(node->buffer + node->start, node->end - node->start, elements, &count);
+                if(!length)
+                    break;
+                node->start += length;
+                if(Subscriber_handle(run, node, elements, count))
+                    return run->self;
+            }
+        }
+        if(subscriber->closed)
+            return run->self;
+        Subscriber_wait(subscriber);
+    }
+}
+
+static VALUE Subscriber_stop(VALUE arg) {
+    Subscriber * subscriber = ((SubscriberRun *) arg)->subscriber;
+
+    subscriber->running = 0;
+    if(subscriber->closed)
+        Subscriber_close_connections(subscriber);
+    return Qnil;
+}
+
+/* Yields the channel and message of every message, with the pattern as
+   well for those that matched one, or pushes them onto the given queue as
+   an array; a SizedQueue holds the subscriber back while it is full.
+   Returns once everything is unsubscribed from, or the subscriber is
+   closed. */
+static VALUE Subscriber_each(int argc, VALUE * argv, VALUE self) {
+    SubscriberRun run;
+
+    rb_scan_args(argc, argv, "01", &run.queue);
+    if(NIL_P(run.queue))
+        RETURN_ENUMERATOR(self, argc, argv);
+
+    run.self = self;
+    TypedData_Get_Struct(self, Subscriber, &subscriber_type, run.subscriber);
+    if(!run.subscriber->nodes)
+        rb_raise(cRedisError, "Subscriber is not initialized");
+    if(run.subscriber->running)
+        rb_raise(cRedisError, "Subscriber is already running");
+    run.subscriber->running = 1;
+    return rb_ensure(Subscriber_run, (VALUE) &run, Subscriber_stop, (VALUE) &run);
+}
+
+/* Drops all connections. Can be called from any thread, or from the block
+   given to each, which then returns. */
+static VALUE Subscriber_close(VALUE self) {
+    Subscriber * subscriber;
+
+    TypedData_Get_Struct(self, Subscriber, &subscriber_type, subscriber);
+    subscriber->closed = 1;
+    if(subscriber->running)
+        Subscriber_wake(subscriber);
+    else if(subscriber->nodes)
+        Subscriber_close_connections(subscriber);
+    return Qnil;
+}
+
+static VALUE Redis_subscriber(VALUE self) {
+    return rb_class_new_instance(1, &self, cRedisSubscriber);
+}
+
+typedef struct {
+    VALUE subscriber;
+    const char * command;
+    int argc;
+    VALUE * argv;
+} SubscribeCall;
+
+static VALUE subscribe_and_run(VALUE arg) {
+    SubscribeCall * call = (SubscribeCall *) arg;
+
+    Subscriber_command(call->subscriber, call->command, call->argc, call->argv, call->command[0] == 'S', 1);
+    return Subscriber_each(0, NULL, call->subscriber);
+}
+
+static VALUE Redis_subscribe_with(int argc, VALUE * argv, VALUE self, const char * command) {
+    SubscribeCall call;
+
+    rb_need_block();
+    rb_check_arity(argc, 1, UNLIMITED_ARGUMENTS);
+    call.subscriber = Redis_subscriber(self);
+    call.command = command;
+    call.argc = argc;
+    call.argv = argv;
+    return rb_ensure(subscribe_and_run, (VALUE) &call, Subscriber_close, call.subscriber);
+}
+
+/* Subscribes to the given channels on a connection of its own, and yields
+   the channel and message of every message until the block breaks out.
+   Redis#subscriber gives a Redis::Subscriber to change the channels on
+   the way. */
+static VALUE Redis_subscribe(int argc, VALUE * argv, VALUE self) {
+    Redis_subscribe_with(argc, argv, self, "SUBSCRIBE");
+    return Qnil;
+}
+
+/* Likewise for patterns, yielding the channel, message and pattern */
+static VALUE Redis_psubscribe(int argc, VALUE * argv, VALUE self) {
+    Redis_subscribe_with(argc, argv, self, "PSUBSCRIBE");
+    return Qnil;
+}
+
+
+void Init_redis() {
+    int i;
+
+    module = Module_new();
+    Module_set_alloc_alloc(module, (void * (*)()) pool_alloc);
+    Module_set_alloc_realloc(module, pool_realloc);
+    Module_set_alloc_free(module, pool_free);
+    Module_init(module);
+
+    pipeline_command_id = Command_id("PIPELINE");
+    multi_command_id = Command_id("MULTI");
+    watch_command_id = Command_id("WATCH");
+    unwatch_command_id = Command_id("UNWATCH");
+    command_read_only[watch_command_id] = 1;
+    command_read_only[unwatch_command_id] = 1;
+
     cRedis = rb_define_class("Redis", rb_cObject);
     rb_define_alloc_func(cRedis, Redis_alloc);
-    rb_define_method(cRedis, "initialize", Redis_initialize, 1);
+    rb_define_singleton_method(cRedis, "allocation_stats", Redis_s_allocation_stats, 0);
+    rb_define_method(cRedis, "initialize", Redis_initialize, -1);
     rb_define_method(cRedis, "connections", Redis_connections, 0);
+    rb_define_method(cRedis, "replicas", Redis_replicas, 0);
+    rb_define_method(cRedis, "pipelined", Redis_pipelined, 0);
+    rb_define_method(cRedis, "multi", Redis_multi, 0);
+    rb_define_method(cRedis, "watch", Redis_watch, -1);
+    rb_define_method(cRedis, "register_script", Redis_register_script, 2);
+    rb_define_method(cRedis, "run_script", Redis_run_script, -1);
+    rb_define_method(cRedis, "subscriber", Redis_subscriber, 0);
+    rb_define_method(cRedis, "subscribe", Redis_subscribe, -1);
+    rb_define_method(cRedis, "psubscribe", Redis_psubscribe, -1);
+    rb_define_method(cRedis, "allocated_bytes", Redis_allocated_bytes, 0);
+    rb_define_method(cRedis, "stats", Redis_stats, 0);
+    rb_define_method(cRedis, "reset_stats", Redis_reset_stats, 0);
+    rb_define_method(cRedis, "async", Redis_async, 0);
+    rb_define_method(cRedis, "near_cache_stats", Redis_near_cache_stats, 0);
+    rb_define_method(cRedis, "invalidate", Redis_invalidate, -1);
+
+    /* Streaming commands, which can be neither pipelined nor queued */
+    rb_define_method(cRedis, "set_from_io", Redis_set_from_io, 3);
+    rb_define_method(cRedis, "get_to_io", Redis_get_to_io, 2);
+    rb_define_method(cRedis, "get_stream", Redis_get_stream, 1);
+
+    /* Scans, which walk a page at a time */
+    rb_define_method(cRedis, "scan_each", Redis_scan_each, -1);
+    rb_define_method(cRedis, "sscan_each", Redis_sscan_each, -1);
+    rb_define_method(cRedis, "zscan_each", Redis_zscan_each, -1);
+    rb_define_method(cRedis, "hscan_each", Redis_hscan_each, -1);
+    rb_define_private_method(cRedis, "scan_page", Redis_scan_page, 6);
+    rb_define_method(cRedis, "bulk_load", Redis_bulk_load, -1);
+    for(i = 0; i < 4; i++) {
+        scan_command_ids[i] = Command_id(scan_commands[i]);
+        command_read_only[scan_command_ids[i]] = 1;
+    }
+
+    for(i = 0; i < COMMAND_COUNT; i++) {
+        CommandSpec_prepare(&(command_table[i]));
+        rb_define_method(cRedis, command_table[i].method, command_table[i].function, -1);
+    }
+
+    cRedisPipeline = rb_define_class_under(cRedis, "Pipeline", cRedis);
+    rb_define_method(cRedisPipeline, "initialize", Pipeline_initialize, 1);
+    rb_define_method(cRedisPipeline, "execute", Pipeline_execute, 0);
+
+    cRedisTransaction = rb_define_class_under(cRedis, "Transaction", cRedisPipeline);
+    rb_define_method(cRedisTransaction, "initialize", Transaction_initialize, 1);
+    rb_define_method(cRedisTransaction, "execute", Transaction_execute, 0);
+
+    cRedisSubscriber = rb_define_class_under(cRedis, "Subscriber", rb_cObject);
+    rb_define_alloc_func(cRedisSubscriber, Subscriber_alloc);
+    rb_define_method(cRedisSubscriber, "initialize", Subscriber_initialize, 1);
+    rb_define_method(cRedisSubscriber, "subscribe", Subscriber_subscribe, -1);
+    rb_define_method(cRedisSubscriber, "unsubscribe", Subscriber_unsubscribe, -1);
+    rb_define_method(cRedisSubscriber, "psubscribe", Subscriber_psubscribe, -1);
+    rb_define_method(cRedisSubscriber, "punsubscribe", Subscriber_punsubscribe, -1);
+    rb_define_method(cRedisSubscriber, "subscriptions", Subscriber_subscriptions, 0);
+    rb_define_method(cRedisSubscriber, "each", Subscriber_each, -1);
+    rb_define_method(cRedisSubscriber, "close", Subscriber_close, 0);
+
+    cRedisFuture = rb_define_class_under(cRedis, "Future", rb_cObject);
+    rb_define_method(cRedisFuture, "value", Future_value, 0);
+    rb_define_method(cRedisFuture, "ready?", Future_ready, 0);
+
+    cConditionVariable = rb_path2class("Thread::ConditionVariable");
+    cRedisAsync = rb_define_class_under(cRedis, "Async", rb_cObject);
+    rb_define_method(cRedisAsync, "close", Async_close, 0);
+    for(i = 0; i < COMMAND_COUNT; i++)
+        rb_define_method(cRedisAsync, command_table[i].method, Async_command, -1);
 
-    rb_define_method(cRedis, "quit", Redis_quit, 0);
-    rb_define_method(cRedis, "auth", Redis_auth, 1);
-
-    rb_define_method(cRedis, "exists?", Redis_exists, 1);
-    rb_define_method(cRedis, "del", Redis_del, 1);
-    rb_define_method(cRedis, "type", Redis_type, 1);
-    rb_define_method(cRedis, "keys", Redis_keys, 1);
-    rb_define_method(cRedis, "random_key", Redis_random_key, 0);
-    rb_define_method(cRedis, "rename", Redis_rename, 2);
-    rb_define_method(cRedis, "renamenx", Redis_renamenx, 2);
-    rb_define_method(cRedis, "dbsize", Redis_dbsize, 0);
-    rb_define_method(cRedis, "expire", Redis_expire, 2);
-    rb_define_method(cRedis, "expire_at", Redis_expire_at, 2);
-    rb_define_method(cRedis, "ttl", Redis_ttl, 1);
-    rb_define_method(cRedis, "select", Redis_select, 1);
-    rb_define_method(cRedis, "move", Redis_move, 2);
-    rb_define_method(cRedis, "flush_db", Redis_flush_db, 0);
-    rb_define_method(cRedis, "flush_all", Redis_flush_all, 0);
-
-    rb_define_method(cRedis, "set", Redis_set, 2);
-    rb_define_method(cRedis, "get", Redis_get, 1);
-    rb_define_method(cRedis, "getset", Redis_get_set, 2);
-    rb_define_method(cRedis, "setnx", Redis_setnx, 2);
-    rb_define_method(cRedis, "incr", Redis_incr, 1);
-    rb_define_method(cRedis, "incrby", Redis_incrby, 2);
-    rb_define_method(cRedis, "decr", Redis_decr, 1);
-    rb_define_method(cRedis, "decrby", Redis_decrby, 2);
-
-    rb_define_method(cRedis, "rpush", Redis_rpush, 2);
-    rb_define_method(cRedis, "lpush", Redis_lpush, 2);
-    rb_define_method(cRedis, "llen", Redis_llen, 1);
-    rb_define_method(cRedis, "lrange", Redis_lrange, 3);
-    rb_define_method(cRedis, "ltrim", Redis_ltrim, 3);
-    rb_define_method(cRedis, "lindex", Redis_lindex, 2);
-    rb_define_method(cRedis, "lset", Redis_lset, 3);
-    rb_define_method(cRedis, "lrem", Redis_lrem, 3);
-    rb_define_method(cRedis, "lpop", Redis_lpop, 1);
-    rb_define_method(cRedis, "rpop", Redis_rpop, 1);
-    rb_define_method(cRedis, "rpoplpush", Redis_rpoplpush, 2);
-
-    rb_define_method(cRedis, "sadd", Redis_sadd, 2);
-    rb_define_method(cRedis, "srem", Redis_srem, 2);
-    rb_define_method(cRedis, "spop", Redis_spop, 1);
-    rb_define_method(cRedis, "smove", Redis_smove, 3);
-    rb_define_method(cRedis, "scard", Redis_scard, 1);
-    rb_define_method(cRedis, "sismember", Redis_sismember, 2);
-    rb_define_method(cRedis, "srandmember", Redis_srandmember, 1);
-
-    rb_define_method(cRedis, "zadd", Redis_zadd, 3);
-    rb_define_method(cRedis, "zrem", Redis_zrem, 2);
-    rb_define_method(cRedis, "zincrby", Redis_zincrby, 3);
-    rb_define_method(cRedis, "zrank", Redis_zrank, 2);
-    rb_define_method(cRedis, "zrevrank", Redis_zrevrank, 2);
-    rb_define_method(cRedis, "zcard", Redis_zcard, 1);
-    rb_define_method(cRedis, "zscore", Redis_zscore, 2);
-    rb_define_method(cRedis, "zremrangebyrank", Redis_zremrangebyrank, 3);
-    rb_define_method(cRedis, "zremrangebyscore", Redis_zremrangebyscore, 3);
+    id_value = rb_intern("@value");
+    id_ready = rb_intern("@ready");
+    id_async = rb_intern("@async");
+    id_redis = rb_intern("@redis");
+    id_lock = rb_intern("@lock");
+    id_work = rb_intern("@work");
+    id_done = rb_intern("@done");
+    id_pending = rb_intern("@pending");
+    id_thread = rb_intern("@thread");
+    id_closed = rb_intern("@closed");
+    id_wait = rb_intern("wait");
+    id_signal = rb_intern("signal");
+    id_broadcast = rb_intern("broadcast");
+    id_read = rb_intern("read");
+    id_write = rb_intern("write");
 
+    id_errors = rb_intern("@errors");
+    id_result = rb_intern("@result");
 
     cRedisError = rb_define_class("RedisError", rb_eStandardError);
+    cRedisConnectionError = rb_define_class("RedisConnectionError", cRedisError);
+    cRedisTimeoutError = rb_define_class("RedisTimeoutError", cRedisError);
+    cRedisPartialError = rb_define_class("RedisPartialError", cRedisError);
+    rb_define_attr(cRedisPartialError, "errors", 1, 0);
+    rb_define_attr(cRedisPartialError, "result", 1, 0);
 }
@@ -2,170 +2,320 @@
 
 #define CRLF "\r\n"
 
+#define DEFAULT_PORT 6379
+#define DEFAULT_WEIGHT 100
+#define DEFAULT_POOL_SIZE 1
+#define DEFAULT_TIMEOUT 500             /* milliseconds */
+#define DEFAULT_CONNECT_TIMEOUT 1000
+#define DEFAULT_RECONNECT_ATTEMPTS 1
+#define DEFAULT_RECONNECT_DELAY 0.05    /* seconds */
+#define MAX_RECONNECT_DELAY 1.0
+
+#define STATS_BUCKETS 32
+
+/* Counters kept per command name when stats are enabled. Latencies go into
+   bucket n when they took less than 2^n microseconds. */
 typedef struct {
-    Module * module;
-    Connection * connection;
-    VALUE connection_string;
-} Redis;
+    unsigned long long calls;
+    unsigned long long failures;
+    unsigned long long timeouts;
+    unsigned long long nanoseconds;
+    unsigned long long histogram[STATS_BUCKETS];
+} CommandStats;
+
+typedef struct {
+    unsigned long long bytes_written;
+    unsigned long long bytes_read;      /* payload of the replies */
+    unsigned long long error_replies;
+    CommandStats * commands;            /* indexed by command id */
+    int command_count;
+} Stats;
+
+#define DEFAULT_CACHE_BYTES (16 * 1024 * 1024)
+
+/* A slot of the near cache. Values are frozen strings, handed out to every
+   caller as they are. */
+typedef struct {
+    VALUE key;
+    VALUE value;                /* Qundef while the slot is free */
+    size_t bytes;
+    unsigned long long expires; /* monotonic nanoseconds, 0 for never */
+    int referenced;             /* since the clock hand last passed */
+} CacheEntry;
+
+typedef struct {
+    VALUE index;                /* key => slot */
+    CacheEntry * entries;
+    long capacity;
+    long used;                  /* slots handed out so far */
+    long * free;                /* slots freed again */
+    long free_count;
+    long hand;
+    size_t bytes;
+    size_t max_bytes;
+    unsigned long long ttl;     /* nanoseconds, 0 for none */
+    unsigned long long generation;  /* bumped by every write */
+    unsigned long long hits;
+    unsigned long long misses;
+    unsigned long long evictions;
+    unsigned long long invalidations;
+} Cache;
+
+/* A script registered with Redis#register_script */
+typedef struct {
+    VALUE sha;
+    VALUE source;
+    char * loaded;              /* per node, set once the script is known to be in its cache */
+    unsigned long version;      /* changes whenever the name gets another script */
+} Script;
+
+typedef struct {
+    VALUE index;                /* name => position in entries */
+    Script * entries;
+    long count;
+    unsigned long versions;
+} Scripts;
+
+/* How values of the commands flagged CODEC are turned into what is stored:
+   serialized when there is a serializer, and compressed when they are at
+   least threshold bytes long. Either way they get a header, see
+   Codec_encode; values without one are read as plain strings. */
+typedef struct {
+    VALUE serializer;           /* nil to store strings as they are */
+    ID dump;
+    ID load;
+    int compression;            /* CODEC_ZLIB, CODEC_LZ or 0 */
+    long threshold;
+} Codec;
+
+#define CODEC_MAGIC "\xC0\xDE"
+#define CODEC_HEADER_SIZE 3     /* the magic and the flags */
+#define CODEC_LENGTH_SIZE 4     /* the length before compression, if compressed */
+#define CODEC_SERIALIZED 1
+#define CODEC_ZLIB 2
+#define CODEC_LZ 4
+#define DEFAULT_COMPRESS_THRESHOLD 1024
 
 typedef struct {
     char * data;
     ReplyType reply_type;
     size_t length;
-    Executor * executor;
+    Batch * batch;              /* to read the elements of a multibulk reply */
+    Stats * stats;
+    Codec * codec;
 } Reply;
 
-#define FUNCTION_LINE_NOARGS(method)            \
-    static VALUE Redis_##method(VALUE self)
+typedef VALUE (*ReplyHandler)(Reply *);
+
+typedef struct {
+    ReplyHandler handler;
+    int node;                   /* -1 when the command went to every node */
+    long script;                /* position of the script it runs, or -1 */
+    unsigned long version;      /* of that script */
+} QueuedReply;
+
+/* A command of the command table, see commands.h */
+typedef struct {
+    const char * name;
+    const char * method;
+    const char * arguments;
+    ReplyHandler handler;
+    int flags;
+    VALUE (*function)(int, VALUE *, VALUE);
+
+    /* Filled in when the extension is loaded */
+    int id;
+    int min_args;
+    int max_args;               /* UNLIMITED_ARGUMENTS with a trailing * */
+    char * header;              /* "*3\r\n$3\r\nSET\r\n", without the count if variadic */
+    long header_length;
+} CommandSpec;
+
+/* How connections are used, see Redis_initialize */
+typedef struct {
+    int timeout;                /* of a round trip, in milliseconds */
+    int connect_timeout;        /* likewise, of making a connection */
+    int nodelay;
+    int keepalive;
+    int send_buffer;            /* bytes, 0 for the default of the system */
+    int receive_buffer;
+    int reconnect_attempts;
+    double reconnect_delay;     /* seconds */
+    int db;                     /* -1 until selected */
+    VALUE password;             /* nil for none */
+} ConnectionOptions;
+
+/* A server, and the pool of connections to it. A command checks out one
+   connection per node it is sent to, and returns it as soon as the replies
+   are in. */
+typedef struct Node {
+    char * address;
+    const ConnectionOptions * options;  /* of the instance that made it */
+    pthread_mutex_t lock;
+    pthread_cond_t available;
+    Connection ** idle;
+    int idle_count;
+    int size;
+
+    /* Replicas of a primary, which read only commands are sent to */
+    struct Node * replicas;
+    int replica_count;
+    double latency;             /* moving average of a replica in microseconds, 0 before the first */
+    unsigned long long down_until;  /* monotonic nanoseconds, after a failure */
+
+    /* AUTH and SELECT for connections that have not had them, see Node_set_setup */
+    char * setup;               /* NULL for none */
+    long setup_length;
+    int setup_commands;
+    Connection ** ready;        /* connections that have had the setup */
+    int ready_count;
+
+    VALUE * watchers;           /* threads of the watch blocks holding a connection, only compared */
+    int watcher_count;
+} Node;
+
+/* Commands of different threads queued to go out together, see
+   AutoPipeline_call. Values holds the arguments of each command until it
+   is written, and its reply after that. */
+typedef struct {
+    Batch ** batches;           /* per node */
+    QueuedReply * queue;
+    const CommandSpec ** specs; /* per queued command, NULL once its thread
+                                   stopped waiting before the flush */
+    long queue_length;
+    long queue_capacity;
+    VALUE values;
+    int done;                   /* replies are in */
+    int waiters;                /* threads yet to pick up their reply */
+} AutoFlush;
+
+typedef struct {
+    AutoFlush * filling;        /* NULL until a command is queued */
+    int flushing;               /* a thread is waiting for replies */
+    VALUE mutex;
+    VALUE condition;            /* broadcast when a flush is done */
+} AutoPipeline;
+
+/* The connection held by a Redis#watch block. Commands sent through the
+   watcher and its transactions go over it, so the server sees the WATCH
+   and the EXEC on the same connection. */
+typedef struct {
+    int node;
+    Connection * connection;
+    int active;                 /* WATCH sent, no EXEC since */
+    int aborted;                /* EXEC found a watched key changed */
+    int broken;
+} Watch;
+
+typedef struct {
+    Module * module;
+    Node * nodes;
+    int connection_count;
+    Ketama * ketama;            /* only used with more than one server */
+    VALUE connection_strings;
+    Stats * stats;              /* NULL unless enabled, shared with pipelines */
+    Cache * cache;              /* likewise */
+    Scripts * scripts;          /* shared with pipelines like stats */
+    Codec * codec;              /* likewise, NULL unless configured */
+    AutoPipeline * auto_pipeline;   /* likewise, NULL unless enabled */
+    int replicated;             /* some node has replicas */
+    ConnectionOptions options;
+    Watch * watch;              /* only set for the watcher of a watch block */
+
+    /* Pipeline state. A pipeline borrows the connections of its parent and
+       queues commands into one batch per node until it is executed. */
+    VALUE parent;
+    int pipelined;
+    Batch ** batches;
+    QueuedReply * queue;
+    long queue_length;
+    long queue_capacity;
+    VALUE futures;
+} Redis;
+
+/* A connection of a subscriber. libredis expects one reply per command
+   it sends, while a subscriber gets messages pushed at any time, so these
+   are plain sockets with a read buffer of their own. */
+typedef struct {
+    int fd;                     /* -1 until something is subscribed on the node */
+    char * buffer;
+    long size;
+    long start;                 /* of the data not parsed yet */
+    long end;
+    long subscriptions;         /* as last reported by the server */
+} SubscriberNode;
+
+typedef struct {
+    VALUE redis;
+    SubscriberNode * nodes;
+    int node_count;
+    int wakeup[2];              /* written to stop waiting for messages */
+    int running;
+    int closed;
+} Subscriber;
+
+#define SUBSCRIBER_BUFFER_SIZE (64 * 1024)
+
+#define DEFAULT_LOAD_WINDOW 4
+#define DEFAULT_LOAD_CHUNK_SIZE 1000
+#define DEFAULT_LOAD_CHUNK_BYTES (1024 * 1024)
+
+/* The nodes a single command is written to, and the batch for each of them */
+typedef struct {
+    Batch ** batches;
+    Batch ** fallbacks;         /* a copy for the primaries, when sent to replicas */
+    int first;
+    int last;
+    int node;
+    int id;                     /* see Command_id */
+    Stats * stats;
+    Cache * cache;
+} Command;
 
-#define FUNCTION_LINE_1ARG(method, arg_name)                \
-    static VALUE Redis_##method(VALUE self, VALUE arg_name)
+#define READ_ONLY 1
+#define CODEC 2                 /* values go through the codec */
 
-#define FUNCTION_LINE_2ARGS(method, arg1_name, arg2_name)               \
-    static VALUE Redis_##method(VALUE self, VALUE arg1_name, VALUE arg2_name)
 
-#define FUNCTION_LINE_3ARGS(method, arg1_name, arg2_name, arg3_name)    \
-    static VALUE Redis_##method(VALUE self, VALUE arg1_name, VALUE arg2_name, VALUE arg3_name)
+/* For commands written by hand */
 
+#define COMMAND_BATCHES(redis, cmd)                                     \
+    (cmd).batches = (redis)->pipelined ? (redis)->batches : ALLOCA_N(Batch *, (redis)->connection_count); \
+    (cmd).fallbacks = (redis)->replicated && !(redis)->pipelined ? ALLOCA_N(Batch *, (redis)->connection_count) : NULL
 
-#define SETUP(command)                                                  \
+#define SETUP(command, key)                                             \
+    static int command_id = -1;                                         \
     Redis * redis;                                                      \
-    Data_Get_Struct(self, Redis, redis);                                \
-    Batch * batch = Batch_new();                                        \
-    Batch_write(batch, #command " ", (int) (sizeof(#command " ") - 1), 0)
-
-
-#define WRITE_CRLF()                                \
-    Batch_write(batch, CRLF, sizeof(CRLF) - 1, 0)
-
-#define WRITE_SPACE()                           \
-    Batch_write(batch, " ", 1, 0)
-
-#define WRITE_INT(a)                        \
-    Batch_write_decimal(batch, FIX2LONG(a))
-
-#define WRITE_STRING(a)                                 \
-    Batch_write(batch, RSTRING_PTR(a), RSTRING_LEN(a), 0)
-
-#define WRITE_BLOB(a)                                       \
-    Batch_write_decimal(batch, RSTRING_LEN(a));             \
-    WRITE_CRLF();                                           \
-    Batch_write(batch, RSTRING_PTR(a), RSTRING_LEN(a), 0)
-
-#define FINISH_BATCH() \
-    Batch_write(batch, CRLF, (sizeof(CRLF) - 1), 1)
-
-
-#define RUN_EXECUTE()                                                   \
-    Executor * executor = Executor_new();                               \
-    Executor_add(executor, redis->connection, batch);                   \
-    if(Executor_execute(executor, 500) <= 0) {                          \
-        char * error = Module_last_error(redis->module);                \
-        rb_raise(cRedisError, error);                                   \
-    }
-
-#define GET_REPLY()                                                     \
-    Reply * reply = Reply_new();                                        \
-    reply->executor = executor;                                         \
-    Batch_next_reply(batch, &(reply->reply_type), &(reply->data), &(reply->length))
-
-#define CLEANUP() \
-    Reply_free(reply); \
-    Batch_free(batch)
-
-
-/* Argument types */
-
-#define STR(arg_name)                           \
-    WRITE_STRING(arg_name)
-
-#define INT(arg_name)                           \
-    WRITE_INT(arg_name)
-
-#define BLOB(arg_name)                          \
-    WRITE_BLOB(arg_name)
-
-
-/* Return macros */
-
-#define ANY                                     \
-    VALUE ret = return_value(reply)
-
-#define BOOLEAN                                                    \
-    VALUE ret;                                                      \
-    switch(reply->reply_type) {                                     \
-    case RT_INTEGER:                                                \
-        ret = *(reply->data) == '0' ? Qfalse : Qtrue;               \
-        break;                                                      \
-    case RT_ERROR:                                                  \
-        rb_raise(cRedisError, reply->data);                         \
-        break;                                                      \
-    default:                                                        \
-        rb_raise(cRedisError, "Unexpected return type from Redis"); \
-    }
-
-#define STATUS                                                      \
-    VALUE ret;                                                      \
-    switch(reply->reply_type) {                                     \
-    case RT_OK:                                                     \
-        ret = Qtrue;                                                \
-        break;                                                      \
-    case RT_INTEGER:                                                \
-        /* This is retarded */                                      \
-        ret = *(reply->data) == '0' ? Qfalse : Qtrue;               \
-        break;                                                      \
-    case RT_ERROR:                                                  \
-        rb_raise(cRedisError, reply->data);                         \
-        break;                                                      \
-    default:                                                        \
-        rb_raise(cRedisError, "Unexpected return type from Redis"); \
-    }
-
-#define INTEGER \
-    VALUE ret = INT2FIX(atoi(reply->data))
-
-#define EXECUTE(return_body)                    \
-    FINISH_BATCH();                             \
-    RUN_EXECUTE();                              \
-    GET_REPLY();                                \
-    return_body;                                \
-    CLEANUP()
-
-/* Function prototypes */
-
-#define REDIS_CMD_0(command, method, return_body)           \
-    FUNCTION_LINE_NOARGS(method) {                          \
-        SETUP(command);                                     \
-        EXECUTE(return_body);                               \
-        return ret;                                         \
-    }
-
-#define REDIS_CMD_1(command, method, arg_type, return_body) \
-    FUNCTION_LINE_1ARG(method, a) {                         \
-        SETUP(command);                                     \
-        arg_type(a);                                        \
-        EXECUTE(return_body);                               \
-        return ret;                                         \
-    }
-
-#define REDIS_CMD_2(command, method, arg1_type, arg2_type, return_body) \
-    FUNCTION_LINE_2ARGS(method, a, b) {                                 \
-        SETUP(command);                                                 \
-        arg1_type(a);                                                   \
-        WRITE_SPACE();                                                  \
-        arg2_type(b);                                                   \
-        EXECUTE(return_body);                                           \
-        return ret;                                                     \
-    }
-
-#define REDIS_CMD_3(command, method, arg1_type, arg2_type, arg3_type, return_body) \
-    FUNCTION_LINE_3ARGS(method, a, b, c) {                              \
-        SETUP(command);                                                 \
-        arg1_type(a);                                                   \
-        WRITE_SPACE();                                                  \
-        arg2_type(b);                                                   \
-        WRITE_SPACE();                                                  \
-        arg3_type(c);                                                   \
-        EXECUTE(return_body);                                           \
-        return ret;                                                     \
-    }
+    TypedData_Get_Struct(self, Redis, &redis_type, redis);              \
+    Command cmd;                                                        \
+    if(command_id < 0)                                                  \
+        command_id = Command_id(#command);                              \
+    COMMAND_BATCHES(redis, cmd);                                        \
+    Command_init(redis, &cmd, command_id, key)
+
+#define FOR_EACH_NODE()                                                 \
+    for(cmd.node = cmd.first; cmd.node <= cmd.last; cmd.node++)
+
+/* Binary safe multibulk requests, for commands with any number of arguments */
+
+#define WRITE_MULTIBULK(command, argc)                                  \
+    write_multibulk_header(&cmd, (argc) + 1);                           \
+    write_bulk(&cmd, #command, sizeof(#command) - 1)
+
+#define FINISH_MULTIBULK() \
+    Command_write(&cmd, NULL, 0, 1)
+
+#define EXECUTE(reply_handler)                          \
+    return Command_execute(redis, &cmd, reply_handler)
+
+
+/* Return types */
+
+#define ANY return_value
+
+#define BOOLEAN return_boolean
+
+#define STATUS return_status
+
+#define DOUBLE return_double
+
+#define DECODED return_decoded
@@ -1,5 +1,11 @@
+require 'socket'
+require 'stringio'
+require 'digest/sha1'
 require File.join(File.dirname(__FILE__), '..', 'ext', 'redis')
 
+# Keeps a server from answering anyone else for 300ms
+BUSY_SCRIPT = "local s = redis.call('TIME') repeat local t = redis.call('TIME') until (t[1] - s[1]) * 1000000 + t[2] - s[2] > 300000 return 1"
+
 describe 'Redis' do
   it 'exists' do
     defined?(Redis).should be_true
@@ -9,6 +15,77 @@ describe 'Redis' do
     Redis.new('127.0.0.1:6379')
   end
 
+  it 'accepts a pool size on initialize' do
+    Redis.new('127.0.0.1:6379', :pool_size => 4)
+  end
+
+  it 'accepts a list of weighted servers on initialize' do
+    Redis.new(['127.0.0.1:6379', ['127.0.0.1:6380', 200]])
+  end
+
+  describe 'with several servers' do
+    before :each do
+      @redis = Redis.new(['127.0.0.1:6379', '127.0.0.1:6380'])
+      @redis.flush_all
+    end
+
+    it 'returns every connection string' do
+      @redis.connections.should == ['127.0.0.1:6379', '127.0.0.1:6380']
+    end
+
+    it 'spreads keys over the servers' do
+      100.times { |i| @redis.set("key_#{i}", i.to_s) }
+      Redis.new('127.0.0.1:6379').dbsize.should > 0
+      Redis.new('127.0.0.1:6380').dbsize.should > 0
+      @redis.dbsize.should == 100
+      @redis.get('key_42').should == '42'
+    end
+
+    it 'pipelines commands for several servers' do
+      @redis.pipelined do |p|
+        10.times { |i| p.set("key_#{i}", i.to_s) }
+        10.times { |i| p.get("key_#{i}") }
+      end.last(10).should == (0...10).map { |i| i.to_s }
+    end
+
+    it 'refuses commands with keys on different servers' do
+      100.times { |i| @redis.set("key_#{i}", i.to_s) }
+      first = Redis.new('127.0.0.1:6379')
+      here, there = (0...100).map { |i| "key_#{i}" }.partition { |key| first.exists?(key) }
+      lambda { @redis.rename(here.first, there.first) }.should raise_error(RedisError)
+    end
+
+    it 'splits mget, mset and del up by server' do
+      keys = (0...100).map { |i| "key_#{i}" }
+      @redis.mset(Hash[keys.map { |key| [key, key.upcase] }]).should be_true
+      @redis.mget(*keys).should == keys.map { |key| key.upcase }
+      @redis.del(*keys).should == 100
+    end
+
+    it 'sends bulk loaded commands without a key to every server' do
+      @redis.set('foo', 'bar')
+      Redis.new('127.0.0.1:6380').set('bar', 'foo')
+      @redis.bulk_load([[:flushdb]])[:commands].should == 2
+      @redis.dbsize.should == 0
+    end
+
+    it 'routes Symbol keys of mset like the strings they are sent as' do
+      keys = (0...20).map { |i| :"key_#{i}" }
+      @redis.mset(Hash[keys.map { |key| [key, key.to_s.upcase] }]).should be_true
+      @redis.mget(*keys.map { |key| key.to_s }).should == keys.map { |key| key.to_s.upcase }
+    end
+
+    it 'answers for the servers that are up' do
+      down = Redis.new(['127.0.0.1:6379', '127.0.0.1:6389'])
+      keys = (0...100).map { |i| "key_#{i}" }
+      keys.each { |key| Redis.new('127.0.0.1:6379').set(key, 'up') }
+      values = down.mget(*keys)
+      values.grep(RedisError).should_not be_empty
+      values.grep(String).uniq.should == ['up']
+      lambda { down.del(*keys) }.should raise_error(RedisPartialError)
+    end
+  end
+
   describe 'instance method' do
     before :each do
       @redis = Redis.new('127.0.0.1:6379')
@@ -21,6 +98,432 @@ describe 'Redis' do
       end
     end
 
+    describe :pipelined do
+      it 'returns the results of all queued commands in order' do
+        @redis.pipelined do |p|
+          p.set('foo', 'bar')
+          p.incr('counter')
+          p.get('foo')
+        end.should == ['OK', 1, 'bar']
+      end
+
+      it 'fills in futures once the pipeline has executed' do
+        future = nil
+        @redis.pipelined do |p|
+          p.set('foo', 'bar')
+          future = p.get('foo')
+          future.ready?.should == false
+        end
+        future.value.should == 'bar'
+      end
+
+      it 'does not send anything before the block returns' do
+        @redis.pipelined do |p|
+          p.set('foo', 'bar')
+          @redis.exists?('foo').should == false
+        end
+        @redis.exists?('foo').should == true
+      end
+    end
+
+    describe Redis::Pipeline do
+      it 'queues commands until execute is called' do
+        pipeline = Redis::Pipeline.new(@redis)
+        pipeline.set('foo', 'bar')
+        pipeline.get('foo')
+        pipeline.execute.should == ['OK', 'bar']
+        pipeline.execute.should == []
+      end
+    end
+
+    describe 'with replicas' do
+      it 'sends read only commands to a replica' do
+        redis = Redis.new('127.0.0.1:6379', :replicas => ['127.0.0.1:6379'])
+        redis.set('foo', 'bar')
+        redis.replicas.first[:latency].should be_nil
+        redis.get('foo').should == 'bar'
+        redis.replicas.first[:latency].should be_kind_of(Float)
+      end
+
+      it 'falls back to the primary when a replica fails' do
+        redis = Redis.new('127.0.0.1:6379', :replicas => ['127.0.0.1:6398'])
+        @redis.set('foo', 'bar')
+        redis.get('foo').should == 'bar'
+        redis.replicas.first[:up].should == false
+      end
+
+      it 'walks scans on the primary, where their cursors hold' do
+        redis = Redis.new('127.0.0.1:6379', :replicas => ['127.0.0.1:6379'])
+        keys = (0...50).map { |i| "key_#{i}" }
+        keys.each { |key| redis.set(key, key) }
+        redis.scan_each(:count => 10).to_a.sort.should == keys.sort
+        redis.sscan_each('nothing', :count => 10).to_a.should == []
+        redis.replicas.first[:latency].should be_nil
+      end
+
+      it 'only marks down the replicas that did not answer in time' do
+        redis = Redis.new(['127.0.0.1:6379', '127.0.0.1:6380'], :replicas => [['127.0.0.1:6379'], ['127.0.0.1:6380']], :timeout => 0.1)
+        busy = Redis.new('127.0.0.1:6380')
+        busy.register_script(:busy, BUSY_SCRIPT)
+        blocking = Thread.new { busy.run_script(:busy) }
+        sleep 0.05
+        redis.mget(*(0...50).map { |i| "key_#{i}" })
+        blocking.join
+        redis.replicas.map { |replica| replica[:up] }.should == [true, false]
+      end
+    end
+
+    describe :multi do
+      it 'returns the results of all queued commands in order' do
+        @redis.multi do |t|
+          t.set('foo', 'bar')
+          t.incr('counter')
+          t.get('foo')
+        end.should == ['OK', 1, 'bar']
+      end
+
+      it 'fills in futures once the transaction has executed' do
+        future = nil
+        @redis.multi { |t| future = t.incr('counter') }
+        future.value.should == 1
+      end
+
+      it 'puts errors of single commands in place of their result' do
+        results = @redis.multi do |t|
+          t.set('foo', 'bar')
+          t.lpush('foo', 'baz')
+        end
+        results[0].should == 'OK'
+        results[1].should be_kind_of(RedisError)
+      end
+    end
+
+    describe :watch do
+      it 'runs the block again when a watched key changed' do
+        other = Redis.new('127.0.0.1:6379')
+        runs = 0
+        @redis.watch('counter') do |w|
+          runs += 1
+          value = w.get('counter').to_i
+          other.set('counter', '10') if runs == 1
+          w.multi { |t| t.set('counter', (value + 1).to_s) }
+        end
+        runs.should == 2
+        @redis.get('counter').should == '11'
+      end
+
+      it 'returns the result of the block' do
+        @redis.set('counter', '1')
+        @redis.watch('counter') { |w| w.get('counter') }.should == '1'
+      end
+
+      it 'raises instead of waiting for the connection the block holds' do
+        lambda { @redis.watch('counter') { |w| @redis.get('counter') } }.should raise_error(RedisError)
+        @redis.set('counter', '2')
+        @redis.get('counter').should == '2'
+      end
+    end
+
+    describe :run_script do
+      it 'runs a registered script, loading it where needed' do
+        @redis.register_script(:first_key, 'return KEYS[1]').should == Digest::SHA1.hexdigest('return KEYS[1]')
+        @redis.run_script(:first_key, ['foo'], ['bar']).should == 'foo'
+        @redis.run_script(:first_key, ['foo']).should == 'foo'
+      end
+
+      it 'raises ArgumentError for scripts that were not registered' do
+        lambda { @redis.run_script(:unknown) }.should raise_error(ArgumentError)
+      end
+
+      it 'counts a script as loaded only once a pipeline has run it' do
+        @redis.register_script(:fresh, "return KEYS[1] -- #{rand}")
+        lambda { @redis.pipelined { |p| p.run_script(:fresh, ['foo']) ; raise 'discarded' } }.should raise_error(RuntimeError)
+        @redis.pipelined { |p| p.run_script(:fresh, ['foo']) }.should == ['foo']
+        @redis.pipelined { |p| p.run_script(:fresh, ['bar']) }.should == ['bar']
+      end
+    end
+
+    describe :subscribe do
+      it 'yields the channel and message of every message published' do
+        messages = []
+        thread = Thread.new do
+          Redis.new('127.0.0.1:6379').subscribe('news', 'sport') do |channel, message|
+            messages << [channel, message]
+            break if messages.size == 2
+          end
+        end
+        sleep 0.1
+        @redis.publish('news', 'a').should == 1
+        @redis.publish('weather', 'b').should == 0
+        @redis.publish('sport', 'c').should == 1
+        thread.join
+        messages.should == [['news', 'a'], ['sport', 'c']]
+      end
+    end
+
+    describe Redis::Subscriber do
+      it 'takes channels on and off while running' do
+        subscriber = @redis.subscriber
+        queue = SizedQueue.new(10)
+        subscriber.subscribe('news')
+        thread = Thread.new { subscriber.each(queue) }
+        sleep 0.1
+        subscriber.subscribe('sport')
+        sleep 0.1
+        @redis.publish('sport', 'a')
+        queue.pop.should == ['sport', 'a']
+        subscriber.unsubscribe
+        thread.join.should == thread
+        subscriber.subscriptions.should == 0
+        subscriber.close
+      end
+    end
+
+    describe 'near cache' do
+      before(:each) do
+        @cached = Redis.new('127.0.0.1:6379', :near_cache => { :max_bytes => 1024 * 1024 })
+      end
+
+      it 'answers repeated gets from the cache with the same frozen string' do
+        @cached.set('foo', 'bar')
+        value = @cached.get('foo')
+        value.should be_frozen
+        @cached.get('foo').should equal(value)
+        @cached.near_cache_stats[:hits].should == 1
+      end
+
+      it 'drops keys written through the same instance' do
+        @cached.set('foo', 'bar')
+        @cached.get('foo')
+        @cached.set('foo', 'baz')
+        @cached.get('foo').should == 'baz'
+        @cached.del('foo')
+        @cached.get('foo').should be_nil
+      end
+
+      it 'drops keys when asked to' do
+        @cached.set('foo', 'bar')
+        @cached.get('foo')
+        @redis.set('foo', 'baz')
+        @cached.invalidate('foo')
+        @cached.get('foo').should == 'baz'
+      end
+
+      it 'treats Symbol keys like the strings they are sent as' do
+        @cached.set('foo', 'bar')
+        @cached.get(:foo).should == 'bar'
+        @cached.mset(:foo => 'baz')
+        @cached.get('foo').should == 'baz'
+        @redis.set('foo', 'qux')
+        @cached.invalidate(:foo)
+        @cached.get(:foo).should == 'qux'
+      end
+
+      it 'expires entries after their ttl' do
+        cached = Redis.new('127.0.0.1:6379', :near_cache => { :ttl => 0.01 })
+        cached.set('foo', 'bar')
+        cached.get('foo')
+        @redis.set('foo', 'baz')
+        sleep 0.02
+        cached.get('foo').should == 'baz'
+      end
+    end
+
+    describe 'codec' do
+      it 'serializes values and reads them back' do
+        coded = Redis.new('127.0.0.1:6379', :codec => :marshal)
+        coded.set('foo', { 'a' => [1, 2] })
+        coded.get('foo').should == { 'a' => [1, 2] }
+        coded.mset('bar' => [3], 'baz' => 4)
+        coded.mget('bar', 'baz').should == [[3], 4]
+      end
+
+      it 'compresses values from the threshold on' do
+        compressed = Redis.new('127.0.0.1:6379', :compression => :lz, :compress_threshold => 100)
+        compressed.set('foo', 'x' * 10_000)
+        @redis.get('foo').size.should < 1000
+        compressed.get('foo').should == 'x' * 10_000
+        compressed.set('bar', 'short')
+        @redis.get('bar').should == 'short'
+      end
+
+      it 'still reads values stored without it' do
+        @redis.set('foo', 'bar')
+        Redis.new('127.0.0.1:6379', :codec => :marshal, :compression => :zlib).get('foo').should == 'bar'
+      end
+    end
+
+    describe :bulk_load do
+      it 'sets pairs and sends commands in chunks' do
+        pairs = (0...2500).map { |i| ["key_#{i}", i.to_s] }
+        result = @redis.bulk_load(pairs + [[:rpush, 'list', 'a', 'b']], :window => 2, :chunk_size => 100)
+        result[:commands].should == 2501
+        result[:chunks].should == 26
+        result[:failed].should == 0
+        @redis.get('key_2499').should == '2499'
+        @redis.lrange('list', 0, -1).should == ['a', 'b']
+      end
+
+      it 'reports chunks with errors and goes on' do
+        @redis.rpush('list', 'a')
+        errors = []
+        result = @redis.bulk_load([[:incr, 'list'], ['foo', 'bar']]) { |error| errors << error }
+        result[:failed].should == 1
+        result[:errors].should == errors
+        errors.first[:commands].should == 2
+        @redis.get('foo').should == 'bar'
+      end
+
+      it 'reports entries that cannot be sent and goes on' do
+        result = @redis.bulk_load([[:get], [:nope, 'foo'], ['foo', 'bar']])
+        result[:failed].should == 2
+        result[:errors].map { |error| error[:entry] }.should == [[:get], [:nope, 'foo']]
+        result[:errors].map { |error| error[:server] }.should == [nil, nil]
+        @redis.get('foo').should == 'bar'
+      end
+    end
+
+    describe :async do
+      it 'returns futures that wait for their reply' do
+        @redis.set('foo', 'bar')
+        futures = (0...100).map { @redis.async.get('foo') }
+        futures.map { |future| future.value }.should == ['bar'] * 100
+      end
+
+      it 'can be shared by several threads' do
+        threads = (0...8).map do
+          Thread.new { (0...10).map { @redis.async.incr('count') }.each { |future| future.value } }
+        end
+        threads.each { |thread| thread.join }
+        @redis.get('count').should == '80'
+      end
+
+      it 'raises errors from the future' do
+        @redis.set('foo', 'bar')
+        lambda { @redis.async.rpush('foo', 'baz').value }.should raise_error(RedisError)
+      end
+
+      it 'fails the futures of a background thread that was killed, and starts a new one' do
+        async = @redis.async
+        async.get('foo').value
+        futures = (0...10).map { async.incr('count') }
+        async.instance_variable_get(:@thread).kill
+        futures.map { |future| begin; future.value; rescue RedisError; :failed; end }.size.should == 10
+        async.incr('count').value.should be_kind_of(Integer)
+      end
+    end
+
+    describe 'auto pipelining' do
+      before :each do
+        @auto = Redis.new('127.0.0.1:6379', :auto_pipeline => true)
+      end
+
+      it 'hands every thread its own reply' do
+        (0...20).each { |i| @redis.set("key_#{i}", i.to_s) }
+        threads = (0...20).map do |i|
+          Thread.new { (0...50).map { @auto.get("key_#{i}") }.uniq }
+        end
+        threads.map { |thread| thread.value }.should == (0...20).map { |i| [i.to_s] }
+      end
+
+      it 'runs every command sent by the threads' do
+        threads = (0...8).map { Thread.new { 10.times { @auto.incr('count') } } }
+        threads.each { |thread| thread.join }
+        @redis.get('count').should == '80'
+      end
+
+      it 'raises errors only in the thread whose command failed' do
+        @redis.set('foo', 'bar')
+        failing = Thread.new { @auto.rpush('foo', 'baz') }
+        @auto.get('foo').should == 'bar'
+        lambda { failing.join }.should raise_error(RedisError)
+      end
+
+      it 'never sends the command of a thread interrupted before its turn' do
+        busy = Redis.new('127.0.0.1:6379')
+        busy.register_script(:busy, BUSY_SCRIPT)
+        blocking = Thread.new { busy.run_script(:busy) }
+        sleep 0.05
+        first = Thread.new { @auto.get('foo') }
+        sleep 0.05
+        interrupted = Thread.new { @auto.set('interrupted', '1') }
+        sleep 0.05
+        interrupted.kill.join
+        first.join
+        blocking.join
+        @redis.exists?('interrupted').should == false
+      end
+    end
+
+    describe :allocated_bytes do
+      it 'returns the memory held by libredis' do
+        @redis.allocated_bytes.should be_a(Integer)
+      end
+    end
+
+    describe :stats do
+      it 'returns nil unless stats were enabled' do
+        @redis.stats.should be_nil
+      end
+
+      it 'counts calls, latencies and traffic per command' do
+        redis = Redis.new('127.0.0.1:6379', :stats => true)
+        redis.set('foo', 'bar')
+        2.times { redis.get('foo') }
+        stats = redis.stats
+        stats[:commands]['GET'][:calls].should == 2
+        stats[:commands]['GET'][:histogram].values.inject(:+).should == 2
+        stats[:commands]['SET'][:calls].should == 1
+        stats[:bytes_written].should > 0
+        stats[:bytes_read].should == 'OK'.size + 'bar'.size * 2
+      end
+
+      it 'can be reset' do
+        redis = Redis.new('127.0.0.1:6379', :stats => true)
+        redis.get('foo')
+        redis.reset_stats
+        redis.stats[:commands].should == {}
+      end
+    end
+
+    describe 'threads' do
+      it 'can share an instance and each get their own replies' do
+        threads = (0...8).map do |t|
+          Thread.new do
+            50.times.all? do |i|
+              @redis.set("thread_#{t}", i.to_s)
+              @redis.get("thread_#{t}") == i.to_s
+            end
+          end
+        end
+        threads.map { |thread| thread.value }.should == [true] * 8
+      end
+
+      it 'can share a pool of connections' do
+        redis = Redis.new('127.0.0.1:6379', :pool_size => 2)
+        threads = (0...8).map do |t|
+          Thread.new do
+            50.times.all? do |i|
+              redis.set("thread_#{t}", i.to_s)
+              redis.get("thread_#{t}") == i.to_s
+            end
+          end
+        end
+        threads.map { |thread| thread.value }.should == [true] * 8
+      end
+
+      it 'keeps its connections when threads waiting for one are interrupted' do
+        redis = Redis.new('127.0.0.1:6379', :pool_size => 1)
+        10.times do
+          threads = (0...8).map { Thread.new { 100.times { redis.get('foo') } rescue nil } }
+          threads.each { |thread| thread.raise(RuntimeError) rescue nil }
+          threads.each { |thread| thread.join }
+        end
+        redis.set('foo', 'bar')
+        redis.get('foo').should == 'bar'
+      end
+    end
+
     describe 'connection handling' do
       describe :quit do
         it 'always returns true'
@@ -38,6 +541,42 @@ describe 'Redis' do
       describe :auth do
         # need a better test env before we can test this
       end
+
+      it 'raises a RedisConnectionError when the server is down' do
+        down = Redis.new('127.0.0.1:6389', :timeout => 0.1, :reconnect_attempts => 2, :reconnect_delay => 0.01)
+        lambda { down.get('foo') }.should raise_error(RedisConnectionError)
+      end
+
+      it 'sends only reads again when their connection was dropped' do
+        server = TCPServer.new('127.0.0.1', 0)
+        received = 0
+        thread = Thread.new { loop { socket = server.accept ; socket.readpartial(1024) ; received += 1 ; socket.close } }
+        dropping = Redis.new("127.0.0.1:#{server.addr[1]}", :reconnect_attempts => 2, :reconnect_delay => 0.01)
+        lambda { dropping.get('foo') }.should raise_error(RedisConnectionError)
+        received.should == 3
+        lambda { dropping.incr('foo') }.should raise_error(RedisConnectionError)
+        received.should == 4
+        thread.kill
+        server.close
+      end
+
+      it 'connects to unix sockets' do
+        path = "/tmp/redis_spec_#{Process.pid}.sock"
+        server = UNIXServer.new(path)
+        thread = Thread.new { client = server.accept ; client.readpartial(1024) ; client.write("$3\r\nbar\r\n") ; client }
+        begin
+          Redis.new("unix://#{path}").get('foo').should == 'bar'
+          thread.value.close
+        ensure
+          server.close
+          File.unlink(path)
+        end
+      end
+
+      it 'raises a RedisConnectionError when nothing listens on a unix socket' do
+        down = Redis.new('/tmp/redis_spec_nothing.sock', :reconnect_attempts => 0)
+        lambda { down.get('foo') }.should raise_error(RedisConnectionError)
+      end
     end
     
     describe 'basic commands' do
@@ -58,6 +597,13 @@ describe 'Redis' do
           @redis.del('foo')
           @redis.exists?('foo').should == false
         end
+
+        it 'removes several keys at once' do
+          @redis.incr('foo')
+          @redis.incr('bar')
+          @redis.del('foo', 'bar', 'baz').should == 2
+          @redis.dbsize.should == 0
+        end
       end
       
       describe :type do
@@ -72,13 +618,31 @@ describe 'Redis' do
       end
 
       describe :keys do
-        it 'returns a space separated list of keys' do
+        it 'returns an array of matching keys' do
           @redis.set('keys_a', '1')
           @redis.set('keys_b', '1')
           @redis.set('keys_c', '1')
           @redis.keys('keys_?').should == ['keys_a', 'keys_b', 'keys_c']
         end
       end
+
+      describe :scan_each do
+        it 'yields every matching key a page at a time' do
+          20.times { |i| @redis.set("scan_#{i}", '1') }
+          @redis.set('other', '1')
+          @redis.scan_each(:match => 'scan_*', :count => 3).to_a.sort.should == (0...20).map { |i| "scan_#{i}" }.sort
+        end
+
+        it 'returns a lazy enumerator' do
+          20.times { |i| @redis.set("scan_#{i}", '1') }
+          @redis.scan_each(:count => 3).lazy.first(2).size.should == 2
+        end
+
+        it 'prefetches the next page when asked to' do
+          20.times { |i| @redis.set("scan_#{i}", '1') }
+          @redis.scan_each(:match => 'scan_*', :count => 3, :prefetch => true).to_a.size.should == 20
+        end
+      end
       
       describe :random_key do
         it 'returns an empty string if no keys exist' do
@@ -173,6 +737,24 @@ describe 'Redis' do
           @redis.select(1)
           @redis.exists?('foo').should == false
         end
+
+        it 'selects the db on every connection of the pool' do
+          pooled = Redis.new('127.0.0.1:6379', :pool_size => 4)
+          pooled.select(1)
+          threads = (0...8).map { |i| Thread.new { 10.times { |j| pooled.set("key_#{i}_#{j}", 'x') } } }
+          threads.each { |thread| thread.join }
+          Redis.new('127.0.0.1:6379', :db => 1).dbsize.should == 80
+          Redis.new('127.0.0.1:6379', :db => 0).dbsize.should == 0
+        end
+
+        it 'cannot be pipelined' do
+          lambda { @redis.pipelined { |pipeline| pipeline.select(1) } }.should raise_error(RedisError)
+        end
+
+        it 'checks the primary even with replicas' do
+          redis = Redis.new('127.0.0.1:6389', :replicas => ['127.0.0.1:6379'])
+          lambda { redis.select(1) }.should raise_error(RedisConnectionError)
+        end
       end
       
       describe :move do
@@ -239,6 +821,74 @@ describe 'Redis' do
         end
       end
       
+      describe :mget do
+        it 'retrieves the values of several keys' do
+          @redis.set('a', '1')
+          @redis.set('b', '2')
+          @redis.mget('a', 'b', 'c').should == ['1', '2', nil]
+        end
+      end
+
+      describe :mset do
+        it 'sets several keys to their values' do
+          @redis.mset('a' => '1', 'b' => "binary\r\n\0").should == true
+          @redis.get('a').should == '1'
+          @redis.get('b').should == "binary\r\n\0"
+        end
+      end
+
+      describe :set_from_io do
+        it 'sets a key to a value read from an IO' do
+          value = 'x' * 100_000
+          @redis.set_from_io('my_key', StringIO.new(value), value.size).should == true
+          @redis.get('my_key').should == value
+        end
+
+        it 'raises and sets nothing if the IO runs out' do
+          lambda { @redis.set_from_io('my_key', StringIO.new('abc'), 10) }.should raise_error(EOFError)
+          @redis.exists?('my_key').should == false
+        end
+
+        it 'raises and sets nothing if the IO reads more than it was asked for' do
+          io = StringIO.new('abc')
+          def io.read(length, buffer = nil) 'abcdef' end
+          lambda { @redis.set_from_io('my_key', io, 3) }.should raise_error(IOError)
+          @redis.exists?('my_key').should == false
+        end
+
+        it 'refuses to bypass a codec' do
+          coded = Redis.new('127.0.0.1:6379', :codec => :marshal)
+          lambda { coded.set_from_io('my_key', StringIO.new('abc'), 3) }.should raise_error(ArgumentError)
+          lambda { coded.get_to_io('my_key', StringIO.new) }.should raise_error(ArgumentError)
+          lambda { coded.get_stream('my_key') { } }.should raise_error(ArgumentError)
+        end
+      end
+
+      describe :get_to_io do
+        it 'writes the value of a key to an IO' do
+          value = 'x' * 100_000
+          io = StringIO.new
+          @redis.set('my_key', value)
+          @redis.get_to_io('my_key', io).should == value.size
+          io.string.should == value
+        end
+
+        it 'returns nil if the key does not exist' do
+          @redis.get_to_io('my_key', StringIO.new).should be_nil
+        end
+      end
+
+      describe :get_stream do
+        it 'yields the value of a key in chunks' do
+          value = 'x' * 100_000
+          @redis.set('my_key', value)
+          chunks = []
+          @redis.get_stream('my_key') { |chunk| chunks << chunk.dup }
+          chunks.size.should > 1
+          chunks.join.should == value
+        end
+      end
+
       describe :getset do
         it 'sets a key to a value and return the previous value' do
           @redis.set('my_key', 'a')
@@ -261,6 +911,24 @@ describe 'Redis' do
           @redis.incrby('incr_test', 2).should == 2
           @redis.get('incr_test').should == '2'
         end
+
+        it 'sends integers too big for a Fixnum' do
+          @redis.set('incr_test', '0')
+          @redis.incrby('incr_test', 2 ** 62)
+          @redis.get('incr_test').should == (2 ** 62).to_s
+        end
+
+        it 'returns integers too big for a Fixnum' do
+          @redis.set('incr_test', (2 ** 62).to_s)
+          @redis.incrby('incr_test', 2 ** 62).should == 2 ** 63
+        end
+      end
+
+      describe :incrbyfloat do
+        it 'increments the value of a key by a fraction' do
+          @redis.set('incr_test', '1')
+          @redis.incrbyfloat('incr_test', 0.5).should == 1.5
+        end
       end
       
       describe :decr do
@@ -287,6 +955,11 @@ describe 'Redis' do
           @redis.rpush('foo','b')
           @redis.lindex('foo', -1).should == 'b'
         end
+
+        it 'adds several values to the tail of a list' do
+          @redis.rpush('foo', 'a', 'b', 'c').should == 3
+          @redis.lrange('foo', 0, -1).should == ['a', 'b', 'c']
+        end
       end
       
       describe :lpush do
@@ -307,7 +980,16 @@ describe 'Redis' do
       end
       
       describe :lrange do
-        it 'returns a subset of the values of a list'
+        it 'returns a subset of the values of a list' do
+          %w(a b c d).each do |x|
+            @redis.rpush('foo', x)
+          end
+          @redis.lrange('foo', 1, 2).should == ['b', 'c']
+        end
+
+        it 'returns an empty array for a nonexistent list' do
+          @redis.lrange('foo', 0, -1).should == []
+        end
       end
       
       describe :ltrim do
@@ -390,6 +1072,11 @@ describe 'Redis' do
           @redis.sadd 'set_test', 'a'
           @redis.sismember('set_test', 'a').should == true
         end
+
+        it 'adds several values to a set' do
+          @redis.sadd('set_test', 'a', 'b', 'c').should == 3
+          @redis.scard('set_test').should == 3
+        end
       end
       
       describe :srem do
@@ -438,31 +1125,67 @@ describe 'Redis' do
       end
       
       describe :sinter do
-        it 'returns the intersection between the given sets'
+        it 'returns the intersection between the given sets' do
+          @redis.sadd('set_a', 'a', 'b')
+          @redis.sadd('set_b', 'b', 'c')
+          @redis.sinter('set_a', 'set_b').should == ['b']
+        end
       end
       
       describe :sinterstore do
-        it 'stores the intersection between the given sets in a new set'
+        it 'stores the intersection between the given sets in a new set' do
+          @redis.sadd('set_a', 'a', 'b')
+          @redis.sadd('set_b', 'b', 'c')
+          @redis.sinterstore('set_c', 'set_a', 'set_b').should == 1
+          @redis.smembers('set_c').should == ['b']
+        end
       end
       
       describe :sunion do
-        it 'returns the union of the given sets'
+        it 'returns the union of the given sets' do
+          @redis.sadd('set_a', 'a', 'b')
+          @redis.sadd('set_b', 'b', 'c')
+          @redis.sunion('set_a', 'set_b').sort.should == ['a', 'b', 'c']
+        end
       end
       
       describe :sunionstore do
-        it 'stores the union of the given sets in a new set'
+        it 'stores the union of the given sets in a new set' do
+          @redis.sadd('set_a', 'a', 'b')
+          @redis.sadd('set_b', 'b', 'c')
+          @redis.sunionstore('set_c', 'set_a', 'set_b').should == 3
+        end
       end
       
       describe :sdiff do
-        it 'returns the difference between the given sets'
+        it 'returns the difference between the given sets' do
+          @redis.sadd('set_a', 'a', 'b')
+          @redis.sadd('set_b', 'b', 'c')
+          @redis.sdiff('set_a', 'set_b').should == ['a']
+        end
       end
       
       describe :sdiffstore do
-        it 'stores the difference between the given sets in a new set'
+        it 'stores the difference between the given sets in a new set' do
+          @redis.sadd('set_a', 'a', 'b')
+          @redis.sadd('set_b', 'b', 'c')
+          @redis.sdiffstore('set_c', 'set_a', 'set_b').should == 1
+        end
       end
       
       describe :smembers do
-        it 'returns all the member of a given set'
+        it 'returns all the member of a given set' do
+          @redis.sadd('set_test', 'a')
+          @redis.sadd('set_test', 'b')
+          @redis.smembers('set_test').sort.should == ['a', 'b']
+        end
+      end
+
+      describe :sscan_each do
+        it 'yields every member of a set' do
+          @redis.sadd('set_test', *(1..20).map(&:to_s))
+          @redis.sscan_each('set_test', :count => 3).to_a.sort_by(&:to_i).should == (1..20).map(&:to_s)
+        end
       end
       
       describe :srandmember do
@@ -516,15 +1239,28 @@ describe 'Redis' do
       end
 
       describe :zrange do
-        it 'returns a range of elements by rank'
+        it 'returns a range of elements by rank' do
+          @redis.zadd('test', 1, 'abc')
+          @redis.zadd('test', 2, 'xyz')
+          @redis.zrange('test', 0, -1).should == ['abc', 'xyz']
+        end
       end
 
       describe :zrevrange do
-        it 'returns a range of elements in reverse by rank'
+        it 'returns a range of elements in reverse by rank' do
+          @redis.zadd('test', 1, 'abc')
+          @redis.zadd('test', 2, 'xyz')
+          @redis.zrevrange('test', 0, -1).should == ['xyz', 'abc']
+        end
       end
 
       describe :zrangebyscore do
-        it 'returns a range of elements with scores between x and y'
+        it 'returns a range of elements with scores between x and y' do
+          @redis.zadd('test', 1, 'a')
+          @redis.zadd('test', 2, 'b')
+          @redis.zadd('test', 3, 'c')
+          @redis.zrangebyscore('test', 2, 3).should == ['b', 'c']
+        end
       end
 
       describe :zcard do
@@ -540,6 +1276,19 @@ describe 'Redis' do
           @redis.zadd('test', 10, 'abc')
           @redis.zscore('test', 'abc').should == 10
         end
+
+        it 'returns fractional scores exactly' do
+          @redis.zadd('test', 0.1, 'abc')
+          @redis.zscore('test', 'abc').should == 0.1
+        end
+      end
+
+      describe :zscan_each do
+        it 'yields every member of a zset with its score' do
+          @redis.zadd('test', 10, 'abc')
+          @redis.zadd('test', 0.5, 'def')
+          @redis.zscan_each('test').to_a.sort.should == [['abc', 10.0], ['def', 0.5]]
+        end
       end
 
       describe :zremrangebyrank do
@@ -571,5 +1320,30 @@ describe 'Redis' do
       describe :zinter
     end
 
+    describe 'hash commands' do
+      describe :hset do
+        it 'sets a field of a hash' do
+          @redis.hset('hash', 'field', 'value')
+          @redis.hget('hash', 'field').should == 'value'
+        end
+      end
+
+      describe :hgetall do
+        it 'returns all fields and values of a hash' do
+          @redis.hset('hash', 'a', '1')
+          @redis.hset('hash', 'b', '2')
+          @redis.hgetall('hash').should == { 'a' => '1', 'b' => '2' }
+        end
+      end
+
+      describe :hscan_each do
+        it 'yields every field of a hash with its value' do
+          @redis.hset('hash', 'a', '1')
+          @redis.hset('hash', 'b', '2')
+          @redis.hscan_each('hash').to_a.sort.should == [['a', '1'], ['b', '2']]
+        end
+      end
+    end
+
   end
 end